@@ -35,6 +35,8 @@ _SHARING_EXTENSION "cl_APPLE_gl_sharing"
 #include <map>
 #include <algorithm>
 #include <functional>
+#include <unordered_map>
+#include <memory>
 
 #ifdef _WIN32
 #include <Windows.h>
@@ -52,6 +54,7 @@ using namespace std;
 #define STRINGIFY(s) #s
 
 #include "intersection.h"
+#include "texture_cache.h"
 
 namespace prototyper
 {
@@ -968,6 +971,15 @@ namespace prototyper
 
     GLuint load_image( const std::string& str )
     {
+      //mipmapped, from the cache if there's one
+      if( texture_cache_current() )
+      {
+        GLuint tex = texture_cache_current()->load( str );
+
+        if( tex )
+          return tex;
+      }
+
       sf::Image im;
       im.loadFromFile( str );
       unsigned w = im.getSize().x;
@@ -1711,100 +1723,186 @@ namespace prototyper
       s.meshes.resize( s.meshes.size() + the_scene->mNumMeshes );
       s.materials.resize( s.materials.size() + the_scene->mNumMeshes );
 
+      //index of every texture in s.textures by filename
+      std::unordered_map<std::string, int> texture_index;
+
+      for( int c = 0; c < s.textures.size(); ++c )
+      {
+        texture_index[s.textures[c].filename] = c;
+      }
+
+      struct texture_load
+      {
+        std::string filename;
+        bool srgb; //of the first material that uses it
+        bool loaded, cached, is_transparent;
+        texture_cache_entry entry;
+        texture_image img;
+      };
+
+      //the textures the materials reference, each once
+      const aiTextureType texture_types[] = { aiTextureType_DIFFUSE, aiTextureType_NORMALS, aiTextureType_SPECULAR };
+      const bool texture_srgb[] = { true, false, true };
+
+      std::vector<std::pair<std::string, bool> > to_load;
+      std::unordered_map<std::string, int> to_load_index;
+
       for( unsigned int c = 0; c < the_scene->mNumMeshes; ++c )
       {
         aiMaterial* mtl = the_scene->mMaterials[the_scene->mMeshes[c]->mMaterialIndex];
 
-        auto grab_texture = [&]( aiTextureType t, std::string& filename, GLuint& tex, bool& trans, bool srgb )
+        for( int t = 0; t < 3; ++t )
         {
-          tex = 0;
-
           aiString texpath;
-          if( mtl->GetTexture( t, 0, &texpath ) == AI_SUCCESS )
+          if( mtl->GetTexture( texture_types[t], 0, &texpath ) == AI_SUCCESS )
           {
             std::string tex_filename = path + texpath.C_Str();
 
-            auto it = std::find_if( s.textures.begin(), s.textures.end(), [&]( const texture& a ) -> bool
+            if( texture_index.find( tex_filename ) == texture_index.end() && to_load_index.find( tex_filename ) == to_load_index.end() )
             {
-              return a.filename == tex_filename;
-            } );
+              to_load_index[tex_filename] = to_load.size();
+              to_load.push_back( std::make_pair( tex_filename, texture_srgb[t] ) );
+            }
+          }
+        }
+      }
+
+      //decoding (or mapping the cached mip chain) is done in parallel, only the uploads are on the GL thread
+      //the finished ones are uploaded and freed while the rest decode, the queue is small and a full queue stalls the workers,
+      //so at most a few decoded images are in memory at once
+      std::unique_ptr<texture_load[]> loads( new texture_load[to_load.size()] );
+
+      int thread_count = std::min( std::max( int( std::thread::hardware_concurrency() ) - 1, 1 ), int( to_load.size() ) );
+      mpsc_queue<int> finished( thread_count * 2 );
+      std::atomic<int> next( 0 );
+      std::vector<std::thread> workers;
 
-            GLuint orig_tex = 0;
-            unsigned miplevels = 0;
-            bool is_transparent = false;
+      for( int t = 0; t < thread_count; ++t )
+      {
+        workers.push_back( std::thread( [&]
+        {
+          for( int c = next++; c < to_load.size(); c = next++ )
+          {
+            auto& l = loads[c];
+            l.filename = to_load[c].first;
+            l.srgb = to_load[c].second;
+            l.cached = texture_cache_current() && texture_cache_current()->acquire( l.filename, TEXTURE_CACHE_RGBA8, l.entry );
 
-            if( it == s.textures.end() )
+            if( l.cached )
             {
-              sf::Image im;
-              if( im.loadFromFile( tex_filename ) )
-              {
-                s.textures.push_back( texture() );
-                glGenTextures( 1, &s.textures.back().texid );
-                orig_tex = s.textures.back().texid;
-                s.textures.back().filename = tex_filename;
-                s.textures.back().miplevels = std::log2( float( std::max( im.getSize().x, im.getSize().y ) ) ) + 1;
-                miplevels = s.textures.back().miplevels;
-                glBindTexture( GL_TEXTURE_2D, s.textures.back().texid );
-                glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT );
-                glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT );
-                glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR );
-                glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR );
-                glTexParameterf( GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, 4 );
-
-                s.textures.back().w = im.getSize().x;
-                s.textures.back().h = im.getSize().y;
-
-                if( srgb )
-                {
-                  glTexStorage2D( GL_TEXTURE_2D, s.textures.back().miplevels, GL_SRGB8_ALPHA8, im.getSize().x, im.getSize().y );
-                  s.textures.back().internal_format = GL_SRGB8_ALPHA8;
-                }
-                else
-                {
-                  glTexStorage2D( GL_TEXTURE_2D, s.textures.back().miplevels, GL_RGBA8, im.getSize().x, im.getSize().y );
-                  s.textures.back().internal_format = GL_RGBA8;
-                }
+              l.loaded = true;
+              l.is_transparent = l.entry.get_header().is_transparent != 0;
+            }
+            else
+            {
+              l.loaded = texture_decode( l.filename, 0, l.img );
+              l.is_transparent = l.loaded && texture_is_transparent( &l.img.mips[0].pixels[0], l.img.mips[0].w * l.img.mips[0].h );
+            }
 
-                glTexSubImage2D( GL_TEXTURE_2D, 0, 0, 0, im.getSize().x, im.getSize().y, GL_RGBA, GL_UNSIGNED_BYTE, im.getPixelsPtr() );
+            while( !finished.push( c ) )
+            {
+              std::this_thread::yield();
+            }
+          }
+        } ) );
+      }
 
-                glGenerateMipmap( GL_TEXTURE_2D );
+      //in the order they finish
+      for( int done = 0; done < to_load.size(); ++done )
+      {
+        int c;
 
-                s.textures.back().is_transparent = false;
+        while( !finished.pop( c ) )
+        {
+          std::this_thread::yield();
+        }
 
-                if( tex_filename.rfind( "vase_plant.png" ) != string::npos )
-                {
-                  int a = 0;
-                }
+        auto& l = loads[c];
 
-                for( unsigned y = 0; y < im.getSize().y; ++y )
-                {
-                  for( unsigned x = 0; x < im.getSize().x; ++x )
-                  {
-                    if( im.getPixel( x, y ).a < 255 )
-                    {
-                      s.textures.back().is_transparent = true;
-                      break;
-                    }
-                  }
+        if( !l.loaded )
+        {
+          std::cerr << "couldn't load texture: " << l.filename << endl;
+          continue;
+        }
 
-                  if( s.textures.back().is_transparent )
-                    break;
-                }
+        texture_index[l.filename] = s.textures.size();
 
-                is_transparent = s.textures.back().is_transparent;
-              }
-              else
-              {
-                std::cerr << "couldn't load texture: " << filename << endl;
-              }
-            }
-            else
+        s.textures.push_back( texture() );
+        auto& tx = s.textures.back();
+
+        glGenTextures( 1, &tx.texid );
+        tx.filename = l.filename;
+        glBindTexture( GL_TEXTURE_2D, tx.texid );
+        glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT );
+        glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT );
+        glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR );
+        glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR );
+        glTexParameterf( GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, 4 );
+
+        tx.internal_format = l.srgb ? GL_SRGB8_ALPHA8 : GL_RGBA8;
+        tx.is_transparent = l.is_transparent;
+
+        if( l.cached )
+        {
+          //the cache has the mip chain
+          auto& h = l.entry.get_header();
+
+          tx.miplevels = h.level_count;
+          tx.w = h.levels[0].w;
+          tx.h = h.levels[0].h;
+
+          glTexStorage2D( GL_TEXTURE_2D, tx.miplevels, tx.internal_format, tx.w, tx.h );
+          l.entry.upload( true );
+          l.entry.close();
+        }
+        else
+        {
+          auto& m = l.img.mips[0];
+
+          tx.miplevels = std::log2( float( std::max( m.w, m.h ) ) ) + 1;
+          tx.w = m.w;
+          tx.h = m.h;
+
+          glTexStorage2D( GL_TEXTURE_2D, tx.miplevels, tx.internal_format, tx.w, tx.h );
+          glTexSubImage2D( GL_TEXTURE_2D, 0, 0, 0, tx.w, tx.h, GL_RGBA, GL_UNSIGNED_BYTE, &m.pixels[0] );
+          glGenerateMipmap( GL_TEXTURE_2D );
+
+          std::vector<texture_mip>().swap( l.img.mips );
+        }
+      }
+
+      for( auto& t : workers )
+      {
+        t.join();
+      }
+
+      loads.reset();
+
+      for( unsigned int c = 0; c < the_scene->mNumMeshes; ++c )
+      {
+        aiMaterial* mtl = the_scene->mMaterials[the_scene->mMeshes[c]->mMaterialIndex];
+
+        auto grab_texture = [&]( aiTextureType t, std::string& filename, GLuint& tex, bool& trans, bool srgb )
+        {
+          tex = 0;
+
+          aiString texpath;
+          if( mtl->GetTexture( t, 0, &texpath ) == AI_SUCCESS )
+          {
+            std::string tex_filename = path + texpath.C_Str();
+
+            auto it = texture_index.find( tex_filename );
+
+            //already reported above
+            if( it == texture_index.end() )
             {
-              orig_tex = it->texid;
-              miplevels = it->miplevels;
-              is_transparent = it->is_transparent;
+              return;
             }
 
+            GLuint orig_tex = s.textures[it->second].texid;
+            unsigned miplevels = s.textures[it->second].miplevels;
+            bool is_transparent = s.textures[it->second].is_transparent;
+
             trans = is_transparent;
 
             //create texture view
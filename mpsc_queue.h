@@ -0,0 +1,97 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <cstddef>
+
+//bounded lock-free queue, any number of threads may push, one thread pops
+//every slot has a sequence number telling whether it is free to write or ready to read
+template< class t >
+class mpsc_queue
+{
+  struct slot
+  {
+    std::atomic<size_t> seq;
+    t data;
+  };
+
+  std::vector<slot> slots;
+  size_t mask;
+  std::atomic<size_t> head; //next slot to write
+  size_t tail; //next slot to read, only touched by the consumer
+
+  mpsc_queue( const mpsc_queue& );
+  mpsc_queue& operator=( const mpsc_queue& );
+
+public:
+  //capacity is rounded up to a power of two
+  explicit mpsc_queue( size_t capacity = 1024 ) : mask( 0 ), head( 0 ), tail( 0 )
+  {
+    size_t size = 2;
+    while( size < capacity )
+    {
+      size *= 2;
+    }
+
+    std::vector<slot> s( size );
+    slots.swap( s );
+    mask = size - 1;
+
+    for( size_t c = 0; c < size; ++c )
+    {
+      slots[c].seq.store( c, std::memory_order_relaxed );
+    }
+  }
+
+  //returns false if the queue is full
+  bool push( const t& v )
+  {
+    size_t pos = head.load( std::memory_order_relaxed );
+
+    while( true )
+    {
+      slot& s = slots[pos & mask];
+      size_t seq = s.seq.load( std::memory_order_acquire );
+      ptrdiff_t diff = ( ptrdiff_t )seq - ( ptrdiff_t )pos;
+
+      if( diff == 0 )
+      {
+        //the slot is free, try to claim it
+        if( head.compare_exchange_weak( pos, pos + 1, std::memory_order_relaxed ) )
+        {
+          s.data = v;
+          s.seq.store( pos + 1, std::memory_order_release );
+          return true;
+        }
+      }
+      else if( diff < 0 )
+      {
+        //not read yet, full
+        return false;
+      }
+      else
+      {
+        pos = head.load( std::memory_order_relaxed );
+      }
+    }
+  }
+
+  //consumer only, returns false if the queue is empty
+  bool pop( t& v )
+  {
+    slot& s = slots[tail & mask];
+    size_t seq = s.seq.load( std::memory_order_acquire );
+
+    if( seq != tail + 1 )
+    {
+      //empty, or a producer is still writing it
+      return false;
+    }
+
+    v = s.data;
+    s.seq.store( tail + mask + 1, std::memory_order_release );
+    ++tail;
+
+    return true;
+  }
+};
@@ -1,12 +1,91 @@
 #pragma once
 
 #include <functional>
+#include <climits>
+#include <cfloat>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <atomic>
+#include <mutex>
+
+#include "thread_pool.h"
+#include "mpsc_queue.h"
 
 //TODO
 //soft particles
 //instancing
 //collision
 
+//small, fast, seedable random number generator (pcg32)
+//each emitter has its own stream, so the results don't depend on the update order
+struct particle_rng
+{
+  uint64_t state;
+
+  void seed( uint64_t s )
+  {
+    state = 0;
+    next();
+    state += s;
+    next();
+  }
+
+  uint32_t next()
+  {
+    uint64_t old = state;
+    state = old * 6364136223846793005ULL + 1442695040888963407ULL;
+    uint32_t xorshifted = uint32_t( ( ( old >> 18u ) ^ old ) >> 27u );
+    uint32_t rot = uint32_t( old >> 59u );
+    return ( xorshifted >> rot ) | ( xorshifted << ( ( 0u - rot ) & 31 ) );
+  }
+
+  //random number in [min...max)
+  float get( float min, float max )
+  {
+    return min + ( max - min ) * ( next() >> 8 ) * ( 1.0f / 16777216.0f );
+  }
+};
+
+//the generator of the emitter being updated on this thread
+inline particle_rng*& particle_current_rng()
+{
+  static thread_local particle_rng* rng = 0;
+  return rng;
+}
+
+//makes rng the current generator while in scope
+struct particle_rng_scope
+{
+  particle_rng* prev;
+
+  particle_rng_scope( particle_rng* rng ) : prev( particle_current_rng() )
+  {
+    particle_current_rng() = rng;
+  }
+
+  ~particle_rng_scope()
+  {
+    particle_current_rng() = prev;
+  }
+};
+
+//random number in [min...max]
+//uses the current emitter's stream when called from the emitter functions
+inline float particle_random( float min, float max )
+{
+  particle_rng* rng = particle_current_rng();
+
+  if( rng )
+  {
+    return rng->get( min, max );
+  }
+
+  return min + ( max - min ) * (float)rand() / (float)RAND_MAX;
+}
+
 enum animable_type
 {
   CONSTANT = 0, FUNCTION
@@ -20,7 +99,7 @@ struct animable_property
   t value;
   std::function<t( float, const vec3&, const vec3& )> func;
 
-  t get( float a, const vec3& b, const vec3& c )
+  t get( float a, const vec3& b, const vec3& c ) const
   {
     if( type == CONSTANT )
     {
@@ -33,6 +112,169 @@ struct animable_property
   }
 };
 
+static const int particle_curve_max_keys = 8;
+
+//piecewise linear curve, clamped at the ends
+struct particle_curve
+{
+  uint32_t key_count;
+  float x[particle_curve_max_keys];
+  float value[particle_curve_max_keys][3];
+
+  vec3 get( float t ) const
+  {
+    if( key_count == 0 )
+    {
+      return vec3( 0 );
+    }
+
+    if( t <= x[0] )
+    {
+      return vec3( value[0][0], value[0][1], value[0][2] );
+    }
+
+    for( uint32_t c = 1; c < key_count; ++c )
+    {
+      if( t < x[c] )
+      {
+        float f = ( t - x[c - 1] ) / ( x[c] - x[c - 1] );
+        vec3 a( value[c - 1][0], value[c - 1][1], value[c - 1][2] );
+        vec3 b( value[c][0], value[c][1], value[c][2] );
+        return mix( a, b, f );
+      }
+    }
+
+    return vec3( value[key_count - 1][0], value[key_count - 1][1], value[key_count - 1][2] );
+  }
+};
+
+//half precision floats, used by the compact particle storage
+inline uint16_t particle_float_to_half( float f )
+{
+  uint32_t x;
+  memcpy( &x, &f, 4 );
+
+  uint32_t sign = ( x >> 16 ) & 0x8000;
+  int32_t exp = int32_t( ( x >> 23 ) & 0xff ) - 127 + 15;
+  uint32_t mant = x & 0x7fffff;
+
+  if( exp >= 31 )
+  {
+    //nan stays nan, everything else saturates to infinity
+    return uint16_t( sign | 0x7c00 | ( ( ( x >> 23 ) & 0xff ) == 0xff && mant ? 0x200 : 0 ) );
+  }
+
+  if( exp <= 0 )
+  {
+    //denormal or zero
+    if( exp < -10 )
+      return uint16_t( sign );
+
+    mant |= 0x800000;
+    uint32_t shift = 14 - exp;
+    uint32_t h = mant >> shift;
+
+    if( ( mant >> ( shift - 1 ) ) & 1 )
+      ++h;
+
+    return uint16_t( sign | h );
+  }
+
+  uint32_t h = sign | ( uint32_t( exp ) << 10 ) | ( mant >> 13 );
+
+  //round to nearest, a carry into the exponent is still correct
+  if( mant & 0x1000 )
+    ++h;
+
+  return uint16_t( h );
+}
+
+inline float particle_half_to_float( uint16_t h )
+{
+  uint32_t sign = uint32_t( h & 0x8000 ) << 16;
+  uint32_t exp = ( h >> 10 ) & 0x1f;
+  uint32_t mant = h & 0x3ff;
+  uint32_t x;
+
+  if( exp == 0 )
+  {
+    float f = mant * 5.96046448e-8f; //2^-24
+    return sign ? -f : f;
+  }
+  else if( exp == 31 )
+  {
+    x = sign | 0x7f800000 | ( mant << 13 );
+  }
+  else
+  {
+    x = sign | ( ( exp + 112 ) << 23 ) | ( mant << 13 );
+  }
+
+  float f;
+  memcpy( &f, &x, 4 );
+  return f;
+}
+
+//define PARTICLE_COMPACT_STORAGE to store color, size and opacity as half floats, and to drop old_pos
+//this takes a particle from 80 to 48 bytes, less to move in the update and when packing for rendering
+//48 is the floor w/o changing the simulation: pos and vel are 16 byte SSE vectors that the kernels
+//and the VM work on directly, and halving would mean half float velocities, too coarse to integrate
+//small accelerations like gravity every frame. life stays a float for the same reason
+//the rest of the code goes through the accessors, so it works with both layouts
+#ifdef PARTICLE_COMPACT_STORAGE
+struct particle
+{
+  vec3 pos;
+  vec3 vel;
+  float life;
+  uint16_t color[3];
+  uint16_t size;
+  uint16_t opacity;
+  uint16_t seed; //random, fixed for the particle's life, fits in the padding
+
+  //the previous position isn't stored, nothing in the simulation reads it
+  void set_old_pos( const vec3& )
+  {
+  }
+
+  void translate( const vec3& d )
+  {
+    pos += d;
+  }
+
+  vec3 get_color() const
+  {
+    return vec3( particle_half_to_float( color[0] ), particle_half_to_float( color[1] ), particle_half_to_float( color[2] ) );
+  }
+
+  void set_color( const vec3& c )
+  {
+    color[0] = particle_float_to_half( c.x );
+    color[1] = particle_float_to_half( c.y );
+    color[2] = particle_float_to_half( c.z );
+  }
+
+  float get_size() const
+  {
+    return particle_half_to_float( size );
+  }
+
+  void set_size( float s )
+  {
+    size = particle_float_to_half( s );
+  }
+
+  float get_opacity() const
+  {
+    return particle_half_to_float( opacity );
+  }
+
+  void set_opacity( float o )
+  {
+    opacity = particle_float_to_half( o );
+  }
+};
+#else
 struct particle
 {
   vec3 old_pos;
@@ -41,185 +283,1685 @@ struct particle
   vec3 color;
   float size;
   float opacity;
-  float gravity_multiplier;
   float life;
+  uint16_t seed; //random, fixed for the particle's life, eg. the flipbook's start frame
+
+  void set_old_pos( const vec3& p )
+  {
+    old_pos = p;
+  }
+
+  void translate( const vec3& d )
+  {
+    old_pos += d;
+    pos += d;
+  }
+
+  vec3 get_color() const
+  {
+    return color;
+  }
+
+  void set_color( const vec3& c )
+  {
+    color = c;
+  }
+
+  float get_size() const
+  {
+    return size;
+  }
+
+  void set_size( float s )
+  {
+    size = s;
+  }
+
+  float get_opacity() const
+  {
+    return opacity;
+  }
+
+  void set_opacity( float o )
+  {
+    opacity = o;
+  }
 };
+#endif
 
-class particle_manager;
+//a request for a sub-emitter to emit at a parent particle's birth or death
+struct subemitter_event
+{
+  vec3 pos;
+  vec3 dir;
+  vec3 vel; //velocity of the parent particle, inherited if the sub-emitter wants it
+  int child_id; //the sub-emitter
+  int count; //how many times the sub-emitter's bursts are emitted
+};
 
-class particle_emitter
+//particles are stored in fixed size chunks, taken from a shared pool when needed
+//must be a multiple of the particle program's batch size, see particle_vm.h
+const int particle_chunk_size = 1024;
+
+struct particle_chunk
 {
-  int id;
-  bool first_update;
-  particle_manager* pm;
+  particle data[particle_chunk_size];
+
+  //of the positions in the chunk, conservative, for culling whole chunks
+  vec3 bounds_min, bounds_max;
+  float max_size;
+
+  //scratch space of the update, the chunk is updated on its own
+  int live; //particles that survived the update, at the front
+  vector<subemitter_event> death_events;
+
+  void reset_bounds()
+  {
+    bounds_min = vec3( FLT_MAX );
+    bounds_max = vec3( -FLT_MAX );
+    max_size = 0;
+  }
+
+  void grow_bounds( const particle& p )
+  {
+    bounds_min = min( bounds_min, p.pos );
+    bounds_max = max( bounds_max, p.pos );
+    max_size = std::max( max_size, p.get_size() );
+  }
+};
+
+//free chunks shared by every emitter, so an emitter only holds memory for the particles it has
+//thread safe, emitters take chunks while spawning in parallel
+class particle_chunk_pool
+{
+  std::mutex m;
+  vector<particle_chunk*> free_chunks;
+  int allocated;
+
 public:
-  int get_id() const
+  particle_chunk_pool() : allocated( 0 )
   {
-    return id;
   }
 
-  vec3 pos, dir;
+  particle_chunk* acquire()
+  {
+    {
+      std::lock_guard<std::mutex> lock( m );
+
+      if( !free_chunks.empty() )
+      {
+        particle_chunk* c = free_chunks.back();
+        free_chunks.pop_back();
+        return c;
+      }
+
+      ++allocated;
+    }
+
+    return new particle_chunk;
+  }
+
+  void release( particle_chunk* c )
+  {
+    c->death_events.clear();
+
+    std::lock_guard<std::mutex> lock( m );
+    free_chunks.push_back( c );
+  }
+
+  //gives the free chunks back to the system
+  void trim()
+  {
+    std::lock_guard<std::mutex> lock( m );
+
+    for( auto c : free_chunks )
+    {
+      delete c;
+    }
+
+    allocated -= free_chunks.size();
+    free_chunks.clear();
+  }
+
+  //chunks in use or free
+  int get_allocated()
+  {
+    std::lock_guard<std::mutex> lock( m );
+    return allocated;
+  }
+
+  int get_free()
+  {
+    std::lock_guard<std::mutex> lock( m );
+    return free_chunks.size();
+  }
+};
+
+//never destroyed, emitters may outlive any static pool
+inline particle_chunk_pool& particle_get_chunk_pool()
+{
+  static particle_chunk_pool* pool = new particle_chunk_pool;
+  return *pool;
+}
+
+//the particles of an emitter, dense: particle i is at chunks[i / particle_chunk_size]
+//only the last chunk is partially filled, chunks are returned to the pool when emptied
+class particle_storage
+{
+  vector<particle_chunk*> chunks;
+  int count;
+
+  void release_from( int first )
+  {
+    for( int c = first; c < chunks.size(); ++c )
+    {
+      particle_get_chunk_pool().release( chunks[c] );
+    }
+
+    chunks.resize( std::min( first, (int)chunks.size() ) );
+  }
+
+public:
+  class iterator
+  {
+    particle_storage* s;
+    int i;
+
+  public:
+    iterator( particle_storage* s, int i ) : s( s ), i( i )
+    {
+    }
+
+    particle& operator*() const
+    {
+      return ( *s )[i];
+    }
+
+    particle* operator->() const
+    {
+      return &( *s )[i];
+    }
+
+    iterator& operator++()
+    {
+      ++i;
+      return *this;
+    }
+
+    bool operator==( const iterator& other ) const
+    {
+      return i == other.i;
+    }
+
+    bool operator!=( const iterator& other ) const
+    {
+      return i != other.i;
+    }
+  };
+
+  particle_storage() : count( 0 )
+  {
+  }
+
+  particle_storage( const particle_storage& other ) : count( 0 )
+  {
+    *this = other;
+  }
+
+  particle_storage( particle_storage&& other ) noexcept : chunks( std::move( other.chunks ) ), count( other.count )
+  {
+    other.chunks.clear();
+    other.count = 0;
+  }
+
+  particle_storage& operator=( const particle_storage& other )
+  {
+    if( this != &other )
+    {
+      clear();
+
+      for( int c = 0; c < other.chunks.size(); ++c )
+      {
+        chunks.push_back( particle_get_chunk_pool().acquire() );
+        memcpy( chunks[c]->data, other.chunks[c]->data, other.get_chunk_size( c ) * sizeof( particle ) );
+        chunks[c]->bounds_min = other.chunks[c]->bounds_min;
+        chunks[c]->bounds_max = other.chunks[c]->bounds_max;
+        chunks[c]->max_size = other.chunks[c]->max_size;
+      }
+
+      count = other.count;
+    }
+
+    return *this;
+  }
+
+  particle_storage& operator=( particle_storage&& other ) noexcept
+  {
+    std::swap( chunks, other.chunks );
+    std::swap( count, other.count );
+    return *this;
+  }
+
+  ~particle_storage()
+  {
+    clear();
+  }
+
+  int size() const
+  {
+    return count;
+  }
+
+  bool empty() const
+  {
+    return count == 0;
+  }
+
+  particle& operator[]( int i )
+  {
+    return chunks[i / particle_chunk_size]->data[i % particle_chunk_size];
+  }
+
+  const particle& operator[]( int i ) const
+  {
+    return chunks[i / particle_chunk_size]->data[i % particle_chunk_size];
+  }
+
+  particle& back()
+  {
+    return ( *this )[count - 1];
+  }
+
+  iterator begin()
+  {
+    return iterator( this, 0 );
+  }
+
+  iterator end()
+  {
+    return iterator( this, count );
+  }
+
+  void push_back( const particle& p )
+  {
+    if( count == chunks.size() * particle_chunk_size )
+    {
+      chunks.push_back( particle_get_chunk_pool().acquire() );
+      chunks.back()->reset_bounds();
+    }
+
+    particle_chunk* c = chunks.back();
+    c->data[count % particle_chunk_size] = p;
+    c->grow_bounds( p );
+    ++count;
+  }
+
+  void clear()
+  {
+    release_from( 0 );
+    count = 0;
+  }
+
+  void assign( const particle* p, int n )
+  {
+    clear();
+
+    for( int c = 0; c < n; ++c )
+    {
+      push_back( p[c] );
+    }
+  }
+
+  //copies the particles in order to out, which has room for size() particles
+  void copy_to( particle* out ) const
+  {
+    for( int c = 0; c < chunks.size(); ++c )
+    {
+      memcpy( out + c * particle_chunk_size, chunks[c]->data, get_chunk_size( c ) * sizeof( particle ) );
+    }
+  }
+
+  int get_chunk_count() const
+  {
+    return chunks.size();
+  }
+
+  particle_chunk& get_chunk( int c )
+  {
+    return *chunks[c];
+  }
+
+  const particle_chunk& get_chunk( int c ) const
+  {
+    return *chunks[c];
+  }
+
+  //number of particles in the chunk
+  int get_chunk_size( int c ) const
+  {
+    return std::min( count - c * particle_chunk_size, particle_chunk_size );
+  }
+
+  //recomputes the bounds, after the particles were moved by something else than the update
+  void refresh_bounds()
+  {
+    refresh_bounds( 0, chunks.size() );
+  }
+
+  //of the chunks [first...last)
+  void refresh_bounds( int first, int last )
+  {
+    for( int c = first; c < last; ++c )
+    {
+      particle_chunk* ch = chunks[c];
+      ch->reset_bounds();
+
+      for( int i = 0; i < get_chunk_size( c ); ++i )
+      {
+        ch->grow_bounds( ch->data[i] );
+      }
+    }
+  }
+
+  //called after every chunk was updated and kept its survivors at the front (particle_chunk::live)
+  //slides the survivors forward over the holes, so the order is kept, and frees the emptied chunks
+  //the particles after the first hole are all moved, and the bounds of the chunks they land in recomputed
+  void compact()
+  {
+    int out = 0; //where the next survivor goes
+    int first_moved = chunks.size();
+
+    for( int c = 0; c < chunks.size(); ++c )
+    {
+      particle_chunk* s = chunks[c];
+
+      //no holes so far, they stay in place
+      if( out == c * particle_chunk_size )
+      {
+        out += s->live;
+        continue;
+      }
+
+      first_moved = std::min( first_moved, out / particle_chunk_size );
+
+      //at most two runs, the end of one chunk and the start of the next, which may be this one
+      for( int i = 0; i < s->live; )
+      {
+        particle_chunk* d = chunks[out / particle_chunk_size];
+        int at = out % particle_chunk_size;
+        int run = std::min( s->live - i, particle_chunk_size - at );
+
+        memmove( d->data + at, s->data + i, run * sizeof( particle ) );
+        i += run;
+        out += run;
+      }
+    }
+
+    count = out;
+
+    int used = ( count + particle_chunk_size - 1 ) / particle_chunk_size;
+    release_from( used );
+    refresh_bounds( first_moved, used );
+  }
+};
+
+class particle_manager;
+class particle_snapshot;
+class particle_emitter;
+
+//a placement of an instanced emitter
+struct particle_emitter_instance
+{
+  mat4 transform; //emitter space -> world space
+  //the instance is drawn this many seconds ahead, hides the repetition, only for looping emitters
+  //the particles are extrapolated ballistically and their over lifetime / speed modules evaluated at the new age,
+  //custom updates (eg. programs) are not. a particle that would die before is wrapped into its remaining life,
+  //so the instances show the same number of particles
+  float time_offset;
+};
+
+//how the particles of an emitter are ordered for drawing
+enum particle_sort_mode
+{
+  PARTICLE_SORT_AUTO = 0, //none for additive and order independent emitters, back-to-front otherwise
+  PARTICLE_SORT_NONE,
+  PARTICLE_SORT_BACK_TO_FRONT,
+  PARTICLE_SORT_FRONT_TO_BACK,
+  PARTICLE_SORT_BUCKET //approximately back-to-front, into depth buckets, no comparisons
+};
+
+//animated texture: frames in a grid of cols x rows inside uv_rect (eg. a region of a particle_atlas), row by row from uv_rect's first corner
+//the frame follows the particle's age, on the same time base as the _over_lifetime modules (duration - life)
+struct particle_flipbook
+{
+  float uv_rect[4]; //u0, v0, u1, v1
+  int cols, rows;
+  int frames; //0: cols * rows
+  float cycles; //times the animation plays over duration
+  float fps; //if > 0, frames per second instead of cycles
+  bool random_start; //every particle starts from a random frame
+  bool blend; //the instances also get the next frame and how far the particle is towards it
+
+  particle_flipbook() : cols( 1 ), rows( 1 ), frames( 0 ), cycles( 1 ), fps( 0 ), random_start( false ), blend( false )
+  {
+    uv_rect[0] = uv_rect[1] = 0;
+    uv_rect[2] = uv_rect[3] = 1;
+  }
+
+  int get_frame_count() const
+  {
+    return frames > 0 ? std::min( frames, cols * rows ) : cols * rows;
+  }
+
+  //uv rect of a frame
+  void get_frame_rect( int frame, float* rect ) const
+  {
+    float w = ( uv_rect[2] - uv_rect[0] ) / cols;
+    float h = ( uv_rect[3] - uv_rect[1] ) / rows;
+    rect[0] = uv_rect[0] + ( frame % cols ) * w;
+    rect[1] = uv_rect[1] + ( frame / cols ) * h;
+    rect[2] = rect[0] + w;
+    rect[3] = rect[1] + h;
+  }
+
+  //frame at age, and the fraction towards the next one
+  int get_frame( float age, float duration, uint16_t seed, float& fraction ) const
+  {
+    int count = get_frame_count();
+
+    if( count <= 1 )
+    {
+      fraction = 0;
+      return 0;
+    }
+
+    float f = fps > 0 ? age * fps : age / std::max( duration, 1e-6f ) * cycles * count;
+    f = std::max( f, 0.0f );
+
+    float whole = std::floor( f );
+    fraction = f - whole;
+
+    int frame = int( whole ) % count;
+
+    if( random_start )
+    {
+      frame = ( frame + seed % count ) % count;
+    }
+
+    return frame;
+  }
+};
+
+//the settings of an emitter, shared by all the emitters spawned from the same effect
+//treat it as immutable once emitters use it, particle_emitter::edit_def() makes a private copy
+struct particle_emitter_def
+{
+  animable_property<vec3> start_pos; //particle is initialized w/ this position relative to pos
+  animable_property<vec3> start_velocity; //particle is initialized w/ this velocity relative to dir
+  animable_property<vec3> start_color; //particle is initialized w/ this color
+  animable_property<float> start_size; //particle is initialized w/ this size
+  animable_property<float> start_opacity; //particle is initialized w/ this opacity
+
+  animable_property<float> emit_per_second; //how many particles to emit per second
+
+  animable_property<float> start_life; //the lifetime of a particle
+
+  std::function<vec3( float, const vec3&, const vec3& )> color_over_lifetime;
+  std::function<vec3( float, const vec3&, const vec3& )> color_over_speed;
+  std::function<float( float, const vec3&, const vec3& )> size_over_lifetime;
+  std::function<float( float, const vec3&, const vec3& )> size_over_speed;
+  std::function<float( float, const vec3&, const vec3& )> opacity_over_lifetime;
+  std::function<float( float, const vec3&, const vec3& )> opacity_over_speed;
+
+  //runs after the built-in modules every update, eg. a particle_program
+  std::function<void( particle_emitter&, float )> custom_update;
+
+  std::vector<std::pair<float, int> > bursts; //when to emit a burst [0...duration], and how many particles to emit
+
+  float duration; //the emitter's lifetime (seconds), if looped, one cycle
+  bool is_looping; //if true, the particle system won't die
+  bool prewarm; //if true, the system will be in a state as if we simulated one cycle
+
+  float gravity_multiplier; //[0...1] how much should gravity affect the particle?
+
+  int max_particles; //maximum number of particles to be present at a time
+
+  int priority; //when the manager is over budget, lower priority emitters are throttled first
+  float importance_radius; //approximate size of the effect, used to estimate its screen size for the budget
+
+  bool is_child;
+
+  bool is_additive;
+
+  //weighted blended order independent transparency, for alpha blended emitters that tolerate the approximation
+  bool is_oit;
+
+  int sort_mode; //particle_sort_mode
+
+  //1: drawn at full resolution, 2 or 4: drawn offscreen at half or quarter resolution and upsampled, for large overlapping billboards
+  //order independent emitters are always drawn at full resolution
+  int downsample;
+
+  //renderer handles, eg. gl names, 0 leaves the choice to the renderer
+  uint32_t texture;
+  uint32_t shader;
+
+  particle_flipbook flipbook;
+
+  bool is_stretched;
+  float stretch_factor;
+
+  bool inherit_vel;
+
+  //if true the particles are simulated relative to the emitter, and only moved to its place when drawn
+  //they follow the emitter when it moves and turns, the emitter's dir is +y of the simulation space
+  bool is_local_space;
+
+  particle_emitter_def() : duration( 1 ), is_looping( false ), prewarm( false ), gravity_multiplier( 1 ), max_particles( 1000 ),
+    priority( 0 ), importance_radius( 1 ), is_child( false ), is_additive( false ), is_oit( false ), sort_mode( PARTICLE_SORT_AUTO ), downsample( 1 ), texture( 0 ), shader( 0 ), is_stretched( false ), stretch_factor( 1 ), inherit_vel( false ),
+    is_local_space( false )
+  {
+    start_pos.type = CONSTANT;
+    start_pos.value = vec3( 0 );
+    start_velocity.type = CONSTANT;
+    start_velocity.value = vec3( 0 );
+    start_color.type = CONSTANT;
+    start_color.value = vec3( 1 );
+    start_size.type = CONSTANT;
+    start_size.value = 1;
+    start_opacity.type = CONSTANT;
+    start_opacity.value = 1;
+    emit_per_second.type = CONSTANT;
+    emit_per_second.value = 0;
+    start_life.type = CONSTANT;
+    start_life.value = 1;
+  }
+};
+
+//the sort mode in effect, additive and order independent emitters don't need any
+inline particle_sort_mode particle_get_sort_mode( const particle_emitter_def& d )
+{
+  if( d.sort_mode != PARTICLE_SORT_AUTO )
+  {
+    return ( particle_sort_mode )d.sort_mode;
+  }
+
+  return d.is_additive || d.is_oit ? PARTICLE_SORT_NONE : PARTICLE_SORT_BACK_TO_FRONT;
+}
+
+//the settings emitters start with, until they are given their own
+inline const std::shared_ptr<const particle_emitter_def>& particle_default_def()
+{
+  static const std::shared_ptr<const particle_emitter_def> def = std::make_shared<particle_emitter_def>();
+  return def;
+}
+
+class particle_emitter
+{
+  friend class particle_snapshot;
+  friend class particle_render_packer;
+
+  int id;
+  bool first_update;
+  particle_manager* pm;
+  std::shared_ptr<const particle_emitter_def> def;
+public:
+  int get_id() const
+  {
+    return id;
+  }
+
+  const particle_emitter_def& get_def() const
+  {
+    return *def;
+  }
+
+  void set_def( const std::shared_ptr<const particle_emitter_def>& d )
+  {
+    def = d;
+  }
+
+  //returns the settings for modification, copied first if other emitters share them
+  particle_emitter_def& edit_def()
+  {
+    if( def.use_count() > 1 )
+    {
+      def = std::make_shared<particle_emitter_def>( *def );
+    }
+
+    return const_cast<particle_emitter_def&>( *def );
+  }
+
+  vec3 pos, dir;
+
+  std::vector<int> birth_subemitter_ids; //makes the sub-emitters emit at this emitter's particles' birth
+  std::vector<int> death_subemitter_ids; //makes the sub-emitters emit at this emitter's particles' death
+
+  //sub-emitter requests of this update, consumed by the manager after the update phase
+  vector<subemitter_event> sub_events;
+
+  float life; //how much does the emitter have from it's life (seconds)
+
+  //emission bookkeeping for the manager's budget
+  int spawn_requests; //emit requests since the last schedule
+  int last_spawn_requests; //emit requests in the last frame, used as the demand estimate
+  int spawn_quota; //particles this emitter may spawn in this update
+  float spawn_scale; //[0...1] fraction of emit requests granted
+  float spawn_accum;
+
+  int triggered_burst; //particles to emit in the next update, on request
+  bool is_stopped; //no more emission, the emitter is removed when its particles are gone
+  int handle; //command queue handle of the emitter, -1 if none
+
+  particle_rng rng; //random stream of this emitter, seeded from the manager's seed and the id
+
+  //if not empty, the particles are simulated once and drawn at each of these placements instead of where they are
+  //pos and dir then describe the emitter's own space, usually the origin
+  vector<particle_emitter_instance> instances;
+
+  particle_storage particles;
+
+  void init( int id, particle_manager* pm, uint64_t seed, const std::shared_ptr<const particle_emitter_def>& d )
+  {
+    this->id = id;
+    this->pm = pm;
+    def = d;
+    first_update = true;
+
+    reseed( seed );
+
+    spawn_requests = 0;
+    last_spawn_requests = 0;
+    spawn_quota = INT_MAX;
+    spawn_scale = 1;
+    spawn_accum = 0;
+    triggered_burst = 0;
+    is_stopped = false;
+    handle = -1;
+
+    //the emitter may be a recycled one, the containers keep their capacity
+    birth_subemitter_ids.clear();
+    death_subemitter_ids.clear();
+    sub_events.clear();
+    instances.clear();
+    particles.clear();
+  }
+
+  //restarts the random stream, derived from the manager's seed and the id
+  void reseed( uint64_t seed )
+  {
+    rng.seed( seed ^ ( uint64_t( id ) * 0x9E3779B97F4A7C15ULL ) );
+  }
+
+  //emits a particle at pos/dir
+  void emit( float dt, bool sub_birth, const vec3& inherited_vel = vec3( 0 ) )
+  {
+    spawn( dt, get_sim_pos(), get_sim_dir(), sub_birth, inherited_vel );
+  }
+
+  //where the emitter is in the space its particles are simulated in
+  vec3 get_sim_pos() const
+  {
+    return def->is_local_space ? vec3( 0 ) : pos;
+  }
+
+  //where the emitter faces in the space its particles are simulated in
+  vec3 get_sim_dir() const
+  {
+    return def->is_local_space ? vec3( 0, 1, 0 ) : dir;
+  }
+
+  //simulation space -> world space, for local space particles dir is the y axis, the other two are arbitrary but stable
+  mat4 get_transform() const
+  {
+    if( !def->is_local_space )
+    {
+      return mat4( 1 );
+    }
+
+    vec3 y = length( dir ) > 1e-6f ? normalize( dir ) : vec3( 0, 1, 0 );
+    vec3 x, z;
+
+    if( std::abs( y.z ) < 0.999f )
+    {
+      x = normalize( cross( y, vec3( 0, 0, 1 ) ) );
+      z = cross( x, y );
+    }
+    else
+    {
+      z = normalize( cross( vec3( 1, 0, 0 ), y ) );
+      x = cross( y, z );
+    }
+
+    return mat4( vec4( x, 0 ), vec4( y, 0 ), vec4( z, 0 ), vec4( pos, 1 ) );
+  }
+
+  //world space -> simulation space, w is 1 for points and 0 for directions
+  vec3 to_sim_space( const vec3& v, float w ) const
+  {
+    if( !def->is_local_space )
+    {
+      return v;
+    }
+
+    //the inverse of a rotation is its transpose
+    mat4 m = get_transform();
+    vec3 d = v - m[3].xyz * w;
+    return vec3( dot( d, m[0].xyz ), dot( d, m[1].xyz ), dot( d, m[2].xyz ) );
+  }
+
+  //emits a particle as if the emitter was at at_pos, facing at_dir
+  void spawn( float dt, const vec3& at_pos, const vec3& at_dir, bool sub_birth, const vec3& inherited_vel );
+
+  void emit_bursts( float dt, bool force, const vec3& inherited_vel = vec3( 0 ) )
+  {
+    for( auto& i : def->bursts )
+    {
+      if( force || std::abs( i.first - ( def->duration - life ) ) < dt )
+      {
+        for( int j = 0; j < i.second; ++j )
+        {
+          emit( dt, false, inherited_vel );
+        }
+      }
+    }
+  }
+
+  //number of particles emitted when all the bursts fire
+  int get_burst_size() const
+  {
+    int size = 0;
+
+    for( auto& i : def->bursts )
+    {
+      size += i.second;
+    }
+
+    return size;
+  }
+
+  //number of particles the bursts will emit in the next update
+  int get_due_burst_size( float dt ) const
+  {
+    if( def->is_child || is_stopped )
+    {
+      return triggered_burst;
+    }
+
+    float t = first_update ? 0 : def->duration - life;
+    int size = triggered_burst;
+
+    for( auto& i : def->bursts )
+    {
+      if( std::abs( i.first - t ) < dt )
+      {
+        size += i.second;
+      }
+    }
+
+    return size;
+  }
+
+  //emits the bursts of this (sub-)emitter for every event, at the event's position
+  void emit_events( float dt, const subemitter_event* events, int count )
+  {
+    particle_rng_scope rng_scope( &rng );
+
+    for( int c = 0; c < count; ++c )
+    {
+      const auto& e = events[c];
+      vec3 vel = def->inherit_vel ? e.vel : vec3( 0 );
+
+      for( int r = 0; r < e.count; ++r )
+      {
+        for( auto& i : def->bursts )
+        {
+          for( int j = 0; j < i.second; ++j )
+          {
+            spawn( dt, to_sim_space( e.pos, 1 ), to_sim_space( e.dir, 0 ), false, to_sim_space( vel, 0 ) );
+          }
+        }
+      }
+    }
+  }
+
+  void update_life( float dt )
+  {
+    life -= dt;
+
+    if( def->is_looping && life < 0 )
+    {
+      life += def->duration;
+    }
+  }
+
+  //runs the update kernel specialized for the active modules on one chunk of the particles
+  //chunks don't touch each other, they may be updated in parallel
+  void update_chunk( int c, float dt );
+
+  //merges the results of the chunk updates, see particle_storage::compact()
+  void collect_chunks();
+
+  void update_particles( float dt )
+  {
+    for( int c = 0; c < particles.get_chunk_count(); ++c )
+    {
+      update_chunk( c, dt );
+    }
+
+    collect_chunks();
+  }
+
+  //requests the sub-emitters to emit at the particle
+  void push_subemitter_events( const vector<int>& ids, const particle& p )
+  {
+    push_subemitter_events( ids, p, sub_events );
+  }
+
+  void push_subemitter_events( const vector<int>& ids, const particle& p, vector<subemitter_event>& events ) const;
+
+  particle_storage::iterator get_particle_iterator()
+  {
+    return particles.begin();
+  }
+
+  particle_storage::iterator get_particle_iterator_end()
+  {
+    return particles.end();
+  }
+
+  float elapsed_time;
+
+  //the update is split in three, so that the manager can update the chunks of every emitter together
+  //begin_update(), update_chunk() for every chunk, collect_chunks(), finish_update()
+  void update( float dt )
+  {
+    begin_update();
+    update_particles( dt );
+    finish_update( dt );
+  }
+
+  void begin_update()
+  {
+    particle_rng_scope rng_scope( &rng );
+
+    if( first_update )
+    {
+      //init life
+      life = def->duration;
+
+      elapsed_time = 0;
+
+      first_update = false;
+
+      //prewarm
+      if( def->is_looping && def->prewarm )
+      {
+        float time = def->duration;
+        while( time >= 0 )
+        {
+          float delta = 1 / 60.0f;
+          update( delta );
+          time -= delta;
+        }
+      }
+    }
+  }
+
+  void finish_update( float dt )
+  {
+    particle_rng_scope rng_scope( &rng );
+
+    if( def->custom_update )
+    {
+      def->custom_update( *this, dt );
+
+      //it may have moved the particles anywhere
+      particles.refresh_bounds();
+    }
+
+    //bursts
+    if( !def->is_child && !is_stopped )
+      emit_bursts( dt, false );
+
+    for( ; triggered_burst > 0; --triggered_burst )
+      emit( dt, true );
+
+    //update life
+    update_life( dt );
+
+    //spawn new particles
+    if( !def->is_child && !is_stopped )
+    {
+      elapsed_time += dt;
+
+      float eps = def->emit_per_second.get( dt, pos, dir );
+      float emit_period = 1 / eps;
+
+      if( elapsed_time > emit_period )
+      {
+        while( elapsed_time > emit_period )
+        {
+          elapsed_time -= emit_period;
+          emit( dt, true );
+        }
+      }
+    }
+  }
+};
+
+//inputs of the simulation, recorded to be able to replay a run
+enum particle_event_type
+{
+  PEV_STEP = 0, //v[0]: dt passed to update()
+  PEV_VIEWER, //v: viewer position
+  PEV_BUDGET, //id: max live particles, param: max spawns per frame
+  PEV_CREATE, //id: effect key, v: position
+  PEV_REMOVE, //id: emitter
+  PEV_POS, //id: emitter, v: position
+  PEV_DIR, //id: emitter, v: direction
+  PEV_PARAM, //id: emitter, param: particle_param, v[0]: value
+  PEV_BURST, //id: emitter, param: particle count
+  PEV_STOP //id: emitter
+};
+
+//parameters that can be changed through the manager
+enum particle_param
+{
+  PARAM_EMIT_PER_SECOND = 0,
+  PARAM_START_SIZE,
+  PARAM_START_OPACITY,
+  PARAM_START_LIFE,
+  PARAM_GRAVITY_MULTIPLIER,
+  PARAM_STRETCH_FACTOR,
+  PARAM_IS_LOOPING
+};
+
+//requests posted to the manager from any thread, applied at the start of update()
+enum particle_command_type
+{
+  PCMD_CREATE = 0, //create the effect, param: effect key, v: position
+  PCMD_POS, //v: position
+  PCMD_DIR, //v: direction
+  PCMD_PARAM, //param: particle_param, v[0]: value
+  PCMD_BURST, //param: particle count
+  PCMD_STOP, //stop emitting, the emitter goes away when its particles die
+  PCMD_KILL //remove the emitter and its particles now
+};
+
+struct particle_command
+{
+  int32_t type;
+  int32_t handle; //from particle_manager::post_create()
+  int32_t param;
+  float v[3];
+};
+
+struct particle_event
+{
+  int32_t type;
+  int32_t id;
+  int32_t param;
+  float v[3];
+
+  static particle_event make( int32_t type, int32_t id, int32_t param = 0, const vec3& v = vec3( 0 ) )
+  {
+    particle_event e;
+    e.type = type;
+    e.id = id;
+    e.param = param;
+    e.v[0] = v.x;
+    e.v[1] = v.y;
+    e.v[2] = v.z;
+    return e;
+  }
+};
+
+class particle_manager
+{
+  friend class particle_snapshot;
+  friend class particle_render_packer;
+
+  int id_counter;
+  vector<particle_emitter> emitters;
+
+  uint64_t seed; //emitters are seeded from this and their id
+  float fixed_timestep; //if >0 the simulation is advanced in steps of this size
+  float time_accum; //time not simulated yet in fixed timestep mode
+  int max_fixed_steps; //at most this many steps are taken in one update
+
+  vector<particle_event>* recording; //if set, the inputs are appended to it
+
+  //finished emitters, reused by create() instead of allocating new ones
+  //they don't keep their settings, only the address of them to find one of the same effect
+  vector<std::pair<const particle_emitter_def*, particle_emitter> > recycled;
+  int max_recycled;
+
+  void retire( particle_emitter& e )
+  {
+    //the effect's handle goes away w/ its last emitter
+    auto it = handles.find( e.handle );
+
+    if( it != handles.end() )
+    {
+      auto& ids = it->second.ids;
+      ids.erase( std::remove( ids.begin(), ids.end(), e.get_id() ), ids.end() );
+
+      if( ids.empty() )
+      {
+        handles.erase( it );
+      }
+    }
+
+    if( recycled.size() < max_recycled )
+    {
+      //the particles of a removed emitter go back to the chunk pool right away
+      e.particles.clear();
+
+      //and the settings don't look shared by it, see edit_def()
+      const particle_emitter_def* d = &e.get_def();
+      e.set_def( std::shared_ptr<const particle_emitter_def>() );
+
+      recycled.push_back( std::make_pair( d, std::move( e ) ) );
+    }
+  }
+
+  //appends an emitter to be init()-ed, a recycled one if there is any
+  particle_emitter& add_emitter( const std::shared_ptr<const particle_emitter_def>& def )
+  {
+    if( recycled.empty() )
+    {
+      emitters.push_back( particle_emitter() );
+    }
+    else
+    {
+      //prefer one of the same effect, its containers are sized for it
+      int idx = recycled.size() - 1;
+
+      for( int c = idx; c >= 0; --c )
+      {
+        if( recycled[c].first == def.get() )
+        {
+          idx = c;
+          break;
+        }
+      }
+
+      emitters.push_back( std::move( recycled[idx].second ) );
+
+      if( idx != recycled.size() - 1 )
+      {
+        recycled[idx] = std::move( recycled.back() );
+      }
+
+      recycled.pop_back();
+    }
+
+    return emitters.back();
+  }
+
+  //creates the effects with the given key, used by create_effect() and the replay
+  std::function<int( particle_manager&, int, const vec3& )> effect_factory;
+
+  void record( const particle_event& e )
+  {
+    if( recording )
+    {
+      recording->push_back( e );
+    }
+  }
+
+  int max_live_particles; //global limit of live particles, <0 means unlimited
+  int max_spawns_per_frame; //global limit of particles emitted per update, <0 means unlimited
+  int live_particles; //live particles at the start of the update
+  vec3 viewer_pos; //used to estimate the importance of the emitters
+
+  vector<std::pair<float, int> > schedule; //(importance, emitter index), in priority order
+  vector<std::pair<int, int> > chunk_jobs; //(emitter index, chunk index), scratch space of the update
+
+  thread_pool workers; //emitters are updated in parallel if there are worker threads
+
+  mpsc_queue<particle_command> commands;
+  std::atomic<int> handle_counter;
+  //the emitters created by an effect
+  struct effect
+  {
+    int root; //the emitter create_effect() returned, controlled by the commands
+    vector<int> ids; //every emitter of the effect still alive, including the sub-emitters, stopped and killed together
+  };
+
+  std::map<int, effect> handles; //command handle -> effect, only touched by the updating thread
+
+  bool post( int type, int handle, int param, const vec3& v )
+  {
+    particle_command c;
+    c.type = type;
+    c.handle = handle;
+    c.param = param;
+    c.v[0] = v.x;
+    c.v[1] = v.y;
+    c.v[2] = v.z;
+
+    if( !commands.push( c ) )
+    {
+      cerr << "Particle manager: command queue full, command dropped." << endl;
+      return false;
+    }
+
+    return true;
+  }
+
+  //applies the posted commands through the regular (recorded) functions
+  void apply_commands()
+  {
+    particle_command c;
+
+    while( commands.pop( c ) )
+    {
+      vec3 v( c.v[0], c.v[1], c.v[2] );
+
+      if( c.type == PCMD_CREATE )
+      {
+        //ids are handed out in order, so everything the factory creates is in [first...id_counter)
+        int first = id_counter;
+        int id = create_effect( c.param, v );
+
+        if( get( id ) )
+        {
+          effect& fx = handles[c.handle];
+          fx.root = id;
+          fx.ids.clear();
+
+          for( int i = first; i < id_counter; ++i )
+          {
+            auto e = get( i );
+
+            if( e )
+            {
+              e->handle = c.handle;
+              fx.ids.push_back( i );
+            }
+          }
+        }
+
+        continue;
+      }
+
+      auto it = handles.find( c.handle );
+
+      if( it == handles.end() )
+      {
+        //the effect is already gone, or it couldn't be created
+        continue;
+      }
+
+      int id = it->second.root;
+
+      //removing them changes the list
+      vector<int> ids = c.type == PCMD_STOP || c.type == PCMD_KILL ? it->second.ids : vector<int>();
+
+      switch( c.type )
+      {
+      case PCMD_POS:
+        set_pos( id, v );
+        break;
+      case PCMD_DIR:
+        set_dir( id, v );
+        break;
+      case PCMD_PARAM:
+        set_param( id, ( particle_param )c.param, v.x );
+        break;
+      case PCMD_BURST:
+        trigger_burst( id, c.param );
+        break;
+      case PCMD_STOP:
+        for( int i : ids )
+          stop( i );
+        break;
+      case PCMD_KILL:
+        for( int i : ids )
+          remove( i );
+        break;
+      default:
+        break;
+      }
+    }
+  }
+
+  bool has_budget() const
+  {
+    return max_live_particles >= 0 || max_spawns_per_frame >= 0;
+  }
+
+  //orders the emitters by priority and importance
+  //and distributes the frame's spawn budget among them
+  void schedule_emission( float dt )
+  {
+    schedule.clear();
+
+    live_particles = 0;
+    for( auto& i : emitters )
+    {
+      live_particles += i.particles.size();
+
+      i.last_spawn_requests = i.spawn_requests;
+      i.spawn_requests = 0;
+    }
+
+    if( !has_budget() )
+    {
+      for( int c = 0; c < emitters.size(); ++c )
+      {
+        emitters[c].spawn_scale = 1;
+        emitters[c].spawn_quota = INT_MAX;
+        schedule.push_back( make_pair( 0.0f, c ) );
+      }
+
+      return;
+    }
+
+    int spawns_left = max_spawns_per_frame < 0 ? INT_MAX : max_spawns_per_frame;
+
+    if( max_live_particles >= 0 )
+    {
+      spawns_left = std::min( spawns_left, std::max( max_live_particles - live_particles, 0 ) );
+    }
+
+    for( int c = 0; c < emitters.size(); ++c )
+    {
+      auto& e = emitters[c];
+
+      //projected size of the effect
+      float dist = length( e.pos - viewer_pos );
+
+      //an instanced emitter is as important as its closest instance
+      if( !e.instances.empty() )
+      {
+        dist = FLT_MAX;
+        for( auto& inst : e.instances )
+        {
+          dist = std::min( dist, length( inst.transform[3].xyz - viewer_pos ) );
+        }
+      }
+
+      dist = std::max( dist, 0.001f );
+      float importance = e.get_def().importance_radius / dist;
+
+      schedule.push_back( make_pair( importance, c ) );
+    }
+
+    std::sort( schedule.begin(), schedule.end(), [&]( const std::pair<float, int>& a, const std::pair<float, int>& b ) -> bool
+    {
+      const auto& ea = emitters[a.second];
+      const auto& eb = emitters[b.second];
+
+      if( ea.get_def().priority != eb.get_def().priority )
+      {
+        return ea.get_def().priority > eb.get_def().priority;
+      }
+
+      return a.first > b.first;
+    } );
+
+    //hand out the budget as per emitter quotas, so the emitters don't share any state while updating
+    //the demand is estimated from last frame's requests, plus the bursts due in this update
+    //emitters that don't fit are scaled down, the least important ones first
+    int budget = spawns_left;
+    for( auto& i : schedule )
+    {
+      auto& e = emitters[i.second];
+      int demand = e.last_spawn_requests;
+      int quota = std::min( demand + e.get_due_burst_size( dt ), budget );
+
+      e.spawn_scale = demand <= quota ? 1 : quota / float( demand );
+      e.spawn_quota = quota;
+      budget -= quota;
+    }
+
+    //whatever is left is shared evenly, so that unexpected demand (eg. sub-emitters) can be served
+    if( !schedule.empty() )
+    {
+      int share = budget / schedule.size();
+      int remainder = budget % schedule.size();
+
+      for( int c = 0; c < schedule.size(); ++c )
+      {
+        emitters[schedule[c].second].spawn_quota += share + ( c < remainder ? 1 : 0 );
+      }
+    }
+  }
+
+  //hands the sub-emitter events of every emitter to the sub-emitters
+  //each sub-emitter is looked up once per parent, and emits all of its events in one go
+  void dispatch_subemitter_events( float dt )
+  {
+    for( int c = 0; c < emitters.size(); ++c )
+    {
+      auto& events = emitters[c].sub_events;
 
-  animable_property<vec3> start_pos; //particle is initialized w/ this position relative to pos
-  animable_property<vec3> start_velocity; //particle is initialized w/ this velocity relative to dir
-  animable_property<vec3> start_color; //particle is initialized w/ this color
-  animable_property<float> start_size; //particle is initialized w/ this size
-  animable_property<float> start_opacity; //particle is initialized w/ this opacity
+      if( events.empty() )
+      {
+        continue;
+      }
 
-  animable_property<float> emit_per_second; //how many particles to emit per second
+      //move them out, the children may have children of their own
+      dispatch_buffer.swap( events );
+      events.clear();
 
-  animable_property<float> start_life; //the lifetime of a particle
+      //events are grouped by child, keeping their order
+      std::stable_sort( dispatch_buffer.begin(), dispatch_buffer.end(), []( const subemitter_event& a, const subemitter_event& b ) -> bool
+      {
+        return a.child_id < b.child_id;
+      } );
 
-  std::function<vec3( float, const vec3&, const vec3& )> color_over_lifetime;
-  std::function<vec3( float, const vec3&, const vec3& )> color_over_speed;
-  std::function<float( float, const vec3&, const vec3& )> size_over_lifetime;
-  std::function<float( float, const vec3&, const vec3& )> size_over_speed;
-  std::function<float( float, const vec3&, const vec3& )> opacity_over_lifetime;
-  std::function<float( float, const vec3&, const vec3& )> opacity_over_speed;
+      for( size_t begin = 0; begin < dispatch_buffer.size(); )
+      {
+        size_t end = begin + 1;
 
-  std::vector<std::pair<float, int> > bursts; //when to emit a burst [0...duration], and how many particles to emit
+        while( end < dispatch_buffer.size() && dispatch_buffer[end].child_id == dispatch_buffer[begin].child_id )
+        {
+          ++end;
+        }
 
-  //TODO
-  std::vector<int> birth_subemitter_ids; //makes the sub-emitters emit at this emitter's particles' birth
-  std::vector<int> death_subemitter_ids; //makes the sub-emitters emit at this emitter's particles' death
+        auto child = get( dispatch_buffer[begin].child_id );
 
-  float life; //how much does the emitter have from it's life (seconds)
-  float duration; //the emitter's lifetime (seconds), if looped, one cycle
-  bool is_looping; //if true, the particle system won't die
-  bool prewarm; //if true, the system will be in a state as if we simulated one cycle
+        if( child )
+        {
+          child->emit_events( dt, &dispatch_buffer[begin], end - begin );
+        }
 
-  float gravity_multiplier; //[0...1] how much should gravity affect the particle?
+        begin = end;
+      }
 
-  int max_particles; //maximum number of particles to be present at a time
+      dispatch_buffer.clear();
+    }
+  }
 
-  bool is_child;
+  vector<subemitter_event> dispatch_buffer;
 
-  bool is_additive;
+public:
+  //returns true if the emitter may spawn a particle now
+  //emitters are thinned out evenly by their spawn scale, and the hard limits are enforced here
+  bool grant_spawn( particle_emitter& e )
+  {
+    ++e.spawn_requests;
 
-  bool is_stretched;
-  float stretch_factor;
+    if( !has_budget() )
+    {
+      return true;
+    }
 
-  bool inherit_vel;
+    e.spawn_accum += e.spawn_scale;
+
+    if( e.spawn_accum < 1 )
+    {
+      return false;
+    }
+
+    e.spawn_accum -= 1;
+
+    if( e.spawn_quota <= 0 )
+    {
+      return false;
+    }
+
+    --e.spawn_quota;
 
-  vector<particle> particles;
+    return true;
+  }
 
-  void init( int id, particle_manager* pm )
+  //number of worker threads used to update the emitters, 0 updates on the calling thread only
+  //the result is the same regardless of the number of threads
+  void set_threads( int n )
   {
-    this->id = id;
-    this->pm = pm;
-    first_update = true;
+    workers.set_threads( n );
+  }
+
+  //limits the total number of live particles and the number of particles spawned per update
+  //pass <0 for unlimited
+  void set_budget( int max_live, int max_spawns )
+  {
+    record( particle_event::make( PEV_BUDGET, max_live, max_spawns ) );
+    max_live_particles = max_live;
+    max_spawns_per_frame = max_spawns;
   }
 
-  void emit( float dt, bool sub_birth, const vec3& inherited_vel = vec3(0) );
+  //the emitters close to the viewer are considered more important
+  void set_viewer( const vec3& p )
+  {
+    record( particle_event::make( PEV_VIEWER, 0, 0, p ) );
+    viewer_pos = p;
+  }
 
-  void emit_bursts( float dt, bool force, const vec3& inherited_vel = vec3( 0 ) )
+  //deterministic mode: emitters get their random streams from the seed,
+  //and the simulation is advanced in fixed steps regardless of the dt passed to update()
+  //pass step <= 0 to use variable timesteps
+  //the emitters that already exist are reseeded too, so it may be called after create()
+  void set_deterministic( uint64_t s, float step )
   {
-    for( auto& i : bursts )
+    seed = s;
+    fixed_timestep = step;
+    time_accum = 0;
+
+    for( auto& e : emitters )
     {
-      if( force || std::abs( i.first - ( duration - life ) ) < dt )
-      {
-        for( int j = 0; j < i.second; ++j )
-        {
-          emit( dt, false, inherited_vel );
-        }
-      }
+      e.reseed( seed );
     }
   }
 
-  void update_life( float dt )
+  //the inputs of the simulation are appended to rec, pass 0 to stop recording
+  //only the inputs that go through the manager are recorded
+  void set_recording( vector<particle_event>* rec )
   {
-    life -= dt;
+    recording = rec;
+  }
+
+  //how many finished emitters are kept for reuse, 0 disables recycling
+  void set_recycling( int max )
+  {
+    max_recycled = std::max( max, 0 );
 
-    if( is_looping && life < 0 )
+    if( recycled.size() > max_recycled )
     {
-      life += duration;
+      recycled.erase( recycled.begin() + max_recycled, recycled.end() );
     }
   }
 
-  void update_particles( float dt );
+  void set_effect_factory( const std::function<int( particle_manager&, int, const vec3& )>& f )
+  {
+    effect_factory = f;
+  }
 
-  vector<particle>::iterator get_particle_iterator()
+  //creates an effect through the effect factory, this is recorded so it can be replayed
+  //returns the id of the effect's emitter
+  int create_effect( int key, const vec3& pos )
   {
-    return particles.begin();
+    if( !effect_factory )
+    {
+      return -1;
+    }
+
+    record( particle_event::make( PEV_CREATE, key, 0, pos ) );
+
+    //whatever the factory does is part of the effect
+    auto rec = recording;
+    recording = 0;
+    int id = effect_factory( *this, key, pos );
+    recording = rec;
+
+    return id;
   }
 
-  vector<particle>::iterator get_particle_iterator_end()
+  void set_pos( int id, const vec3& p )
   {
-    return particles.end();
+    record( particle_event::make( PEV_POS, id, 0, p ) );
+    auto e = get( id );
+    if( e ) e->pos = p;
   }
 
-  float elapsed_time;
+  void set_dir( int id, const vec3& d )
+  {
+    record( particle_event::make( PEV_DIR, id, 0, d ) );
+    auto e = get( id );
+    if( e ) e->dir = d;
+  }
 
-  void update( float dt )
+  void set_param( int id, particle_param param, float value )
   {
-    if( first_update )
+    record( particle_event::make( PEV_PARAM, id, param, vec3( value, 0, 0 ) ) );
+    auto ptr = get( id );
+
+    if( !ptr )
     {
-      //init container on first update
-      particles.reserve( max_particles );
+      return;
+    }
 
-      //init life
-      life = duration;
+    //overriding a parameter gives the emitter its own settings
+    auto e = &ptr->edit_def();
 
-      elapsed_time = 0;
+    switch( param )
+    {
+    case PARAM_EMIT_PER_SECOND:
+      e->emit_per_second.type = CONSTANT;
+      e->emit_per_second.value = value;
+      break;
+    case PARAM_START_SIZE:
+      e->start_size.type = CONSTANT;
+      e->start_size.value = value;
+      break;
+    case PARAM_START_OPACITY:
+      e->start_opacity.type = CONSTANT;
+      e->start_opacity.value = value;
+      break;
+    case PARAM_START_LIFE:
+      e->start_life.type = CONSTANT;
+      e->start_life.value = value;
+      break;
+    case PARAM_GRAVITY_MULTIPLIER:
+      e->gravity_multiplier = value;
+      break;
+    case PARAM_STRETCH_FACTOR:
+      e->stretch_factor = value;
+      break;
+    case PARAM_IS_LOOPING:
+      e->is_looping = value != 0;
+      break;
+    default:
+      break;
+    }
+  }
 
-      first_update = false;
+  //emits count particles in the next update, regardless of the emitter's own emission
+  void trigger_burst( int id, int count )
+  {
+    record( particle_event::make( PEV_BURST, id, count ) );
+    auto e = get( id );
+    if( e ) e->triggered_burst += count;
+  }
 
-      //prewarm
-      if( is_looping && prewarm )
-      {
-        float time = duration;
-        while( time >= 0 )
-        {
-          float delta = 1 / 60.0f;
-          update( delta );
-          time -= delta;
-        }
-      }
-    }
+  //the emitter stops emitting, and is removed once its particles are gone
+  void stop( int id )
+  {
+    record( particle_event::make( PEV_STOP, id ) );
+    auto e = get( id );
 
-    //update particles
-    update_particles( dt );
+    if( e ) e->is_stopped = true;
+  }
 
-    //bursts
-    if( !is_child )
-      emit_bursts( dt, false );
+  /*
+   * Thread-safe control of the emitters, these can be called from any thread without locking.
+   * The commands are queued, and applied at the start of the next update() in the order they were posted.
+   * Effects are created through the effect factory, and are referred to by the returned handle
+   * which stays valid (and harmless to use) even after the effect is gone.
+   * Stop and kill act on every emitter the factory created for the effect, the sub-emitters too.
+   */
+
+  //returns the handle of the effect, -1 if the queue was full and the effect won't be created
+  //commands posted w/ -1 do nothing
+  int post_create( int key, const vec3& pos )
+  {
+    int handle = handle_counter.fetch_add( 1 );
+    return post( PCMD_CREATE, handle, key, pos ) ? handle : -1;
+  }
 
-    //update life
-    update_life( dt );
+  bool post_pos( int handle, const vec3& pos )
+  {
+    return post( PCMD_POS, handle, 0, pos );
+  }
 
-    //spawn new particles
-    if( !is_child )
-    {
-      elapsed_time += dt;
+  bool post_dir( int handle, const vec3& dir )
+  {
+    return post( PCMD_DIR, handle, 0, dir );
+  }
 
-      float eps = emit_per_second.get( dt, pos, dir );
-      float emit_period = 1 / eps;
+  bool post_param( int handle, particle_param param, float value )
+  {
+    return post( PCMD_PARAM, handle, param, vec3( value, 0, 0 ) );
+  }
 
-      if( elapsed_time > emit_period )
-      {
-        while( elapsed_time > emit_period )
-        {
-          elapsed_time -= emit_period;
-          emit( dt, true );
-        }
-      }
-    }
+  bool post_burst( int handle, int count )
+  {
+    return post( PCMD_BURST, handle, count, vec3( 0 ) );
   }
-};
 
-class particle_manager
-{
-  int id_counter;
-  vector<particle_emitter> emitters;
-public:
+  bool post_stop( int handle )
+  {
+    return post( PCMD_STOP, handle, 0, vec3( 0 ) );
+  }
+
+  bool post_kill( int handle )
+  {
+    return post( PCMD_KILL, handle, 0, vec3( 0 ) );
+  }
+
+  //applies a recorded input
+  void apply( const particle_event& e )
+  {
+    switch( e.type )
+    {
+    case PEV_STEP:
+      update( e.v[0] );
+      break;
+    case PEV_VIEWER:
+      set_viewer( vec3( e.v[0], e.v[1], e.v[2] ) );
+      break;
+    case PEV_BUDGET:
+      set_budget( e.id, e.param );
+      break;
+    case PEV_CREATE:
+      create_effect( e.id, vec3( e.v[0], e.v[1], e.v[2] ) );
+      break;
+    case PEV_REMOVE:
+      remove( e.id );
+      break;
+    case PEV_POS:
+      set_pos( e.id, vec3( e.v[0], e.v[1], e.v[2] ) );
+      break;
+    case PEV_DIR:
+      set_dir( e.id, vec3( e.v[0], e.v[1], e.v[2] ) );
+      break;
+    case PEV_PARAM:
+      set_param( e.id, ( particle_param )e.param, e.v[0] );
+      break;
+    case PEV_BURST:
+      trigger_burst( e.id, e.param );
+      break;
+    case PEV_STOP:
+      stop( e.id );
+      break;
+    default:
+      break;
+    }
+  }
 
   //returns particle emitter id
   //that uniquely identifies the particle emitter
   //and is guaranteed to always work (pointers and refs may be invalidated after an update())
-  int create()
+  //emitters created from the same definition share it, creating one only allocates
+  //when the emitter array has to grow and there is no finished emitter to recycle
+  int create( const std::shared_ptr<const particle_emitter_def>& def = particle_default_def() )
   {
-    emitters.push_back( particle_emitter() );
-    emitters.back().init( id_counter++, this );
+    add_emitter( def ).init( id_counter++, this, seed, def );
     return emitters.back().get_id();
   }
 
@@ -244,134 +1986,298 @@ public:
 
   void remove( int id )
   {
+    record( particle_event::make( PEV_REMOVE, id ) );
+
     auto it = std::find_if( emitters.begin(), emitters.end(), [&]( const particle_emitter& a )
     {
       return a.get_id() == id;
     } );
 
-    emitters.erase( it );
+    if( it != emitters.end() )
+    {
+      retire( *it );
+      emitters.erase( it );
+    }
   }
 
   void init()
   {
     emitters.reserve( 100 );
+    schedule.reserve( 100 );
     id_counter = 0;
+    handle_counter = 0;
+    handles.clear();
+
+    max_live_particles = -1;
+    max_spawns_per_frame = -1;
+    live_particles = 0;
+    viewer_pos = vec3( 0 );
+
+    seed = 0;
+    fixed_timestep = 0;
+    time_accum = 0;
+    max_fixed_steps = 8;
+    recording = 0;
+
+    recycled.clear();
+    max_recycled = 256;
   }
 
   void update( float dt )
   {
-    for( auto& i : emitters )
+    //commands from other threads take effect before the step, and are recorded as regular inputs
+    apply_commands();
+
+    record( particle_event::make( PEV_STEP, 0, 0, vec3( dt, 0, 0 ) ) );
+
+    if( fixed_timestep <= 0 )
+    {
+      simulate( dt );
+      return;
+    }
+
+    time_accum += dt;
+
+    int steps = 0;
+    while( time_accum >= fixed_timestep && steps < max_fixed_steps )
+    {
+      simulate( fixed_timestep );
+      time_accum -= fixed_timestep;
+      ++steps;
+    }
+
+    //fell behind, drop the rest instead of spiraling
+    if( steps == max_fixed_steps )
     {
-      i.update( dt );
+      time_accum = std::min( time_accum, fixed_timestep );
     }
+  }
+
+  void simulate( float dt )
+  {
+    schedule_emission( dt );
 
-    for( auto it = emitters.begin(); it != emitters.end(); ++it )
+    //emitters don't touch each other while updating, sub-emitters get their events afterwards
+    workers.parallel_for( schedule.size(), 1, [&]( int begin, int end )
     {
-      if( !it->is_looping && it->life < 0 && it->particles.size() == 0 )
+      for( int c = begin; c < end; ++c )
       {
-        emitters.erase( it );
-        it = emitters.begin();
+        emitters[schedule[c].second].begin_update();
+      }
+    } );
 
-        if( it == emitters.end() )
-          break;
+    //the chunks of every emitter are spread over the workers, so a single big emitter is parallel too
+    chunk_jobs.clear();
+
+    for( auto& i : schedule )
+    {
+      for( int c = 0; c < emitters[i.second].particles.get_chunk_count(); ++c )
+      {
+        chunk_jobs.push_back( make_pair( i.second, c ) );
+      }
+    }
+
+    workers.parallel_for( chunk_jobs.size(), 1, [&]( int begin, int end )
+    {
+      for( int c = begin; c < end; ++c )
+      {
+        emitters[chunk_jobs[c].first].update_chunk( chunk_jobs[c].second, dt );
+      }
+    } );
+
+    workers.parallel_for( schedule.size(), 1, [&]( int begin, int end )
+    {
+      for( int c = begin; c < end; ++c )
+      {
+        auto& e = emitters[schedule[c].second];
+        e.collect_chunks();
+        e.finish_update( dt );
+      }
+    } );
+
+    dispatch_subemitter_events( dt );
+
+    //retire the finished emitters in one pass, keeping the order of the rest
+    int out = 0;
+
+    for( int c = 0; c < emitters.size(); ++c )
+    {
+      auto& e = emitters[c];
+
+      if( ( e.is_stopped || ( !e.get_def().is_looping && e.life < 0 ) ) && e.particles.empty() )
+      {
+        retire( e );
+        continue;
+      }
+
+      if( out != c )
+      {
+        emitters[out] = std::move( e );
       }
+
+      ++out;
     }
+
+    emitters.erase( emitters.begin() + out, emitters.end() );
   }
 };
 
-void particle_emitter::emit( float dt, bool sub_birth, const vec3& inherited_vel )
+void particle_emitter::spawn( float dt, const vec3& at_pos, const vec3& at_dir, bool sub_birth, const vec3& inherited_vel )
 {
+  particle_rng_scope rng_scope( &rng );
+
   //emit now
-  if( particles.size() < max_particles )
+  if( particles.size() < def->max_particles && pm->grant_spawn( *this ) )
   {
+    particle p;
+
+    float t = def->duration - life;
+    p.pos = def->start_pos.get( t, at_pos, at_dir );
+    p.set_old_pos( p.pos );
+    p.vel = def->start_velocity.get( t, at_pos, at_dir ) + inherited_vel;
+    p.set_color( def->start_color.get( t, at_pos, at_dir ) );
+    p.set_size( def->start_size.get( t, at_pos, at_dir ) );
+    p.set_opacity( def->start_opacity.get( t, at_pos, at_dir ) );
+    p.life = def->start_life.get( t, at_pos, at_dir );
+
+    //only drawn when needed, so the other emitters' streams stay the same
+    p.seed = def->flipbook.random_start ? rng.next() >> 16 : 0;
+
+    particles.push_back( p );
+
     if( sub_birth )
     {
-      for( auto& i : birth_subemitter_ids )
-      {
-        pm->get( i )->emit_bursts( dt, true, inherited_vel );
-      }
+      push_subemitter_events( birth_subemitter_ids, p );
     }
-
-    particles.push_back( particle() );
-    auto& p = particles.back();
-
-    float t = duration - life;
-    p.old_pos = start_pos.get( t, pos, dir );
-    p.pos = p.old_pos;
-    p.vel = start_velocity.get( t, pos, dir ) + inherited_vel;
-    p.color = start_color.get( t, pos, dir );
-    p.size = start_size.get( t, pos, dir );
-    p.opacity = start_opacity.get( t, pos, dir );
-    p.gravity_multiplier = gravity_multiplier;
-    p.life = start_life.get( t, pos, dir );
   }
 }
 
-void particle_emitter::update_particles( float dt )
+//which variant of a module is active, the _over_lifetime one takes precedence
+enum particle_module_mode
+{
+  MODULE_NONE = 0, MODULE_OVER_LIFETIME, MODULE_OVER_SPEED, MODULE_MODE_COUNT
+};
+
+//one fused pass over a chunk of particles, containing only the active modules
+//integrates, evaluates the modules, emits the death events, moves the survivors to the front and computes their bounds
+template< int color_mode, int size_mode, int opacity_mode, bool has_death_events >
+void particle_update_kernel( particle_emitter& e, particle_chunk& chunk, int count, float dt )
 {
-  //TODO new emitter on birth/death
+  const particle_emitter_def& d = e.get_def();
+  //world space down, turned with local space emitters
+  const vec3 gravity = e.to_sim_space( vec3( 0, 10, 0 ), 0 ) * dt * d.gravity_multiplier;
 
-  for( auto& p : particles )
+  particle* out = chunk.data;
+  chunk.reset_bounds();
+
+  for( int c = 0; c < count; ++c )
   {
-    p.old_pos = p.pos;
-    p.vel -= vec3( 0, 10, 0 ) * dt * gravity_multiplier;
+    particle p = chunk.data[c];
+
+    p.set_old_pos( p.pos );
+    p.vel -= gravity;
     p.pos += p.vel * dt;
     p.life -= dt;
-  }
 
-  if( color_over_lifetime )
-  {
-    for( auto& p : particles )
-      p.color = color_over_lifetime( duration - p.life, pos, dir );
-  }
-  else if( color_over_speed )
-  {
-    for( auto& p : particles )
-      p.color = color_over_speed( length( p.vel ), pos, dir );
-  }
+    if( p.life <= 0 )
+    {
+      if( has_death_events )
+        e.push_subemitter_events( e.death_subemitter_ids, p, chunk.death_events );
 
-  if( size_over_lifetime )
-  {
-    for( auto& p : particles )
-      p.size = size_over_lifetime( duration - p.life, pos, dir );
-  }
-  else if( size_over_speed )
-  {
-    for( auto& p : particles )
-      p.size = size_over_speed( length( p.vel ), pos, dir );
+      continue;
+    }
+
+    if( color_mode == MODULE_OVER_LIFETIME )
+      p.set_color( d.color_over_lifetime( d.duration - p.life, e.pos, e.dir ) );
+    else if( color_mode == MODULE_OVER_SPEED )
+      p.set_color( d.color_over_speed( length( p.vel ), e.pos, e.dir ) );
+
+    if( size_mode == MODULE_OVER_LIFETIME )
+      p.set_size( d.size_over_lifetime( d.duration - p.life, e.pos, e.dir ) );
+    else if( size_mode == MODULE_OVER_SPEED )
+      p.set_size( d.size_over_speed( length( p.vel ), e.pos, e.dir ) );
+
+    if( opacity_mode == MODULE_OVER_LIFETIME )
+      p.set_opacity( d.opacity_over_lifetime( d.duration - p.life, e.pos, e.dir ) );
+    else if( opacity_mode == MODULE_OVER_SPEED )
+      p.set_opacity( d.opacity_over_speed( length( p.vel ), e.pos, e.dir ) );
+
+    chunk.grow_bounds( p );
+    *out = p;
+    ++out;
   }
 
-  if( opacity_over_lifetime )
+  chunk.live = out - chunk.data;
+}
+
+typedef void( *particle_kernel )( particle_emitter&, particle_chunk&, int, float );
+
+//returns the kernel specialized for the given module modes
+inline particle_kernel get_particle_kernel( int color_mode, int size_mode, int opacity_mode, bool has_death_events )
+{
+#define PARTICLE_KERNEL( c, s, o ) { particle_update_kernel<c, s, o, false>, particle_update_kernel<c, s, o, true> }
+#define PARTICLE_KERNEL_ROW( c, s ) PARTICLE_KERNEL( c, s, 0 ), PARTICLE_KERNEL( c, s, 1 ), PARTICLE_KERNEL( c, s, 2 )
+#define PARTICLE_KERNEL_TABLE( c ) PARTICLE_KERNEL_ROW( c, 0 ), PARTICLE_KERNEL_ROW( c, 1 ), PARTICLE_KERNEL_ROW( c, 2 )
+
+  static const particle_kernel table[MODULE_MODE_COUNT * MODULE_MODE_COUNT * MODULE_MODE_COUNT][2] =
   {
-    for( auto& p : particles )
-      p.opacity = opacity_over_lifetime( duration - p.life, pos, dir );
-  }
-  else if( opacity_over_speed )
+    PARTICLE_KERNEL_TABLE( 0 ), PARTICLE_KERNEL_TABLE( 1 ), PARTICLE_KERNEL_TABLE( 2 )
+  };
+
+#undef PARTICLE_KERNEL_TABLE
+#undef PARTICLE_KERNEL_ROW
+#undef PARTICLE_KERNEL
+
+  int idx = ( color_mode * MODULE_MODE_COUNT + size_mode ) * MODULE_MODE_COUNT + opacity_mode;
+  return table[idx][has_death_events ? 1 : 0];
+}
+
+void particle_emitter::push_subemitter_events( const vector<int>& ids, const particle& p, vector<subemitter_event>& events ) const
+{
+  //the events are in world space
+  mat4 m = get_transform();
+
+  //a particle at rest has no direction, it gets the emitter's
+  vec3 vel = ( m * vec4( p.vel, 0 ) ).xyz;
+  float speed = length( vel );
+  vec3 vel_dir = speed > 1e-6f ? vel / speed : dir;
+  vec3 world_pos = ( m * vec4( p.pos, 1 ) ).xyz;
+
+  for( auto& i : ids )
   {
-    for( auto& p : particles )
-      p.opacity = opacity_over_speed( length( p.vel ), pos, dir );
+    subemitter_event e;
+    e.pos = world_pos;
+    e.dir = vel_dir;
+    e.vel = vel;
+    e.child_id = i;
+    e.count = 1;
+    events.push_back( e );
   }
+}
 
-  //remove dead
-  for( auto it = particles.begin(); it != particles.end(); ++it )
-  {
-    if( it->life <= 0 )
-    {
-      for( auto& i : death_subemitter_ids )
-      {
-        auto ps = pm->get( i );
-        ps->pos = it->pos;
-        ps->dir = normalize(it->vel);
-        
-        if( ps->inherit_vel )
-          ps->emit_bursts( dt, true, it->vel );
-      }
+void particle_emitter::update_chunk( int c, float dt )
+{
+  int color_mode = def->color_over_lifetime ? MODULE_OVER_LIFETIME : ( def->color_over_speed ? MODULE_OVER_SPEED : MODULE_NONE );
+  int size_mode = def->size_over_lifetime ? MODULE_OVER_LIFETIME : ( def->size_over_speed ? MODULE_OVER_SPEED : MODULE_NONE );
+  int opacity_mode = def->opacity_over_lifetime ? MODULE_OVER_LIFETIME : ( def->opacity_over_speed ? MODULE_OVER_SPEED : MODULE_NONE );
 
-      particles.erase( it );
-      it = particles.begin();
+  //the emitter's stream can't be shared between threads, each chunk gets its own derived from it
+  particle_rng chunk_rng;
+  chunk_rng.seed( rng.state + uint64_t( c ) );
+  particle_rng_scope rng_scope( &chunk_rng );
 
-      if( it == particles.end() )
-        break;
-    }
+  get_particle_kernel( color_mode, size_mode, opacity_mode, !death_subemitter_ids.empty() )( *this, particles.get_chunk( c ), particles.get_chunk_size( c ), dt );
+}
+
+void particle_emitter::collect_chunks()
+{
+  //in chunk order, so the events don't depend on the threads
+  for( int c = 0; c < particles.get_chunk_count(); ++c )
+  {
+    auto& events = particles.get_chunk( c ).death_events;
+    sub_events.insert( sub_events.end(), events.begin(), events.end() );
+    events.clear();
   }
+
+  particles.compact();
 }
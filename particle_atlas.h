@@ -0,0 +1,213 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+/*
+ * Texture atlas
+ *
+ * Packs the particle images into one RGBA8 image at load time, so emitters
+ * with different looks share a texture, and the render queue can draw them
+ * together:
+ *
+ *   particle_atlas a;
+ *   int smoke = a.add( smoke_pixels, 128, 128 );
+ *   int fire = a.add( fire_sheet_pixels, 512, 512 ); //eg. a 4x4 flipbook
+ *   a.build( 4096, 3 ); //3 mip levels
+ *   glTexImage2D( GL_TEXTURE_2D, 0, GL_RGBA8, a.get_width(), a.get_height(), 0, GL_RGBA, GL_UNSIGNED_BYTE, a.get_pixels() );
+ *   glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, a.get_mip_levels() - 1 );
+ *   glGenerateMipmap( GL_TEXTURE_2D );
+ *
+ *   a.get_rect( fire, def->flipbook.uv_rect );
+ *
+ * Images are placed on shelves, tallest first. Every image is surrounded by a
+ * border of its own edge texels, so linear filtering doesn't bleed the
+ * neighbours in. Every mip level halves the border, so it's 2^(levels - 1)
+ * texels wide, and the slots are aligned to it, so a texel of the last level
+ * never covers two images. The levels past get_mip_levels() mix the
+ * neighbours, the texture has to be clamped to them.
+ */
+
+class particle_atlas
+{
+  struct image
+  {
+    std::vector<uint8_t> pixels;
+    int w, h;
+    int x, y; //placement, w/o the border
+  };
+
+  std::vector<image> images;
+  std::vector<uint8_t> pixels;
+  int width, height;
+  int mip_levels;
+
+  //an image w/ the border on both sides, rounded up to the border
+  static int slot_size( int size, int border )
+  {
+    return ( size + border * 3 - 1 ) / border * border;
+  }
+
+  //shelf packing into size x size w/ the slots aligned to the border, false if it doesn't fit
+  bool place( int size, int border )
+  {
+    std::vector<int> order( images.size() );
+
+    for( int c = 0; c < order.size(); ++c )
+    {
+      order[c] = c;
+    }
+
+    std::stable_sort( order.begin(), order.end(), [&]( int a, int b )
+    {
+      return images[a].h > images[b].h;
+    } );
+
+    int x = 0, y = 0, shelf = 0;
+
+    for( int c : order )
+    {
+      auto& i = images[c];
+      int w = slot_size( i.w, border ), h = slot_size( i.h, border );
+
+      if( w > size )
+        return false;
+
+      if( x + w > size )
+      {
+        x = 0;
+        y += shelf;
+        shelf = 0;
+      }
+
+      if( y + h > size )
+        return false;
+
+      i.x = x + border;
+      i.y = y + border;
+      x += w;
+      shelf = std::max( shelf, h );
+    }
+
+    return true;
+  }
+
+public:
+  particle_atlas() : width( 0 ), height( 0 ), mip_levels( 0 )
+  {
+  }
+
+  //copies w * h RGBA8 pixels, returns the index of the image
+  int add( const uint8_t* rgba, int w, int h )
+  {
+    image i;
+    i.pixels.assign( rgba, rgba + w * h * 4 );
+    i.w = w;
+    i.h = h;
+    i.x = i.y = 0;
+    images.push_back( i );
+    return images.size() - 1;
+  }
+
+  //places the images in the smallest power of two square up to max_size, w/ a border for levels mip levels
+  bool build( int max_size = 4096, int levels = 3 )
+  {
+    if( images.empty() )
+    {
+      std::cerr << "Particle atlas: no images." << std::endl;
+      return false;
+    }
+
+    if( levels < 1 || levels > 8 )
+    {
+      std::cerr << "Particle atlas: " << levels << " mip levels, 1 to 8 are supported." << std::endl;
+      return false;
+    }
+
+    int border = 1 << ( levels - 1 );
+
+    int size = 1;
+
+    while( size <= max_size && !place( size, border ) )
+    {
+      size *= 2;
+    }
+
+    if( size > max_size )
+    {
+      std::cerr << "Particle atlas: the images don't fit in " << max_size << "x" << max_size << "." << std::endl;
+      return false;
+    }
+
+    width = height = size;
+    mip_levels = levels;
+    pixels.assign( width * height * 4, 0 );
+
+    for( auto& i : images )
+    {
+      //the border repeats the nearest edge texel, to the end of the aligned slot
+      int right = slot_size( i.w, border ) - border, bottom = slot_size( i.h, border ) - border;
+
+      for( int y = -border; y < bottom; ++y )
+      {
+        int sy = std::min( std::max( y, 0 ), i.h - 1 );
+
+        for( int x = -border; x < right; ++x )
+        {
+          int sx = std::min( std::max( x, 0 ), i.w - 1 );
+          memcpy( &pixels[( ( i.y + y ) * width + i.x + x ) * 4], &i.pixels[( sy * i.w + sx ) * 4], 4 );
+        }
+      }
+    }
+
+    return true;
+  }
+
+  //u0, v0, u1, v1 of an image, valid after build()
+  void get_rect( int idx, float* rect ) const
+  {
+    auto& i = images[idx];
+    rect[0] = i.x / float( width );
+    rect[1] = i.y / float( height );
+    rect[2] = ( i.x + i.w ) / float( width );
+    rect[3] = ( i.y + i.h ) / float( height );
+  }
+
+  const uint8_t* get_pixels() const
+  {
+    return pixels.empty() ? 0 : &pixels[0];
+  }
+
+  int get_width() const
+  {
+    return width;
+  }
+
+  int get_height() const
+  {
+    return height;
+  }
+
+  //the levels the border protects, GL_TEXTURE_MAX_LEVEL is one less, valid after build()
+  int get_mip_levels() const
+  {
+    return mip_levels;
+  }
+
+  int get_image_count() const
+  {
+    return images.size();
+  }
+
+  //drops the copies of the source images, the atlas stays
+  void release_images()
+  {
+    for( auto& i : images )
+    {
+      std::vector<uint8_t>().swap( i.pixels );
+    }
+  }
+};
@@ -0,0 +1,225 @@
+#pragma once
+
+#include "particle_render.h"
+
+#include <cstdint>
+
+/*
+ * Billboard expansion on the CPU
+ *
+ * Turns the instances of a render frame into quads, 4 vertices per particle,
+ * for paths without instancing. The quads are the same as the ones built one
+ * by one by particle_expand_billboard(), the batched version does 4 particles
+ * at a time with the same operations in the same order, so the results are
+ * bit exact as long as the compiler doesn't fuse multiplies and adds on its
+ * own (-ffp-contract=off), otherwise they may differ in the last bit:
+ *
+ *   vector<particle_vertex> v( b.count * 4 );
+ *   particle_expand_billboards( &f.instances[b.first], b.count, f.view.fwd, &v[0] );
+ *
+ * The output is only written, in order, so it can point into a mapped (write-combined) buffer.
+ */
+
+struct particle_vertex
+{
+  float pos[3];
+  float uv[2];
+  float next_uv[3]; //the next flipbook frame's uv, and the blend factor towards it
+  float color[4];
+};
+
+//vertex order and texture coordinates of a quad: lower right, upper right, upper left, lower left
+static const float particle_quad_uv[4][2] = { { 0, 0 }, { 1, 0 }, { 1, 1 }, { 0, 1 } };
+
+//s, t in [0...1] on the quad, mapped into the particle's uv rect
+inline void particle_write_vertex( particle_vertex* out, float s, float t, float x, float y, float z, const particle_instance& p )
+{
+  float w = p.uv[2] - p.uv[0];
+  float h = p.uv[3] - p.uv[1];
+
+  out->pos[0] = x;
+  out->pos[1] = y;
+  out->pos[2] = z;
+  out->uv[0] = p.uv[0] + w * s;
+  out->uv[1] = p.uv[1] + h * t;
+  out->next_uv[0] = p.next_uv[0] + w * s;
+  out->next_uv[1] = p.next_uv[1] + h * t;
+  out->next_uv[2] = p.frame_blend;
+  out->color[0] = p.color[0];
+  out->color[1] = p.color[1];
+  out->color[2] = p.color[2];
+  out->color[3] = p.color[3];
+}
+
+inline void particle_write_vertex( particle_vertex* out, int corner, float x, float y, float z, const particle_instance& p )
+{
+  particle_write_vertex( out, particle_quad_uv[corner][0], particle_quad_uv[corner][1], x, y, z, p );
+}
+
+//one particle, writes 4 vertices, the reference for the batched version
+inline void particle_expand_billboard( const particle_instance& p, const vec3& fwd, particle_vertex* out )
+{
+  vec3 pos( p.pos[0], p.pos[1], p.pos[2] );
+
+  vec3 yaxis = vec3( p.axis[0], p.axis[1], p.axis[2] );
+  vec3 zaxis = fwd;
+  vec3 xaxis = normalize( cross( zaxis, yaxis ) );
+
+  vec3 to_ur = normalize( xaxis + yaxis );
+  vec3 to_ll = -to_ur;
+  vec3 to_lr = normalize( xaxis - yaxis );
+  vec3 to_ul = -to_lr;
+
+  vec3 ll = pos + to_ll * p.size;
+  vec3 lr = pos + to_lr * p.size;
+  vec3 ul = pos + to_ul * p.size;
+  vec3 ur = pos + to_ur * p.size;
+
+  particle_write_vertex( out + 0, 0, lr.x, lr.y, lr.z, p );
+  particle_write_vertex( out + 1, 1, ur.x, ur.y, ur.z, p );
+  particle_write_vertex( out + 2, 2, ul.x, ul.y, ul.z, p );
+  particle_write_vertex( out + 3, 3, ll.x, ll.y, ll.z, p );
+}
+
+namespace particle_billboard_detail
+{
+  //3 component vectors of 4 particles, one register per component
+  struct soa3
+  {
+    __m128 x, y, z;
+  };
+
+  //same rounding as mymath's cross(): fma( -a.zxy, b.yzx, a.yzx * b.zxy )
+  inline soa3 cross( const soa3& a, const soa3& b )
+  {
+    soa3 r;
+    r.x = mm::impl::sse_fma_ps( mm::impl::sse_neg_ps( a.z ), b.y, _mm_mul_ps( a.y, b.z ) );
+    r.y = mm::impl::sse_fma_ps( mm::impl::sse_neg_ps( a.x ), b.z, _mm_mul_ps( a.z, b.x ) );
+    r.z = mm::impl::sse_fma_ps( mm::impl::sse_neg_ps( a.y ), b.x, _mm_mul_ps( a.x, b.y ) );
+    return r;
+  }
+
+  //same as mymath's normalize(): v / sqrt( ( x * x + y * y ) + z * z )
+  inline soa3 normalize( const soa3& v )
+  {
+    __m128 l = _mm_add_ps( _mm_add_ps( _mm_mul_ps( v.x, v.x ), _mm_mul_ps( v.y, v.y ) ), _mm_mul_ps( v.z, v.z ) );
+    l = _mm_sqrt_ps( l );
+
+    soa3 r;
+    r.x = _mm_div_ps( v.x, l );
+    r.y = _mm_div_ps( v.y, l );
+    r.z = _mm_div_ps( v.z, l );
+    return r;
+  }
+
+  inline soa3 add( const soa3& a, const soa3& b )
+  {
+    soa3 r = { _mm_add_ps( a.x, b.x ), _mm_add_ps( a.y, b.y ), _mm_add_ps( a.z, b.z ) };
+    return r;
+  }
+
+  inline soa3 sub( const soa3& a, const soa3& b )
+  {
+    soa3 r = { _mm_sub_ps( a.x, b.x ), _mm_sub_ps( a.y, b.y ), _mm_sub_ps( a.z, b.z ) };
+    return r;
+  }
+
+  inline soa3 mul( const soa3& a, __m128 s )
+  {
+    soa3 r = { _mm_mul_ps( a.x, s ), _mm_mul_ps( a.y, s ), _mm_mul_ps( a.z, s ) };
+    return r;
+  }
+
+  inline soa3 neg( const soa3& a )
+  {
+    soa3 r = { mm::impl::sse_neg_ps( a.x ), mm::impl::sse_neg_ps( a.y ), mm::impl::sse_neg_ps( a.z ) };
+    return r;
+  }
+
+  //4 particles
+  inline void expand4( const particle_instance* in, const soa3& fwd, particle_vertex* out )
+  {
+    soa3 pos, yaxis;
+    pos.x = _mm_setr_ps( in[0].pos[0], in[1].pos[0], in[2].pos[0], in[3].pos[0] );
+    pos.y = _mm_setr_ps( in[0].pos[1], in[1].pos[1], in[2].pos[1], in[3].pos[1] );
+    pos.z = _mm_setr_ps( in[0].pos[2], in[1].pos[2], in[2].pos[2], in[3].pos[2] );
+    yaxis.x = _mm_setr_ps( in[0].axis[0], in[1].axis[0], in[2].axis[0], in[3].axis[0] );
+    yaxis.y = _mm_setr_ps( in[0].axis[1], in[1].axis[1], in[2].axis[1], in[3].axis[1] );
+    yaxis.z = _mm_setr_ps( in[0].axis[2], in[1].axis[2], in[2].axis[2], in[3].axis[2] );
+    __m128 size = _mm_setr_ps( in[0].size, in[1].size, in[2].size, in[3].size );
+
+    soa3 xaxis = normalize( cross( fwd, yaxis ) );
+
+    soa3 to_ur = normalize( add( xaxis, yaxis ) );
+    soa3 to_ll = neg( to_ur );
+    soa3 to_lr = normalize( sub( xaxis, yaxis ) );
+    soa3 to_ul = neg( to_lr );
+
+    soa3 corners[4] =
+    {
+      add( pos, mul( to_lr, size ) ),
+      add( pos, mul( to_ur, size ) ),
+      add( pos, mul( to_ul, size ) ),
+      add( pos, mul( to_ll, size ) )
+    };
+
+    MYMATH_ALIGNED( 16 ) float x[4][4];
+    MYMATH_ALIGNED( 16 ) float y[4][4];
+    MYMATH_ALIGNED( 16 ) float z[4][4];
+
+    for( int c = 0; c < 4; ++c )
+    {
+      _mm_store_ps( x[c], corners[c].x );
+      _mm_store_ps( y[c], corners[c].y );
+      _mm_store_ps( z[c], corners[c].z );
+    }
+
+    for( int i = 0; i < 4; ++i )
+    {
+      for( int c = 0; c < 4; ++c )
+      {
+        particle_write_vertex( out++, c, x[c][i], y[c][i], z[c][i], in[i] );
+      }
+    }
+  }
+}
+
+//count particles, writes count * 4 vertices
+inline void particle_expand_billboards( const particle_instance* in, int count, const vec3& fwd, particle_vertex* out )
+{
+  particle_billboard_detail::soa3 f = { _mm_set1_ps( fwd.x ), _mm_set1_ps( fwd.y ), _mm_set1_ps( fwd.z ) };
+
+  int c = 0;
+
+  for( ; c + 4 <= count; c += 4 )
+  {
+    particle_billboard_detail::expand4( in + c, f, out + c * 4 );
+  }
+
+  //the rest is padded, so every particle goes through the same code
+  if( c < count )
+  {
+    particle_instance tail[4];
+    particle_vertex tail_out[16];
+
+    for( int i = 0; i < 4; ++i )
+    {
+      tail[i] = in[std::min( c + i, count - 1 )];
+    }
+
+    particle_billboard_detail::expand4( tail, f, tail_out );
+    memcpy( out + c * 4, tail_out, ( count - c ) * 4 * sizeof( particle_vertex ) );
+  }
+}
+
+//same, split between the threads of the pool
+inline void particle_expand_billboards( thread_pool& workers, const particle_instance* in, int count, const vec3& fwd, particle_vertex* out )
+{
+  //multiple of 4, so only the last range has a scalar tail
+  const int grain = 1024;
+
+  workers.parallel_for( count, grain, [&]( int begin, int end )
+  {
+    particle_expand_billboards( in + begin, end - begin, fwd, out + begin * 4 );
+  } );
+}
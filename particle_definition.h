@@ -0,0 +1,1351 @@
+#pragma once
+
+#include "particle.h"
+#include "particle_vm.h"
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <iostream>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/*
+ * Binary emitter definitions
+ *
+ * A definition file is a flat blob that can be memory mapped and used in place,
+ * all references inside it are byte offsets from the start of the blob or indices.
+ * Layout: pdef_header, then the arrays it points to.
+ *
+ * Definitions are authored in a line based text format and compiled with pdef_compile():
+ *
+ * #comment
+ * emitter spark
+ *   duration 0.5
+ *   looping 1
+ *   child 1
+ *   additive 1
+ *   inherit_vel 1
+ *   local_space 1                     //particles follow the emitter
+ *   sort none                         //auto / none / back_to_front / front_to_back / bucket
+ *   downsample 2                      //1 / 2 / 4, drawn at full / half / quarter resolution
+ *   uv_rect 0 0 0.5 0.5               //region of the texture, eg. in an atlas
+ *   flipbook 4 4 16                   //cols, rows, optionally frames
+ *   flipbook_cycles 2                 //or flipbook_fps 30
+ *   flipbook_random_start 1
+ *   flipbook_blend 1
+ *   gravity_multiplier 5
+ *   max_particles 50000
+ *   dir 0 1 0
+ *   dir_speed 0                       //start velocity is dir * dir_speed + start_velocity
+ *   start_pos sphere 0 0 0 0.5        //constant v / random v range / sphere v radius / curve name, a single value is broadcast to xyz
+ *   start_velocity sphere 0 0 0 30
+ *   start_size constant 1
+ *   start_life constant 1.5
+ *   emit_per_second constant 0
+ *   burst 0 1                         //time, count
+ *   death_emitter other_emitter_name
+ *   opacity_over_lifetime fade        //curve name
+ *   update_program swirl              //program name
+ * end
+ *
+ * curve fade
+ *   key 0 1                           //x, value (1 or 3 components)
+ *   key 2 0
+ * end
+ *
+ * program swirl                       //see particle_vm.h for the language
+ *   vel = vel + cross( vec3( 0, 1, 0 ), pos - emitter_pos ) * dt
+ *   opacity = opacity * curve( fade, age )
+ * end
+ *
+ * Programs are compiled to bytecode here, instantiating only copies it.
+ */
+
+static const char pdef_magic[4] = { 'P', 'D', 'E', 'F' };
+static const uint32_t pdef_version = 3;
+static const int pdef_max_curve_keys = particle_curve_max_keys;
+static const int pdef_max_name = 32;
+
+enum pdef_property_mode
+{
+  PDEF_CONSTANT = 0, //value
+  PDEF_RANDOM, //value + [-range...range] per component
+  PDEF_SPHERE, //value + random direction * range[0]
+  PDEF_CURVE //curve sampled at the emitter's time
+};
+
+enum pdef_flags
+{
+  PDEF_LOOPING = 1 << 0,
+  PDEF_PREWARM = 1 << 1,
+  PDEF_CHILD = 1 << 2,
+  PDEF_ADDITIVE = 1 << 3,
+  PDEF_STRETCHED = 1 << 4,
+  PDEF_INHERIT_VEL = 1 << 5,
+  PDEF_LOCAL_SPACE = 1 << 6,
+  PDEF_OIT = 1 << 7,
+
+  //the particle_sort_mode is stored in the flags too
+  PDEF_SORT_SHIFT = 8,
+  PDEF_SORT_MASK = 7 << PDEF_SORT_SHIFT,
+
+  //and log2 of the resolution divisor
+  PDEF_DOWNSAMPLE_SHIFT = 11,
+  PDEF_DOWNSAMPLE_MASK = 3 << PDEF_DOWNSAMPLE_SHIFT,
+
+  PDEF_FLIPBOOK_RANDOM_START = 1 << 13,
+  PDEF_FLIPBOOK_BLEND = 1 << 14
+};
+
+typedef particle_curve pdef_curve;
+
+struct pdef_property
+{
+  uint32_t mode;
+  int32_t curve; //index of the curve, if mode is PDEF_CURVE
+  float value[3];
+  float range[3];
+};
+
+struct pdef_burst
+{
+  float time;
+  int32_t count;
+};
+
+struct pdef_emitter
+{
+  char name[pdef_max_name];
+
+  uint32_t flags;
+  float duration;
+  float gravity_multiplier;
+  float stretch_factor;
+  float importance_radius;
+  int32_t max_particles;
+  int32_t priority;
+
+  float dir[3];
+  float dir_speed;
+
+  pdef_property start_pos;
+  pdef_property start_velocity;
+  pdef_property start_color;
+  pdef_property start_size;
+  pdef_property start_opacity;
+  pdef_property emit_per_second;
+  pdef_property start_life;
+
+  //curve indices, -1 if not used
+  int32_t color_over_lifetime;
+  int32_t color_over_speed;
+  int32_t size_over_lifetime;
+  int32_t size_over_speed;
+  int32_t opacity_over_lifetime;
+  int32_t opacity_over_speed;
+
+  uint32_t first_burst, burst_count;
+  uint32_t first_birth_link, birth_link_count; //indices into the link array
+  uint32_t first_death_link, death_link_count;
+
+  int32_t program; //index of the update program, -1 if not used
+
+  float uv_rect[4];
+  int32_t flipbook_cols, flipbook_rows, flipbook_frames;
+  float flipbook_cycles, flipbook_fps;
+};
+
+struct pdef_program
+{
+  char name[pdef_max_name];
+  uint32_t reads, writes;
+  int32_t register_count;
+  uint32_t first_instr, instr_count;
+  uint32_t first_constant, constant_count; //floats, xyz per constant register
+  uint32_t first_curve, curve_count; //indices into the link array, pointing to curves
+};
+
+struct pdef_header
+{
+  char magic[4];
+  uint32_t version;
+  uint32_t size; //size of the whole blob in bytes
+
+  uint32_t emitter_count, emitter_offset;
+  uint32_t curve_count, curve_offset;
+  uint32_t burst_count, burst_offset;
+  uint32_t link_count, link_offset; //links are uint32_t emitter or curve indices
+  uint32_t program_count, program_offset;
+  uint32_t instr_count, instr_offset; //vm_instr
+  uint32_t constant_count, constant_offset; //floats
+};
+
+//read-only view of a definition blob, no parsing or copying takes place
+class pdef_view
+{
+  const char* data;
+  size_t size;
+
+  template< class t >
+  const t* at( uint32_t offset ) const
+  {
+    return reinterpret_cast<const t*>( data + offset );
+  }
+
+  bool check_array( uint32_t offset, uint32_t count, size_t elem_size ) const
+  {
+    return offset <= size && count <= ( size - offset ) / elem_size;
+  }
+
+public:
+  pdef_view() : data( 0 ), size( 0 )
+  {
+  }
+
+  //validates the header and the array bounds, the blob is not copied
+  bool set( const char* d, size_t s )
+  {
+    data = 0;
+    size = 0;
+
+    if( !d || s < sizeof( pdef_header ) )
+    {
+      cerr << "Particle definition: blob too small." << endl;
+      return false;
+    }
+
+    auto h = reinterpret_cast<const pdef_header*>( d );
+
+    if( memcmp( h->magic, pdef_magic, 4 ) != 0 || h->version != pdef_version || h->size > s )
+    {
+      cerr << "Particle definition: invalid header or unsupported version." << endl;
+      return false;
+    }
+
+    data = d;
+    size = h->size;
+
+    if( !check_array( h->emitter_offset, h->emitter_count, sizeof( pdef_emitter ) ) ||
+        !check_array( h->curve_offset, h->curve_count, sizeof( pdef_curve ) ) ||
+        !check_array( h->burst_offset, h->burst_count, sizeof( pdef_burst ) ) ||
+        !check_array( h->link_offset, h->link_count, sizeof( uint32_t ) ) ||
+        !check_array( h->program_offset, h->program_count, sizeof( pdef_program ) ) ||
+        !check_array( h->instr_offset, h->instr_count, sizeof( vm_instr ) ) ||
+        !check_array( h->constant_offset, h->constant_count, sizeof( float ) ) )
+    {
+      cerr << "Particle definition: corrupt array offsets." << endl;
+      data = 0;
+      size = 0;
+      return false;
+    }
+
+    //the ranges of every emitter have to stay inside the burst and link arrays
+    auto in_range = []( uint32_t first, uint32_t n, uint32_t count ) -> bool
+    {
+      return first <= count && n <= count - first;
+    };
+
+    for( uint32_t c = 0; c < h->emitter_count; ++c )
+    {
+      auto& e = at<pdef_emitter>( h->emitter_offset )[c];
+
+      if( !in_range( e.first_burst, e.burst_count, h->burst_count ) ||
+          !in_range( e.first_birth_link, e.birth_link_count, h->link_count ) ||
+          !in_range( e.first_death_link, e.death_link_count, h->link_count ) )
+      {
+        cerr << "Particle definition: corrupt ranges in emitter " << c << endl;
+        data = 0;
+        size = 0;
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  bool is_valid() const
+  {
+    return data != 0;
+  }
+
+  const pdef_header& header() const
+  {
+    return *at<pdef_header>( 0 );
+  }
+
+  uint32_t get_emitter_count() const
+  {
+    return header().emitter_count;
+  }
+
+  const pdef_emitter& get_emitter( uint32_t i ) const
+  {
+    return at<pdef_emitter>( header().emitter_offset )[i];
+  }
+
+  const pdef_curve* get_curve( int32_t i ) const
+  {
+    if( i < 0 || uint32_t( i ) >= header().curve_count )
+    {
+      return 0;
+    }
+
+    return at<pdef_curve>( header().curve_offset ) + i;
+  }
+
+  //returns a copy of the curve, or an empty curve if the index is invalid
+  pdef_curve copy_curve( int32_t i ) const
+  {
+    const pdef_curve* c = get_curve( i );
+
+    if( c )
+    {
+      return *c;
+    }
+
+    pdef_curve empty;
+    empty.key_count = 0;
+    return empty;
+  }
+
+  const pdef_burst& get_burst( uint32_t i ) const
+  {
+    return at<pdef_burst>( header().burst_offset )[i];
+  }
+
+  uint32_t get_link( uint32_t i ) const
+  {
+    return at<uint32_t>( header().link_offset )[i];
+  }
+
+  const pdef_program* get_program( int32_t i ) const
+  {
+    if( i < 0 || uint32_t( i ) >= header().program_count )
+    {
+      return 0;
+    }
+
+    return at<pdef_program>( header().program_offset ) + i;
+  }
+
+  //copies the bytecode of the program into p
+  //returns false if the index or the program's ranges are invalid
+  bool copy_program( int32_t i, particle_program& p ) const
+  {
+    const pdef_program* d = get_program( i );
+    const pdef_header& h = header();
+
+    if( !d || d->first_instr > h.instr_count || d->instr_count > h.instr_count - d->first_instr ||
+        d->first_constant > h.constant_count || d->constant_count > h.constant_count - d->first_constant ||
+        d->first_curve > h.link_count || d->curve_count > h.link_count - d->first_curve ||
+        d->constant_count % 3 != 0 ||
+        d->register_count < int32_t( VM_ATTR_COUNT + d->constant_count / 3 ) || d->register_count > vm_max_registers )
+    {
+      return false;
+    }
+
+    auto code = at<vm_instr>( h.instr_offset ) + d->first_instr;
+    auto constants = at<float>( h.constant_offset ) + d->first_constant;
+
+    p.code.assign( code, code + d->instr_count );
+    p.constants.assign( constants, constants + d->constant_count );
+    p.curves.clear();
+    p.curve_sources.clear();
+
+    for( uint32_t c = 0; c < d->curve_count; ++c )
+    {
+      p.curves.push_back( copy_curve( get_link( d->first_curve + c ) ) );
+      p.curve_sources.push_back( get_link( d->first_curve + c ) );
+    }
+
+    p.reads = d->reads;
+    p.writes = d->writes;
+    p.register_count = d->register_count;
+
+    //registers are bytes, make sure the code stays inside the register file
+    for( auto& in : p.code )
+    {
+      if( in.dst >= p.register_count || in.a >= p.register_count || in.b >= p.register_count ||
+          ( in.op == VM_CURVE ? in.c >= p.curves.size() : in.c >= p.register_count ) )
+      {
+        p.code.clear();
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  //returns the index of the emitter with the given name, or -1
+  int find_emitter( const std::string& name ) const
+  {
+    for( uint32_t c = 0; c < get_emitter_count(); ++c )
+    {
+      if( strncmp( get_emitter( c ).name, name.c_str(), pdef_max_name ) == 0 )
+      {
+        return c;
+      }
+    }
+
+    return -1;
+  }
+};
+
+//read-only memory mapped file
+class mapped_file
+{
+  const char* data;
+  size_t size;
+
+#ifdef _WIN32
+  HANDLE file, mapping;
+#else
+  int fd;
+#endif
+
+  mapped_file( const mapped_file& );
+  mapped_file& operator=( const mapped_file& );
+
+public:
+  mapped_file() : data( 0 ), size( 0 )
+  {
+#ifdef _WIN32
+    file = INVALID_HANDLE_VALUE;
+    mapping = 0;
+#else
+    fd = -1;
+#endif
+  }
+
+  ~mapped_file()
+  {
+    close();
+  }
+
+  bool open( const std::string& path )
+  {
+    close();
+
+#ifdef _WIN32
+    file = CreateFileA( path.c_str(), GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0 );
+
+    if( file == INVALID_HANDLE_VALUE )
+    {
+      cerr << "Couldn't open file: " << path << endl;
+      return false;
+    }
+
+    LARGE_INTEGER s;
+    GetFileSizeEx( file, &s );
+    size = (size_t)s.QuadPart;
+
+    mapping = CreateFileMappingA( file, 0, PAGE_READONLY, 0, 0, 0 );
+
+    if( mapping )
+    {
+      data = (const char*)MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 );
+    }
+#else
+    fd = ::open( path.c_str(), O_RDONLY );
+
+    if( fd < 0 )
+    {
+      cerr << "Couldn't open file: " << path << endl;
+      return false;
+    }
+
+    struct stat st;
+    fstat( fd, &st );
+    size = st.st_size;
+
+    void* ptr = mmap( 0, size, PROT_READ, MAP_PRIVATE, fd, 0 );
+    data = ptr == MAP_FAILED ? 0 : (const char*)ptr;
+#endif
+
+    if( !data )
+    {
+      cerr << "Couldn't map file: " << path << endl;
+      close();
+      return false;
+    }
+
+    return true;
+  }
+
+  void close()
+  {
+#ifdef _WIN32
+    if( data ) UnmapViewOfFile( data );
+    if( mapping ) CloseHandle( mapping );
+    if( file != INVALID_HANDLE_VALUE ) CloseHandle( file );
+    file = INVALID_HANDLE_VALUE;
+    mapping = 0;
+#else
+    if( data ) munmap( (void*)data, size );
+    if( fd >= 0 ) ::close( fd );
+    fd = -1;
+#endif
+
+    data = 0;
+    size = 0;
+  }
+
+  const char* get_data() const
+  {
+    return data;
+  }
+
+  size_t get_size() const
+  {
+    return size;
+  }
+};
+
+//a definition file mapped into memory
+//along with the emitter settings built from it, shared by all the instances
+class pdef_file
+{
+  mapped_file file;
+  pdef_view view;
+  vector<std::shared_ptr<const particle_emitter_def> > defs;
+public:
+  bool load( const std::string& path )
+  {
+    defs.clear();
+
+    if( !file.open( path ) )
+    {
+      return false;
+    }
+
+    if( !view.set( file.get_data(), file.get_size() ) )
+    {
+      return false;
+    }
+
+    defs.resize( view.get_emitter_count() );
+    return true;
+  }
+
+  const pdef_view& get_view() const
+  {
+    return view;
+  }
+
+  vector<std::shared_ptr<const particle_emitter_def> >& get_defs()
+  {
+    return defs;
+  }
+};
+
+inline vec3 pdef_random_dir()
+{
+  //rejection sampling in the unit cube
+  vec3 v;
+  float l;
+  do
+  {
+    v = vec3( particle_random( -1, 1 ), particle_random( -1, 1 ), particle_random( -1, 1 ) );
+    l = dot( v, v );
+  }
+  while( l > 1 || l < 0.0001f );
+
+  return v / std::sqrt( l );
+}
+
+inline vec3 pdef_eval( const pdef_property& p, const pdef_curve* curve, float t )
+{
+  vec3 v( p.value[0], p.value[1], p.value[2] );
+
+  switch( p.mode )
+  {
+  case PDEF_RANDOM:
+    return v + vec3( particle_random( -p.range[0], p.range[0] ),
+                     particle_random( -p.range[1], p.range[1] ),
+                     particle_random( -p.range[2], p.range[2] ) );
+  case PDEF_SPHERE:
+    return v + pdef_random_dir() * p.range[0];
+  case PDEF_CURVE:
+    return curve ? curve->get( t ) : v;
+  default:
+    return v;
+  }
+}
+
+//sets up an animable property from the definition
+//constants stay constants, everything else is turned into a function
+template< class t, class f >
+void pdef_set_property( animable_property<t>& prop, const pdef_property& p, const pdef_view& v, const f& convert )
+{
+  if( p.mode == PDEF_CONSTANT )
+  {
+    prop.type = CONSTANT;
+    prop.value = convert( vec3( p.value[0], p.value[1], p.value[2] ) );
+    return;
+  }
+
+  pdef_property pc = p;
+  pdef_curve curve = v.copy_curve( p.curve );
+
+  prop.type = FUNCTION;
+  prop.func = [=]( float time, const vec3&, const vec3& ) -> t
+  {
+    return convert( pdef_eval( pc, &curve, time ) );
+  };
+}
+
+namespace pdef_detail
+{
+  inline vec3 to_vec3( const vec3& v )
+  {
+    return v;
+  }
+
+  inline float to_float( const vec3& v )
+  {
+    return v.x;
+  }
+
+  //builds the shared emitter settings of the definition at idx
+  inline std::shared_ptr<particle_emitter_def> make_def( const pdef_view& v, uint32_t idx )
+  {
+    const pdef_emitter& d = v.get_emitter( idx );
+    auto ps = std::make_shared<particle_emitter_def>();
+
+    ps->duration = d.duration;
+    ps->is_looping = ( d.flags & PDEF_LOOPING ) != 0;
+    ps->prewarm = ( d.flags & PDEF_PREWARM ) != 0;
+    ps->is_child = ( d.flags & PDEF_CHILD ) != 0;
+    ps->is_additive = ( d.flags & PDEF_ADDITIVE ) != 0;
+    ps->is_stretched = ( d.flags & PDEF_STRETCHED ) != 0;
+    ps->inherit_vel = ( d.flags & PDEF_INHERIT_VEL ) != 0;
+    ps->is_local_space = ( d.flags & PDEF_LOCAL_SPACE ) != 0;
+    ps->is_oit = ( d.flags & PDEF_OIT ) != 0;
+    ps->sort_mode = std::min( ( d.flags & PDEF_SORT_MASK ) >> PDEF_SORT_SHIFT, (uint32_t)PARTICLE_SORT_BUCKET );
+    ps->downsample = 1 << std::min( ( d.flags & PDEF_DOWNSAMPLE_MASK ) >> PDEF_DOWNSAMPLE_SHIFT, 2u );
+    ps->stretch_factor = d.stretch_factor;
+    ps->gravity_multiplier = d.gravity_multiplier;
+    ps->max_particles = d.max_particles;
+    ps->priority = d.priority;
+    ps->importance_radius = d.importance_radius;
+
+    memcpy( ps->flipbook.uv_rect, d.uv_rect, sizeof( d.uv_rect ) );
+    ps->flipbook.cols = std::max( d.flipbook_cols, 1 );
+    ps->flipbook.rows = std::max( d.flipbook_rows, 1 );
+    ps->flipbook.frames = std::max( d.flipbook_frames, 0 );
+    ps->flipbook.cycles = d.flipbook_cycles;
+    ps->flipbook.fps = d.flipbook_fps;
+    ps->flipbook.random_start = ( d.flags & PDEF_FLIPBOOK_RANDOM_START ) != 0;
+    ps->flipbook.blend = ( d.flags & PDEF_FLIPBOOK_BLEND ) != 0;
+
+    pdef_set_property( ps->start_color, d.start_color, v, to_vec3 );
+    pdef_set_property( ps->start_size, d.start_size, v, to_float );
+    pdef_set_property( ps->start_opacity, d.start_opacity, v, to_float );
+    pdef_set_property( ps->emit_per_second, d.emit_per_second, v, to_float );
+    pdef_set_property( ps->start_life, d.start_life, v, to_float );
+
+    //start position is relative to the emitter position
+    pdef_property sp = d.start_pos;
+    pdef_curve sp_curve = v.copy_curve( sp.curve );
+    ps->start_pos.type = FUNCTION;
+    ps->start_pos.func = [=]( float t, const vec3& p, const vec3& ) -> vec3
+    {
+      return p + pdef_eval( sp, &sp_curve, t );
+    };
+
+    //start velocity is relative to the emitter direction
+    pdef_property sv = d.start_velocity;
+    pdef_curve sv_curve = v.copy_curve( sv.curve );
+    float dir_speed = d.dir_speed;
+    ps->start_velocity.type = FUNCTION;
+    ps->start_velocity.func = [=]( float t, const vec3&, const vec3& dir ) -> vec3
+    {
+      return dir * dir_speed + pdef_eval( sv, &sv_curve, t );
+    };
+
+    auto curve_func = [&]( int32_t i ) -> std::function<vec3( float, const vec3&, const vec3& )>
+    {
+      const pdef_curve* c = v.get_curve( i );
+      if( !c ) return nullptr;
+      pdef_curve curve = *c;
+      return [=]( float x, const vec3&, const vec3& ) -> vec3
+      {
+        return curve.get( x );
+      };
+    };
+
+    auto curve_func_scalar = [&]( int32_t i ) -> std::function<float( float, const vec3&, const vec3& )>
+    {
+      const pdef_curve* c = v.get_curve( i );
+      if( !c ) return nullptr;
+      pdef_curve curve = *c;
+      return [=]( float x, const vec3&, const vec3& ) -> float
+      {
+        return curve.get( x ).x;
+      };
+    };
+
+    ps->color_over_lifetime = curve_func( d.color_over_lifetime );
+    ps->color_over_speed = curve_func( d.color_over_speed );
+    ps->size_over_lifetime = curve_func_scalar( d.size_over_lifetime );
+    ps->size_over_speed = curve_func_scalar( d.size_over_speed );
+    ps->opacity_over_lifetime = curve_func_scalar( d.opacity_over_lifetime );
+    ps->opacity_over_speed = curve_func_scalar( d.opacity_over_speed );
+
+    for( uint32_t c = 0; c < d.burst_count; ++c )
+    {
+      const pdef_burst& b = v.get_burst( d.first_burst + c );
+      ps->bursts.push_back( make_pair( b.time, (int)b.count ) );
+    }
+
+    if( d.program >= 0 )
+    {
+      auto prog = std::make_shared<particle_program>();
+
+      if( v.copy_program( d.program, *prog ) )
+      {
+        particle_attach_program( *ps, prog );
+      }
+      else
+      {
+        cerr << "Particle definition: invalid program in emitter " << d.name << endl;
+      }
+    }
+
+    return ps;
+  }
+
+  //defs: the shared settings per emitter definition, built on demand
+  inline int instantiate( particle_manager& pm, const pdef_view& v, uint32_t idx, const vec3& pos, vector<int>& ids, vector<std::shared_ptr<const particle_emitter_def> >& defs )
+  {
+    if( ids[idx] >= 0 )
+    {
+      return ids[idx];
+    }
+
+    const pdef_emitter& d = v.get_emitter( idx );
+
+    if( !defs[idx] )
+    {
+      defs[idx] = make_def( v, idx );
+    }
+
+    int id = pm.create( defs[idx] );
+    ids[idx] = id;
+
+    //children first, the create() calls may invalidate pointers
+    vector<int> birth, death;
+    for( uint32_t c = 0; c < d.birth_link_count; ++c )
+    {
+      uint32_t l = v.get_link( d.first_birth_link + c );
+      if( l < v.get_emitter_count() )
+        birth.push_back( instantiate( pm, v, l, pos, ids, defs ) );
+    }
+
+    for( uint32_t c = 0; c < d.death_link_count; ++c )
+    {
+      uint32_t l = v.get_link( d.first_death_link + c );
+      if( l < v.get_emitter_count() )
+        death.push_back( instantiate( pm, v, l, pos, ids, defs ) );
+    }
+
+    auto ps = pm.get( id );
+
+    ps->pos = pos;
+    ps->dir = vec3( d.dir[0], d.dir[1], d.dir[2] );
+    ps->birth_subemitter_ids = birth;
+    ps->death_subemitter_ids = death;
+
+    return id;
+  }
+}
+
+//creates the emitter at idx, and all the sub-emitters it links to
+//the emitter settings are built for this call only, use pdef_file to share them between instances
+//returns the id of the emitter, or -1 on error
+inline int pdef_instantiate( particle_manager& pm, const pdef_view& v, uint32_t idx, const vec3& pos = vec3( 0 ) )
+{
+  if( !v.is_valid() || idx >= v.get_emitter_count() )
+  {
+    return -1;
+  }
+
+  vector<int> ids( v.get_emitter_count(), -1 );
+  vector<std::shared_ptr<const particle_emitter_def> > defs( v.get_emitter_count() );
+  return pdef_detail::instantiate( pm, v, idx, pos, ids, defs );
+}
+
+//same as above, but every instance of the file's effects shares the same settings
+inline int pdef_instantiate( particle_manager& pm, pdef_file& f, uint32_t idx, const vec3& pos = vec3( 0 ) )
+{
+  const pdef_view& v = f.get_view();
+
+  if( !v.is_valid() || idx >= v.get_emitter_count() )
+  {
+    return -1;
+  }
+
+  vector<int> ids( v.get_emitter_count(), -1 );
+  return pdef_detail::instantiate( pm, v, idx, pos, ids, f.get_defs() );
+}
+
+//compiles the text format into a binary blob
+//returns false and prints the error on failure
+inline bool pdef_compile( const std::string& text, vector<char>& out )
+{
+  struct emitter_src
+  {
+    pdef_emitter e;
+    vector<pdef_burst> bursts;
+    vector<std::string> birth, death;
+    std::string curves[7 + 6]; //curve names of the properties and the modules
+    std::string program;
+  };
+
+  vector<emitter_src> emitters;
+  vector<pdef_curve> curves;
+  vector<std::string> curve_names;
+  vector<std::string> program_names, program_sources;
+
+  std::stringstream ss( text );
+  std::string line;
+  int line_num = 0;
+
+  enum
+  {
+    NONE, EMITTER, CURVE, PROGRAM
+  } block = NONE;
+
+  auto fail = [&]( const std::string& msg ) -> bool
+  {
+    cerr << "Particle definition, line " << line_num << ": " << msg << endl;
+    return false;
+  };
+
+  //numbers left on the line, the stream is left where it was
+  auto count_numbers = []( std::stringstream& l ) -> int
+  {
+    auto pos = l.tellg();
+
+    if( pos < 0 )
+    {
+      return 0;
+    }
+
+    int n = 0;
+    float f;
+
+    while( l >> f )
+    {
+      ++n;
+    }
+
+    l.clear();
+    l.seekg( pos );
+    return n;
+  };
+
+  //reads count values, or a single value broadcast to all of them if the line doesn't have enough for count
+  //and the rest numbers that have to follow (eg. 1 for a range, which may be broadcast too)
+  auto read_vec = [&]( std::stringstream& l, float* v, int count, int rest = 0, bool broadcast = true ) -> bool
+  {
+    if( broadcast && count > 1 && count_numbers( l ) < count + rest )
+    {
+      if( !( l >> v[0] ) )
+      {
+        return false;
+      }
+
+      for( int c = 1; c < count; ++c )
+      {
+        v[c] = v[0];
+      }
+
+      return true;
+    }
+
+    for( int c = 0; c < count; ++c )
+    {
+      if( !( l >> v[c] ) )
+      {
+        return false;
+      }
+    }
+
+    return true;
+  };
+
+  while( std::getline( ss, line ) )
+  {
+    ++line_num;
+
+    //program lines are kept as they are, they are compiled after all the curves are known
+    if( block == PROGRAM )
+    {
+      std::stringstream l( line );
+      std::string key;
+
+      if( l >> key && key == "end" )
+        block = NONE;
+      else
+        program_sources.back() += line + "\n";
+
+      continue;
+    }
+
+    size_t comment = line.find( '#' );
+    if( comment != std::string::npos )
+      line = line.substr( 0, comment );
+
+    std::stringstream l( line );
+    std::string key;
+
+    if( !( l >> key ) )
+      continue;
+
+    if( block == NONE )
+    {
+      std::string name;
+      if( !( l >> name ) || name.size() >= pdef_max_name )
+        return fail( "missing or too long name" );
+
+      if( key == "emitter" )
+      {
+        emitters.push_back( emitter_src() );
+        auto& e = emitters.back().e;
+        memset( &e, 0, sizeof( e ) );
+        strncpy( e.name, name.c_str(), pdef_max_name - 1 );
+        e.duration = 1;
+        e.stretch_factor = 1;
+        e.importance_radius = 1;
+        e.max_particles = 1000;
+        e.dir[1] = 1;
+        e.start_color.value[0] = e.start_color.value[1] = e.start_color.value[2] = 1;
+        e.start_size.value[0] = 1;
+        e.start_opacity.value[0] = 1;
+        e.start_life.value[0] = 1;
+        e.program = -1;
+        e.uv_rect[2] = e.uv_rect[3] = 1;
+        e.flipbook_cols = e.flipbook_rows = 1;
+        e.flipbook_cycles = 1;
+        block = EMITTER;
+      }
+      else if( key == "curve" )
+      {
+        curves.push_back( pdef_curve() );
+        memset( &curves.back(), 0, sizeof( pdef_curve ) );
+        curve_names.push_back( name );
+        block = CURVE;
+      }
+      else if( key == "program" )
+      {
+        program_names.push_back( name );
+        program_sources.push_back( std::string() );
+        block = PROGRAM;
+      }
+      else
+      {
+        return fail( "expected emitter, curve or program, got " + key );
+      }
+
+      continue;
+    }
+
+    if( key == "end" )
+    {
+      block = NONE;
+      continue;
+    }
+
+    if( block == CURVE )
+    {
+      auto& c = curves.back();
+
+      if( key != "key" || c.key_count >= pdef_max_curve_keys )
+        return fail( "expected key, or too many keys" );
+
+      if( !( l >> c.x[c.key_count] ) || !read_vec( l, c.value[c.key_count], 3 ) )
+        return fail( "invalid key" );
+
+      if( c.key_count > 0 && c.x[c.key_count] <= c.x[c.key_count - 1] )
+        return fail( "keys must be in increasing order" );
+
+      ++c.key_count;
+      continue;
+    }
+
+    auto& src = emitters.back();
+    auto& e = src.e;
+
+    static const char* flag_names[] = { "looping", "prewarm", "child", "additive", "stretched", "inherit_vel", "local_space", "oit" };
+    static const char* sort_names[] = { "auto", "none", "back_to_front", "front_to_back", "bucket" };
+    static const char* prop_names[] = { "start_pos", "start_velocity", "start_color", "start_size", "start_opacity", "emit_per_second", "start_life" };
+    static const char* module_names[] = { "color_over_lifetime", "color_over_speed", "size_over_lifetime", "size_over_speed", "opacity_over_lifetime", "opacity_over_speed" };
+    pdef_property* props[] = { &e.start_pos, &e.start_velocity, &e.start_color, &e.start_size, &e.start_opacity, &e.emit_per_second, &e.start_life };
+
+    bool found = false;
+
+    for( int c = 0; c < 8 && !found; ++c )
+    {
+      if( key == flag_names[c] )
+      {
+        int v = 0;
+        if( !( l >> v ) )
+          return fail( "expected 0 or 1" );
+
+        if( v )
+          e.flags |= 1 << c;
+        else
+          e.flags &= ~( 1 << c );
+
+        found = true;
+      }
+    }
+
+    for( int c = 0; c < 7 && !found; ++c )
+    {
+      if( key == prop_names[c] )
+      {
+        pdef_property& p = *props[c];
+        std::string mode;
+        l >> mode;
+
+        int comps = c < 3 ? 3 : 1;
+        bool ok = true;
+
+        if( mode == "constant" )
+        {
+          p.mode = PDEF_CONSTANT;
+          ok = read_vec( l, p.value, comps );
+        }
+        else if( mode == "random" )
+        {
+          p.mode = PDEF_RANDOM;
+          ok = read_vec( l, p.value, comps, 1 ) && read_vec( l, p.range, comps );
+        }
+        else if( mode == "sphere" )
+        {
+          p.mode = PDEF_SPHERE;
+          ok = read_vec( l, p.value, comps, 1 ) && ( l >> p.range[0] );
+        }
+        else if( mode == "curve" )
+        {
+          p.mode = PDEF_CURVE;
+          ok = !!( l >> src.curves[c] );
+        }
+        else
+        {
+          return fail( "unknown property mode " + mode );
+        }
+
+        if( !ok )
+          return fail( "invalid value for " + key );
+
+        found = true;
+      }
+    }
+
+    for( int c = 0; c < 6 && !found; ++c )
+    {
+      if( key == module_names[c] )
+      {
+        if( !( l >> src.curves[7 + c] ) )
+          return fail( "expected curve name" );
+
+        found = true;
+      }
+    }
+
+    if( found )
+      continue;
+
+    bool ok = true;
+
+    if( key == "duration" ) ok = !!( l >> e.duration );
+    else if( key == "gravity_multiplier" ) ok = !!( l >> e.gravity_multiplier );
+    else if( key == "stretch_factor" ) ok = !!( l >> e.stretch_factor );
+    else if( key == "importance_radius" ) ok = !!( l >> e.importance_radius );
+    else if( key == "max_particles" ) ok = !!( l >> e.max_particles );
+    else if( key == "priority" ) ok = !!( l >> e.priority );
+    else if( key == "dir" ) ok = read_vec( l, e.dir, 3 );
+    else if( key == "dir_speed" ) ok = !!( l >> e.dir_speed );
+    else if( key == "burst" )
+    {
+      pdef_burst b;
+      ok = !!( l >> b.time >> b.count );
+      src.bursts.push_back( b );
+    }
+    else if( key == "update_program" ) ok = !!( l >> src.program );
+    else if( key == "sort" )
+    {
+      std::string name;
+      ok = false;
+
+      if( l >> name )
+      {
+        for( int c = 0; c < 5; ++c )
+        {
+          if( name == sort_names[c] )
+          {
+            e.flags = ( e.flags & ~PDEF_SORT_MASK ) | ( c << PDEF_SORT_SHIFT );
+            ok = true;
+          }
+        }
+      }
+    }
+    else if( key == "downsample" )
+    {
+      int divisor = 0;
+      ok = !!( l >> divisor ) && ( divisor == 1 || divisor == 2 || divisor == 4 );
+
+      if( ok )
+      {
+        e.flags = ( e.flags & ~PDEF_DOWNSAMPLE_MASK ) | ( ( divisor >> 1 ) << PDEF_DOWNSAMPLE_SHIFT );
+      }
+    }
+    else if( key == "uv_rect" ) ok = read_vec( l, e.uv_rect, 4, 0, false ); //one value isn't a rect
+    else if( key == "flipbook" )
+    {
+      ok = !!( l >> e.flipbook_cols >> e.flipbook_rows ) && e.flipbook_cols > 0 && e.flipbook_rows > 0;
+
+      if( ok && !( l >> e.flipbook_frames ) )
+      {
+        e.flipbook_frames = 0;
+      }
+    }
+    else if( key == "flipbook_cycles" ) ok = !!( l >> e.flipbook_cycles );
+    else if( key == "flipbook_fps" ) ok = !!( l >> e.flipbook_fps );
+    else if( key == "flipbook_random_start" || key == "flipbook_blend" )
+    {
+      int v = 0;
+      ok = !!( l >> v );
+      uint32_t bit = key == "flipbook_blend" ? PDEF_FLIPBOOK_BLEND : PDEF_FLIPBOOK_RANDOM_START;
+      e.flags = v ? e.flags | bit : e.flags & ~bit;
+    }
+    else if( key == "birth_emitter" || key == "death_emitter" )
+    {
+      std::string name;
+      ok = !!( l >> name );
+      ( key == "birth_emitter" ? src.birth : src.death ).push_back( name );
+    }
+    else
+    {
+      return fail( "unknown setting " + key );
+    }
+
+    if( !ok )
+      return fail( "invalid value for " + key );
+  }
+
+  if( block != NONE )
+    return fail( "missing end" );
+
+  auto find_curve = [&]( const std::string& name ) -> int32_t
+  {
+    if( name.empty() )
+      return -1;
+
+    auto it = std::find( curve_names.begin(), curve_names.end(), name );
+    return it == curve_names.end() ? -2 : int32_t( it - curve_names.begin() );
+  };
+
+  auto find_emitter = [&]( const std::string& name ) -> int32_t
+  {
+    for( int c = 0; c < emitters.size(); ++c )
+    {
+      if( name == emitters[c].e.name )
+        return c;
+    }
+
+    return -1;
+  };
+
+  //resolve names, flatten the arrays
+  vector<pdef_emitter> out_emitters;
+  vector<pdef_burst> out_bursts;
+  vector<uint32_t> out_links;
+  vector<pdef_program> out_programs;
+  vector<vm_instr> out_instrs;
+  vector<float> out_constants;
+
+  for( int c = 0; c < program_names.size(); ++c )
+  {
+    particle_program prog;
+
+    if( !prog.compile( program_sources[c], curve_names, curves ) )
+    {
+      cerr << "Particle definition: couldn't compile program " << program_names[c] << endl;
+      return false;
+    }
+
+    pdef_program p;
+    memset( &p, 0, sizeof( p ) );
+    strncpy( p.name, program_names[c].c_str(), pdef_max_name - 1 );
+    p.reads = prog.reads;
+    p.writes = prog.writes;
+    p.register_count = prog.register_count;
+    p.first_instr = out_instrs.size();
+    p.instr_count = prog.code.size();
+    p.first_constant = out_constants.size();
+    p.constant_count = prog.constants.size();
+    p.first_curve = out_links.size();
+    p.curve_count = prog.curves.size();
+
+    out_instrs.insert( out_instrs.end(), prog.code.begin(), prog.code.end() );
+    out_constants.insert( out_constants.end(), prog.constants.begin(), prog.constants.end() );
+
+    //the program holds copies of the curves it uses, store them as references
+    out_links.insert( out_links.end(), prog.curve_sources.begin(), prog.curve_sources.end() );
+
+    out_programs.push_back( p );
+  }
+
+  for( auto& src : emitters )
+  {
+    pdef_emitter e = src.e;
+    pdef_property* props[] = { &e.start_pos, &e.start_velocity, &e.start_color, &e.start_size, &e.start_opacity, &e.emit_per_second, &e.start_life };
+    int32_t* modules[] = { &e.color_over_lifetime, &e.color_over_speed, &e.size_over_lifetime, &e.size_over_speed, &e.opacity_over_lifetime, &e.opacity_over_speed };
+
+    for( int c = 0; c < 13; ++c )
+    {
+      int32_t idx = find_curve( src.curves[c] );
+
+      if( idx == -2 )
+      {
+        cerr << "Particle definition: unknown curve " << src.curves[c] << " in emitter " << e.name << endl;
+        return false;
+      }
+
+      if( c < 7 )
+        props[c]->curve = idx;
+      else
+        *modules[c - 7] = idx;
+    }
+
+    if( !src.program.empty() )
+    {
+      auto it = std::find( program_names.begin(), program_names.end(), src.program );
+
+      if( it == program_names.end() )
+      {
+        cerr << "Particle definition: unknown program " << src.program << " in emitter " << e.name << endl;
+        return false;
+      }
+
+      e.program = it - program_names.begin();
+    }
+
+    e.first_burst = out_bursts.size();
+    e.burst_count = src.bursts.size();
+    out_bursts.insert( out_bursts.end(), src.bursts.begin(), src.bursts.end() );
+
+    for( int pass = 0; pass < 2; ++pass )
+    {
+      auto& names = pass == 0 ? src.birth : src.death;
+      ( pass == 0 ? e.first_birth_link : e.first_death_link ) = out_links.size();
+      ( pass == 0 ? e.birth_link_count : e.death_link_count ) = names.size();
+
+      for( auto& n : names )
+      {
+        int32_t idx = find_emitter( n );
+
+        if( idx < 0 )
+        {
+          cerr << "Particle definition: unknown emitter " << n << " in emitter " << e.name << endl;
+          return false;
+        }
+
+        out_links.push_back( idx );
+      }
+    }
+
+    out_emitters.push_back( e );
+  }
+
+  //write the blob, every array is 16 byte aligned
+  auto align = []( uint32_t s ) -> uint32_t
+  {
+    return ( s + 15 ) & ~15u;
+  };
+
+  pdef_header h;
+  memcpy( h.magic, pdef_magic, 4 );
+  h.version = pdef_version;
+  h.emitter_count = out_emitters.size();
+  h.emitter_offset = align( sizeof( pdef_header ) );
+  h.curve_count = curves.size();
+  h.curve_offset = align( h.emitter_offset + h.emitter_count * sizeof( pdef_emitter ) );
+  h.burst_count = out_bursts.size();
+  h.burst_offset = align( h.curve_offset + h.curve_count * sizeof( pdef_curve ) );
+  h.link_count = out_links.size();
+  h.link_offset = align( h.burst_offset + h.burst_count * sizeof( pdef_burst ) );
+  h.program_count = out_programs.size();
+  h.program_offset = align( h.link_offset + h.link_count * sizeof( uint32_t ) );
+  h.instr_count = out_instrs.size();
+  h.instr_offset = align( h.program_offset + h.program_count * sizeof( pdef_program ) );
+  h.constant_count = out_constants.size();
+  h.constant_offset = align( h.instr_offset + h.instr_count * sizeof( vm_instr ) );
+  h.size = align( h.constant_offset + h.constant_count * sizeof( float ) );
+
+  out.assign( h.size, 0 );
+  memcpy( &out[0], &h, sizeof( h ) );
+
+  if( !out_emitters.empty() )
+    memcpy( &out[h.emitter_offset], &out_emitters[0], h.emitter_count * sizeof( pdef_emitter ) );
+  if( !curves.empty() )
+    memcpy( &out[h.curve_offset], &curves[0], h.curve_count * sizeof( pdef_curve ) );
+  if( !out_bursts.empty() )
+    memcpy( &out[h.burst_offset], &out_bursts[0], h.burst_count * sizeof( pdef_burst ) );
+  if( !out_links.empty() )
+    memcpy( &out[h.link_offset], &out_links[0], h.link_count * sizeof( uint32_t ) );
+  if( !out_programs.empty() )
+    memcpy( &out[h.program_offset], &out_programs[0], h.program_count * sizeof( pdef_program ) );
+  if( !out_instrs.empty() )
+    memcpy( &out[h.instr_offset], &out_instrs[0], h.instr_count * sizeof( vm_instr ) );
+  if( !out_constants.empty() )
+    memcpy( &out[h.constant_offset], &out_constants[0], h.constant_count * sizeof( float ) );
+
+  return true;
+}
+
+//compiles a text definition file into a binary one
+inline bool pdef_compile_file( const std::string& src_path, const std::string& dst_path )
+{
+  ifstream f( src_path );
+
+  if( !f.is_open() )
+  {
+    cerr << "Couldn't load particle definition: " << src_path << endl;
+    return false;
+  }
+
+  std::string str( ( istreambuf_iterator<char>( f ) ), istreambuf_iterator<char>() );
+
+  vector<char> blob;
+
+  if( !pdef_compile( str, blob ) )
+  {
+    return false;
+  }
+
+  ofstream o( dst_path, ios::binary );
+
+  if( !o.is_open() )
+  {
+    cerr << "Couldn't write particle definition: " << dst_path << endl;
+    return false;
+  }
+
+  o.write( &blob[0], blob.size() );
+  return true;
+}
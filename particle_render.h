@@ -0,0 +1,673 @@
+#pragma once
+
+#include "particle.h"
+
+#include <cstdint>
+#include <atomic>
+#include <algorithm>
+
+/*
+ * Render snapshots
+ *
+ * After the update the simulation packs what is visible into a particle_render_frame:
+ * culled, sorted, ready to draw instance data that doesn't reference the emitters.
+ * Frames go through a triple-buffered ring, the simulation fills one while the
+ * render thread draws the latest published one, so the two can run in parallel:
+ *
+ *   //simulation thread
+ *   pm.update( dt );
+ *   particle_publish( pm, ring, view );
+ *
+ *   //render thread
+ *   auto f = ring.acquire();
+ *   if( f ) draw( *f );
+ */
+
+//what the snapshot is built for
+struct particle_view
+{
+  vec3 pos;
+  vec3 fwd;
+  vec3 up;
+  vec4 planes[6]; //pointing inwards, a point p is inside if dot( plane.xyz, p ) + plane.w >= 0
+  bool cull;
+
+  particle_view() : pos( 0 ), fwd( 0, 0, -1 ), up( 0, 1, 0 ), cull( false )
+  {
+  }
+
+  //extracts the frustum planes from the projection * modelview matrix
+  void set_up( const vec3& p, const vec3& f, const vec3& u, const mat4& view_proj )
+  {
+    pos = p;
+    fwd = f;
+    up = u;
+    cull = true;
+
+    auto row = [&]( int r ) -> vec4
+    {
+      return vec4( view_proj[0][r], view_proj[1][r], view_proj[2][r], view_proj[3][r] );
+    };
+
+    vec4 r0 = row( 0 ), r1 = row( 1 ), r2 = row( 2 ), r3 = row( 3 );
+
+    planes[0] = r3 + r0; //left
+    planes[1] = r3 - r0; //right
+    planes[2] = r3 + r1; //bottom
+    planes[3] = r3 - r1; //top
+    planes[4] = r3 + r2; //near
+    planes[5] = r3 - r2; //far
+
+    for( auto& pl : planes )
+    {
+      pl /= length( pl.xyz );
+    }
+  }
+
+  bool is_visible( const vec3& p, float radius ) const
+  {
+    if( !cull )
+    {
+      return true;
+    }
+
+    for( auto& pl : planes )
+    {
+      if( pl.x * p.x + pl.y * p.y + pl.z * p.z + pl.w < -radius )
+      {
+        return false;
+      }
+    }
+
+    return true;
+  }
+};
+
+//one particle ready to be drawn
+struct particle_instance
+{
+  float pos[3];
+  float size;
+  float color[4]; //rgb, opacity
+  float axis[3]; //billboard up axis, already stretched
+  float depth; //distance along the view direction
+  float uv[4]; //u0, v0, u1, v1 of the texture (flipbook frame) on the quad
+  float next_uv[2]; //u0, v0 of the next flipbook frame, it's the same size
+  float frame_blend; //[0...1] towards the next frame, 0 unless the flipbook blends
+};
+
+//a range of instances drawn with the same settings, one per emitter unless they are merged
+struct particle_render_batch
+{
+  int32_t emitter_id; //-1 if the batch has particles of more emitters
+  uint32_t first, count;
+  bool is_additive;
+  bool is_oit; //weighted blended order independent transparency, the instances aren't sorted
+  uint32_t downsample; //resolution divisor of the target
+  bool is_stretched;
+  uint32_t texture, shader; //from the emitter's settings
+  float depth; //of the farthest particle
+};
+
+struct particle_render_key
+{
+  float depth;
+  uint32_t particle;
+  uint32_t instance; //index into the emitter's instances, if it has any
+};
+
+//position in the sorted keys of an emitter, used when merging them
+struct particle_render_cursor
+{
+  float depth;
+  uint32_t emitter;
+  uint32_t key;
+};
+
+struct particle_render_frame
+{
+  uint64_t index; //incremented on every publish
+  particle_view view;
+  vector<particle_instance> instances;
+  vector<particle_render_batch> batches;
+
+  //scratch space of the packing, sort keys, first instance and simulation space -> world space per emitter
+  vector<vector<particle_render_key> > keys;
+  vector<uint32_t> offsets;
+  vector<mat4> transforms;
+
+  //scratch space of the global order, the merge heap and the merged order
+  vector<particle_render_cursor> heap;
+  vector<particle_render_cursor> order;
+
+  particle_render_frame() : index( 0 )
+  {
+  }
+};
+
+//triple buffer, one producer and one consumer thread, no locks
+//the producer always has a frame to write, the consumer always gets the latest complete one
+class particle_render_ring
+{
+  static const int fresh_bit = 4;
+
+  particle_render_frame frames[3];
+  std::atomic<int> ready; //index of the last published frame, | fresh_bit if not consumed yet
+  int writing;
+  int reading;
+  uint64_t published; //producer side, number of frames published
+  bool has_frame; //consumer side, false until the first frame is acquired
+
+public:
+  particle_render_ring() : ready( 1 ), writing( 0 ), reading( 2 ), published( 0 ), has_frame( false )
+  {
+  }
+
+  //producer: the frame to fill
+  particle_render_frame& get_write_frame()
+  {
+    return frames[writing];
+  }
+
+  //producer: makes the written frame the latest one
+  void publish()
+  {
+    frames[writing].index = ++published;
+    writing = ready.exchange( writing | fresh_bit ) & ~fresh_bit;
+  }
+
+  //consumer: returns the latest published frame, or 0 if nothing was published yet
+  //the frame stays valid until the next acquire()
+  const particle_render_frame* acquire()
+  {
+    if( ready.load() & fresh_bit )
+    {
+      reading = ready.exchange( reading ) & ~fresh_bit;
+      has_frame = true;
+    }
+
+    return has_frame ? &frames[reading] : 0;
+  }
+};
+
+class particle_render_packer
+{
+  //a particle as drawn at an instance
+  struct placement
+  {
+    vec3 pos, vel; //world space
+    vec3 color;
+    float size, opacity;
+    float life; //remaining, at the instance's time
+  };
+
+  //transform: the emitter's, see particle_emitter::get_transform()
+  static void place( const particle_emitter& e, const mat4& transform, const particle& p, uint32_t instance, placement& out )
+  {
+    auto& d = e.get_def();
+
+    out.pos = p.pos;
+    out.vel = p.vel;
+    out.color = p.get_color();
+    out.size = p.get_size();
+    out.opacity = p.get_opacity();
+    out.life = p.life;
+
+    if( e.instances.empty() )
+    {
+      //local space particles are moved and turned with the emitter
+      if( d.is_local_space )
+      {
+        out.pos = ( transform * vec4( out.pos, 1 ) ).xyz;
+        out.vel = ( transform * vec4( out.vel, 0 ) ).xyz;
+      }
+
+      return;
+    }
+
+    const particle_emitter_instance& inst = e.instances[instance];
+
+    //only a looping emitter looks the same later on, see particle_emitter_instance
+    float t = d.is_looping ? inst.time_offset : 0;
+
+    //a particle that would die within the offset is wrapped into its remaining life instead,
+    //every instance shows all the particles, at different ages
+    if( t > 0 )
+    {
+      t = std::fmod( t, p.life );
+    }
+
+    //extrapolate the ballistic motion, and evaluate the over lifetime / speed modules at the new age
+    if( t > 0 )
+    {
+      vec3 gravity = vec3( 0, 10, 0 ) * d.gravity_multiplier;
+      out.pos += out.vel * t - gravity * ( 0.5f * t * t );
+      out.vel -= gravity * t;
+      out.life -= t;
+
+      float age = d.duration - out.life;
+      float speed = length( out.vel );
+
+      if( d.color_over_lifetime )
+        out.color = d.color_over_lifetime( age, e.pos, e.dir );
+      else if( d.color_over_speed )
+        out.color = d.color_over_speed( speed, e.pos, e.dir );
+
+      if( d.size_over_lifetime )
+        out.size = d.size_over_lifetime( age, e.pos, e.dir );
+      else if( d.size_over_speed )
+        out.size = d.size_over_speed( speed, e.pos, e.dir );
+
+      if( d.opacity_over_lifetime )
+        out.opacity = d.opacity_over_lifetime( age, e.pos, e.dir );
+      else if( d.opacity_over_speed )
+        out.opacity = d.opacity_over_speed( speed, e.pos, e.dir );
+    }
+
+    out.pos = ( inst.transform * vec4( out.pos, 1 ) ).xyz;
+    out.vel = ( inst.transform * vec4( out.vel, 0 ) ).xyz;
+
+    //scaled instances have scaled particles, by the largest axis
+    out.size *= std::max( length( inst.transform[0].xyz ), std::max( length( inst.transform[1].xyz ), length( inst.transform[2].xyz ) ) );
+  }
+
+  static bool is_visible( const particle_emitter& e, const mat4& transform, const particle_chunk& ch, float stretch, const particle_view& view )
+  {
+    vec3 center = ( ch.bounds_min + ch.bounds_max ) * 0.5f;
+    float radius = length( ch.bounds_max - ch.bounds_min ) * 0.5f + ch.max_size * stretch;
+
+    //the bounding sphere turns w/ the emitter, the radius stays
+    if( e.get_def().is_local_space )
+    {
+      center = ( transform * vec4( center, 1 ) ).xyz;
+    }
+
+    return view.is_visible( center, radius );
+  }
+
+  static void sort( vector<particle_render_key>& keys, particle_sort_mode mode )
+  {
+    switch( mode )
+    {
+    case PARTICLE_SORT_BACK_TO_FRONT:
+      std::sort( keys.begin(), keys.end(), []( const particle_render_key& a, const particle_render_key& b )
+      {
+        return a.depth > b.depth;
+      } );
+      break;
+    case PARTICLE_SORT_FRONT_TO_BACK:
+      std::sort( keys.begin(), keys.end(), []( const particle_render_key& a, const particle_render_key& b )
+      {
+        return a.depth < b.depth;
+      } );
+      break;
+    case PARTICLE_SORT_BUCKET:
+      bucket_sort( keys );
+      break;
+    default:
+      break;
+    }
+  }
+
+  //counting sort into depth buckets, farthest first, the order inside a bucket is kept
+  static void bucket_sort( vector<particle_render_key>& keys )
+  {
+    static const int bucket_count = 256;
+
+    if( keys.size() < 2 )
+    {
+      return;
+    }
+
+    float min_depth = keys[0].depth, max_depth = keys[0].depth;
+
+    for( auto& k : keys )
+    {
+      min_depth = std::min( min_depth, k.depth );
+      max_depth = std::max( max_depth, k.depth );
+    }
+
+    if( max_depth <= min_depth )
+    {
+      return;
+    }
+
+    float scale = bucket_count / ( max_depth - min_depth );
+
+    auto bucket = [&]( const particle_render_key& k )
+    {
+      return std::min( int( ( max_depth - k.depth ) * scale ), bucket_count - 1 );
+    };
+
+    uint32_t start[bucket_count + 1] = {};
+
+    for( auto& k : keys )
+    {
+      ++start[bucket( k ) + 1];
+    }
+
+    for( int c = 0; c < bucket_count; ++c )
+    {
+      start[c + 1] += start[c];
+    }
+
+    static thread_local vector<particle_render_key> sorted;
+    sorted.resize( keys.size() );
+
+    for( auto& k : keys )
+    {
+      sorted[start[bucket( k )]++] = k;
+    }
+
+    keys.swap( sorted );
+  }
+
+  //the emitters that take part in the global order, their keys are (about) back-to-front
+  static bool is_merged( const particle_emitter_def& d )
+  {
+    particle_sort_mode mode = particle_get_sort_mode( d );
+    return !d.is_oit && ( mode == PARTICLE_SORT_BACK_TO_FRONT || mode == PARTICLE_SORT_BUCKET );
+  }
+
+  static float get_farthest( const vector<particle_render_key>& keys )
+  {
+    float depth = -FLT_MAX;
+
+    for( auto& k : keys )
+    {
+      depth = std::max( depth, k.depth );
+    }
+
+    return depth;
+  }
+
+  static uint32_t get_downsample( const particle_emitter_def& d )
+  {
+    return d.is_oit || d.downsample <= 1 ? 1 : ( d.downsample <= 2 ? 2 : 4 );
+  }
+
+  static void set_up_batch( particle_render_batch& b, const particle_emitter& e, uint32_t first, float depth )
+  {
+    auto& d = e.get_def();
+    b.emitter_id = e.id;
+    b.first = first;
+    b.count = 0;
+    b.is_additive = d.is_additive;
+    b.is_oit = d.is_oit;
+    b.downsample = get_downsample( d );
+    b.is_stretched = d.is_stretched;
+    b.texture = d.texture;
+    b.shader = d.shader;
+    b.depth = depth;
+  }
+
+  static bool same_state( const particle_render_batch& b, const particle_emitter_def& d )
+  {
+    return b.is_additive == d.is_additive && b.is_oit == d.is_oit && b.downsample == get_downsample( d ) && b.is_stretched == d.is_stretched && b.texture == d.texture && b.shader == d.shader;
+  }
+
+  static void write( const particle_emitter& e, const mat4& transform, const particle_render_key& k, const particle_view& view, particle_instance& out )
+  {
+    auto& d = e.get_def();
+    auto& p = e.particles[k.particle];
+    placement pl;
+    place( e, transform, p, k.instance, pl );
+
+    vec3 axis = d.is_stretched ? normalize( pl.vel ) * d.stretch_factor : view.up;
+
+    out.pos[0] = pl.pos.x;
+    out.pos[1] = pl.pos.y;
+    out.pos[2] = pl.pos.z;
+    out.size = pl.size;
+    out.color[0] = pl.color.x;
+    out.color[1] = pl.color.y;
+    out.color[2] = pl.color.z;
+    out.color[3] = pl.opacity;
+    out.axis[0] = axis.x;
+    out.axis[1] = axis.y;
+    out.axis[2] = axis.z;
+    out.depth = k.depth;
+
+    auto& fb = d.flipbook;
+    float fraction;
+    int frame = fb.get_frame( d.duration - pl.life, d.duration, p.seed, fraction );
+    fb.get_frame_rect( frame, out.uv );
+
+    if( fb.blend && fb.get_frame_count() > 1 )
+    {
+      float next[4];
+      fb.get_frame_rect( ( frame + 1 ) % fb.get_frame_count(), next );
+      out.next_uv[0] = next[0];
+      out.next_uv[1] = next[1];
+      out.frame_blend = fraction;
+    }
+    else
+    {
+      out.next_uv[0] = out.uv[0];
+      out.next_uv[1] = out.uv[1];
+      out.frame_blend = 0;
+    }
+  }
+
+  //merges the sorted keys of the alpha blended emitters into one back-to-front stream, O( n log k ) for k emitters
+  //batches are the runs of particles that can be drawn with the same state, they may span emitters
+  //additive and order independent emitters don't depend on the order, they follow as a batch each, so they don't break up the runs
+  static void merge( particle_manager& pm, particle_render_frame& f, const particle_view& view )
+  {
+    auto& emitters = pm.emitters;
+
+    //heap of the next key of every emitter, farthest on top
+    auto& heap = f.heap;
+    heap.clear();
+
+    uint32_t total = 0;
+    uint32_t merged = 0;
+
+    for( uint32_t c = 0; c < emitters.size(); ++c )
+    {
+      if( !f.keys[c].empty() && is_merged( emitters[c].get_def() ) )
+      {
+        particle_render_cursor cur = { f.keys[c][0].depth, c, 0 };
+        heap.push_back( cur );
+        merged += f.keys[c].size();
+      }
+
+      total += f.keys[c].size();
+    }
+
+    auto closer = []( const particle_render_cursor& a, const particle_render_cursor& b )
+    {
+      return a.depth < b.depth || ( a.depth == b.depth && a.emitter > b.emitter );
+    };
+
+    std::make_heap( heap.begin(), heap.end(), closer );
+
+    f.order.resize( total );
+    f.batches.clear();
+
+    for( uint32_t c = 0; c < merged; ++c )
+    {
+      std::pop_heap( heap.begin(), heap.end(), closer );
+      particle_render_cursor& cur = heap.back();
+
+      f.order[c] = cur;
+
+      auto& e = emitters[cur.emitter];
+
+      if( f.batches.empty() || !same_state( f.batches.back(), e.get_def() ) )
+      {
+        particle_render_batch b;
+        set_up_batch( b, e, c, cur.depth );
+        f.batches.push_back( b );
+      }
+      else if( f.batches.back().emitter_id != e.id )
+      {
+        //a mix of emitters
+        f.batches.back().emitter_id = -1;
+      }
+
+      ++f.batches.back().count;
+
+      if( ++cur.key < f.keys[cur.emitter].size() )
+      {
+        cur.depth = f.keys[cur.emitter][cur.key].depth;
+        std::push_heap( heap.begin(), heap.end(), closer );
+      }
+      else
+      {
+        heap.pop_back();
+      }
+    }
+
+    uint32_t next = merged;
+
+    for( uint32_t c = 0; c < emitters.size(); ++c )
+    {
+      if( f.keys[c].empty() || is_merged( emitters[c].get_def() ) )
+      {
+        continue;
+      }
+
+      particle_render_batch b;
+      set_up_batch( b, emitters[c], next, get_farthest( f.keys[c] ) );
+      b.count = f.keys[c].size();
+      f.batches.push_back( b );
+
+      for( uint32_t k = 0; k < b.count; ++k )
+      {
+        particle_render_cursor cur = { f.keys[c][k].depth, c, k };
+        f.order[next++] = cur;
+      }
+    }
+
+    f.instances.resize( total );
+
+    pm.workers.parallel_for( total, 1024, [&]( int begin, int end )
+    {
+      for( int c = begin; c < end; ++c )
+      {
+        auto& cur = f.order[c];
+        write( emitters[cur.emitter], f.transforms[cur.emitter], f.keys[cur.emitter][cur.key], view, f.instances[c] );
+      }
+    } );
+  }
+
+public:
+  //fills the frame with the visible particles of every emitter, sorted as their sort mode says
+  //emitters are packed in parallel on the manager's workers
+  //global_order merges the alpha blended emitters into one back-to-front stream, so overlapping emitters blend correctly,
+  //at the cost of more batches, otherwise every emitter is a batch and emitters are drawn one after the other
+  static void pack( particle_manager& pm, particle_render_frame& f, const particle_view& view, bool global_order = false )
+  {
+    auto& emitters = pm.emitters;
+
+    f.view = view;
+    f.keys.resize( emitters.size() );
+    f.offsets.resize( emitters.size() );
+    f.transforms.resize( emitters.size() );
+
+    //cull and sort, per emitter
+    pm.workers.parallel_for( emitters.size(), 1, [&]( int begin, int end )
+    {
+      for( int c = begin; c < end; ++c )
+      {
+        auto& e = emitters[c];
+        auto& d = e.get_def();
+        auto& keys = f.keys[c];
+        keys.clear();
+
+        const mat4& transform = f.transforms[c] = e.get_transform();
+
+        uint32_t instance_count = std::max( (uint32_t)e.instances.size(), 1u );
+
+        //stretched particles reach further along their velocity
+        float stretch = d.is_stretched ? std::max( d.stretch_factor, 1.0f ) : 1.0f;
+
+        for( uint32_t inst = 0; inst < instance_count; ++inst )
+        {
+          for( int ch = 0; ch < e.particles.get_chunk_count(); ++ch )
+          {
+            //whole chunks out of view are skipped, instances extrapolate the particles so they are only culled one by one
+            if( e.instances.empty() && !is_visible( e, transform, e.particles.get_chunk( ch ), stretch, view ) )
+            {
+              continue;
+            }
+
+            uint32_t first = ch * particle_chunk_size;
+            uint32_t last = first + e.particles.get_chunk_size( ch );
+
+            for( uint32_t i = first; i < last; ++i )
+            {
+              placement pl;
+              place( e, transform, e.particles[i], inst, pl );
+
+              if( view.is_visible( pl.pos, pl.size * stretch ) )
+              {
+                particle_render_key k;
+                k.depth = dot( pl.pos - view.pos, view.fwd );
+                k.particle = i;
+                k.instance = inst;
+                keys.push_back( k );
+              }
+            }
+          }
+        }
+
+        //instances are sorted together, they may overlap
+        sort( keys, particle_get_sort_mode( d ) );
+      }
+    } );
+
+    if( global_order )
+    {
+      merge( pm, f, view );
+      return;
+    }
+
+    //lay out the batches
+    f.batches.clear();
+    uint32_t total = 0;
+
+    for( int c = 0; c < emitters.size(); ++c )
+    {
+      f.offsets[c] = total;
+
+      if( f.keys[c].empty() )
+      {
+        continue;
+      }
+
+      particle_render_batch b;
+      set_up_batch( b, emitters[c], total, get_farthest( f.keys[c] ) );
+      b.count = f.keys[c].size();
+      f.batches.push_back( b );
+
+      total += b.count;
+    }
+
+    f.instances.resize( total );
+
+    //fill the instances
+    pm.workers.parallel_for( emitters.size(), 1, [&]( int begin, int end )
+    {
+      for( int c = begin; c < end; ++c )
+      {
+        particle_instance* out = f.instances.data() + f.offsets[c];
+
+        for( auto& k : f.keys[c] )
+        {
+          write( emitters[c], f.transforms[c], k, view, *out );
+          ++out;
+        }
+      }
+    } );
+  }
+};
+
+//packs the current state of the manager into the ring and publishes it
+//call it from the simulation thread, after update()
+inline void particle_publish( particle_manager& pm, particle_render_ring& ring, const particle_view& view, bool global_order = false )
+{
+  particle_render_packer::pack( pm, ring.get_write_frame(), view, global_order );
+  ring.publish();
+}
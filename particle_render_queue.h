@@ -0,0 +1,231 @@
+#pragma once
+
+#include "particle_render.h"
+
+#include <cstdint>
+#include <algorithm>
+
+/*
+ * Render queue
+ *
+ * Collects draw packets (a range of instances and the state it needs), sorts
+ * them by target resolution, blend mode, texture, shader and depth, and merges the ones that need
+ * the same state into one draw. Every draw knows which state changed since the
+ * previous one, so the renderer only sets what is different:
+ *
+ *   q.clear();
+ *   q.submit( *frame, default_tex, 0 );
+ *   q.build();
+ *
+ *   for( auto& d : q.get_draws() )
+ *   {
+ *     if( d.changes & PARTICLE_STATE_BLEND ) ...
+ *     for( uint32_t r = d.first_range; r < d.first_range + d.range_count; ++r ) ... q.get_ranges()[r]
+ *   }
+ *
+ * Packets of the same state are drawn back-to-front among themselves,
+ * particles of different emitters are not interleaved. For correct overlap
+ * pack the frame in global order and build( true ), which keeps the order.
+ * Draws of PARTICLE_BLEND_OIT go to the weighted blended accumulation targets,
+ * they are composited once when the blend mode changes from it, or after the last draw.
+ */
+
+//in drawing order, order independent particles are composited over the sorted ones, additive ones come last
+enum particle_blend_mode
+{
+  PARTICLE_BLEND_ALPHA = 0, PARTICLE_BLEND_OIT, PARTICLE_BLEND_ADDITIVE
+};
+
+//what changed since the previous draw, everything for the first one
+enum particle_state_change
+{
+  PARTICLE_STATE_BLEND = 1 << 0, PARTICLE_STATE_TEXTURE = 1 << 1, PARTICLE_STATE_SHADER = 1 << 2, PARTICLE_STATE_TARGET = 1 << 3,
+  PARTICLE_STATE_ALL = PARTICLE_STATE_BLEND | PARTICLE_STATE_TEXTURE | PARTICLE_STATE_SHADER | PARTICLE_STATE_TARGET
+};
+
+struct particle_draw_packet
+{
+  uint32_t downsample; //resolution divisor of the target, 1 is the frame itself
+  uint32_t blend;
+  uint32_t texture;
+  uint32_t shader;
+  float depth; //packets of the same state are sorted back-to-front by this
+  uint32_t first, count; //range of instances
+};
+
+struct particle_draw_range
+{
+  uint32_t first, count;
+};
+
+struct particle_draw
+{
+  uint32_t downsample;
+  uint32_t blend;
+  uint32_t texture;
+  uint32_t shader;
+  uint32_t changes; //particle_state_change bits
+  uint32_t first_range, range_count;
+  uint32_t count; //instances in all the ranges
+};
+
+class particle_render_queue
+{
+  vector<particle_draw_packet> packets;
+  vector<particle_draw_range> ranges;
+  vector<particle_draw> draws;
+  int state_changes;
+
+  static bool same_state( const particle_draw_packet& a, const particle_draw_packet& b )
+  {
+    return a.downsample == b.downsample && a.blend == b.blend && a.texture == b.texture && a.shader == b.shader;
+  }
+
+public:
+  particle_render_queue() : state_changes( 0 )
+  {
+  }
+
+  void clear()
+  {
+    packets.clear();
+    ranges.clear();
+    draws.clear();
+    state_changes = 0;
+  }
+
+  void submit( const particle_draw_packet& p )
+  {
+    if( p.count > 0 )
+    {
+      packets.push_back( p );
+    }
+  }
+
+  //a packet for every batch of the frame, emitters w/o a texture or shader get the defaults
+  void submit( const particle_render_frame& f, uint32_t default_texture, uint32_t default_shader )
+  {
+    for( auto& b : f.batches )
+    {
+      particle_draw_packet p;
+      p.downsample = b.downsample;
+      p.blend = b.is_additive ? PARTICLE_BLEND_ADDITIVE : ( b.is_oit ? PARTICLE_BLEND_OIT : PARTICLE_BLEND_ALPHA );
+      p.texture = b.texture ? b.texture : default_texture;
+      p.shader = b.shader ? b.shader : default_shader;
+      p.depth = b.depth;
+      p.first = b.first;
+      p.count = b.count;
+      submit( p );
+    }
+  }
+
+  //sorts and merges the packets into draws
+  //keep_order only groups the packets by target and blend mode, for frames packed in global order (see particle_render_packer::pack())
+  void build( bool keep_order = false )
+  {
+    if( keep_order )
+    {
+      std::stable_sort( packets.begin(), packets.end(), []( const particle_draw_packet& a, const particle_draw_packet& b )
+      {
+        if( a.downsample != b.downsample )
+          return a.downsample < b.downsample;
+        return a.blend < b.blend;
+      } );
+    }
+    else
+    {
+      std::stable_sort( packets.begin(), packets.end(), []( const particle_draw_packet& a, const particle_draw_packet& b )
+      {
+        if( a.downsample != b.downsample )
+          return a.downsample < b.downsample;
+        if( a.blend != b.blend )
+          return a.blend < b.blend;
+        if( a.texture != b.texture )
+          return a.texture < b.texture;
+        if( a.shader != b.shader )
+          return a.shader < b.shader;
+        return a.depth > b.depth;
+      } );
+    }
+
+    ranges.clear();
+    draws.clear();
+    state_changes = 0;
+
+    for( int c = 0; c < packets.size(); ++c )
+    {
+      auto& p = packets[c];
+
+      if( c == 0 || !same_state( p, packets[c - 1] ) )
+      {
+        particle_draw d;
+        d.downsample = p.downsample;
+        d.blend = p.blend;
+        d.texture = p.texture;
+        d.shader = p.shader;
+        d.first_range = ranges.size();
+        d.range_count = 0;
+        d.count = 0;
+
+        if( draws.empty() )
+        {
+          d.changes = PARTICLE_STATE_ALL;
+        }
+        else
+        {
+          auto& prev = draws.back();
+          d.changes = ( d.downsample != prev.downsample ? PARTICLE_STATE_TARGET : 0 ) |
+                      ( d.blend != prev.blend ? PARTICLE_STATE_BLEND : 0 ) |
+                      ( d.texture != prev.texture ? PARTICLE_STATE_TEXTURE : 0 ) |
+                      ( d.shader != prev.shader ? PARTICLE_STATE_SHADER : 0 );
+        }
+
+        for( uint32_t bits = d.changes; bits; bits &= bits - 1 )
+        {
+          ++state_changes;
+        }
+
+        draws.push_back( d );
+      }
+
+      auto& d = draws.back();
+
+      //neighbouring instance ranges become one
+      if( d.range_count > 0 && ranges.back().first + ranges.back().count == p.first )
+      {
+        ranges.back().count += p.count;
+      }
+      else
+      {
+        particle_draw_range r;
+        r.first = p.first;
+        r.count = p.count;
+        ranges.push_back( r );
+        ++d.range_count;
+      }
+
+      d.count += p.count;
+    }
+  }
+
+  const vector<particle_draw>& get_draws() const
+  {
+    return draws;
+  }
+
+  const vector<particle_draw_range>& get_ranges() const
+  {
+    return ranges;
+  }
+
+  int get_packet_count() const
+  {
+    return packets.size();
+  }
+
+  //number of individual state changes the draws need
+  int get_state_changes() const
+  {
+    return state_changes;
+  }
+};
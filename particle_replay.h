@@ -0,0 +1,155 @@
+#pragma once
+
+#include "particle.h"
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+/*
+ * Recording and bit-exact replay of a particle simulation
+ *
+ * Set the manager to deterministic mode, then record its inputs:
+ *   pm.set_deterministic( seed, 1 / 60.0f );
+ *   pm.set_effect_factory( factory );
+ *   pm.set_recording( &rec.events );
+ * Emitters have to be created through create_effect() and changed through
+ * set_pos(), set_dir(), set_param() etc. for the run to be reproducible.
+ * To replay, set up a fresh manager with the same factory and call
+ * particle_replay::play_frame() until it returns false.
+ */
+
+static const char prec_magic[4] = { 'P', 'R', 'E', 'C' };
+static const uint32_t prec_version = 1;
+
+struct prec_header
+{
+  char magic[4];
+  uint32_t version;
+  uint64_t seed;
+  float fixed_timestep;
+  uint32_t event_count; //particle_event records follow the header
+};
+
+struct particle_recording
+{
+  uint64_t seed;
+  float fixed_timestep;
+  vector<particle_event> events;
+
+  //starts recording the manager's inputs, the manager is switched to deterministic mode
+  void start( particle_manager& pm, uint64_t s, float step )
+  {
+    seed = s;
+    fixed_timestep = step;
+    events.clear();
+    pm.set_deterministic( seed, fixed_timestep );
+    pm.set_recording( &events );
+  }
+
+  bool save( const std::string& path ) const
+  {
+    ofstream f( path, ios::binary );
+
+    if( !f.is_open() )
+    {
+      cerr << "Couldn't write particle recording: " << path << endl;
+      return false;
+    }
+
+    prec_header h;
+    memcpy( h.magic, prec_magic, 4 );
+    h.version = prec_version;
+    h.seed = seed;
+    h.fixed_timestep = fixed_timestep;
+    h.event_count = events.size();
+
+    f.write( (const char*)&h, sizeof( h ) );
+
+    if( !events.empty() )
+    {
+      f.write( (const char*)&events[0], events.size() * sizeof( particle_event ) );
+    }
+
+    return true;
+  }
+
+  bool load( const std::string& path )
+  {
+    ifstream f( path, ios::binary );
+
+    if( !f.is_open() )
+    {
+      cerr << "Couldn't load particle recording: " << path << endl;
+      return false;
+    }
+
+    prec_header h;
+
+    if( !f.read( (char*)&h, sizeof( h ) ) || memcmp( h.magic, prec_magic, 4 ) != 0 || h.version != prec_version )
+    {
+      cerr << "Invalid particle recording: " << path << endl;
+      return false;
+    }
+
+    seed = h.seed;
+    fixed_timestep = h.fixed_timestep;
+    events.resize( h.event_count );
+
+    if( h.event_count && !f.read( (char*)&events[0], h.event_count * sizeof( particle_event ) ) )
+    {
+      cerr << "Truncated particle recording: " << path << endl;
+      events.clear();
+      return false;
+    }
+
+    return true;
+  }
+};
+
+class particle_replay
+{
+  const particle_recording* rec;
+  size_t pos;
+public:
+  particle_replay() : rec( 0 ), pos( 0 )
+  {
+  }
+
+  //pm should be a freshly initialized manager, with the effect factory of the recorded run
+  void start( particle_manager& pm, const particle_recording& r )
+  {
+    rec = &r;
+    pos = 0;
+    pm.set_deterministic( rec->seed, rec->fixed_timestep );
+  }
+
+  //applies the inputs up to and including the next update
+  //returns false when the recording is over
+  bool play_frame( particle_manager& pm )
+  {
+    if( !rec || pos >= rec->events.size() )
+    {
+      return false;
+    }
+
+    while( pos < rec->events.size() )
+    {
+      const particle_event& e = rec->events[pos++];
+      pm.apply( e );
+
+      if( e.type == PEV_STEP )
+      {
+        break;
+      }
+    }
+
+    return true;
+  }
+
+  void play_all( particle_manager& pm )
+  {
+    while( play_frame( pm ) );
+  }
+};
@@ -0,0 +1,363 @@
+#pragma once
+
+#include "particle.h"
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+
+/*
+ * Particle state snapshots
+ *
+ * A snapshot holds the runtime state of every emitter (timers, transform, random
+ * stream, budget bookkeeping, sub-emitter links, particles) in a flat blob that only
+ * uses offsets, so it can be written to disk or copied around.
+ * Particles are stored in their in-memory layout, so restoring is a copy into the
+ * already reserved containers.
+ *
+ * restore() rolls the manager back: emitters created after the snapshot are removed,
+ * and the ones that are gone since are recreated with their old ids. The emitter
+ * settings (functions, bursts etc.) can't be part of the blob, save() hands them out
+ * separately, and restore() needs them to recreate emitters:
+ *
+ *   vector<char> snap;
+ *   particle_snapshot::defs defs;
+ *   particle_snapshot::save( pm, snap, &defs );
+ *   ...
+ *   particle_snapshot::restore( pm, &snap[0], snap.size(), &defs );
+ *
+ * W/o the settings only the emitters that still exist can be restored.
+ * Instances and command handles are not part of the snapshot.
+ */
+
+static const char psnap_magic[4] = { 'P', 'S', 'N', 'P' };
+static const uint32_t psnap_version = 2;
+
+struct psnap_header
+{
+  char magic[4];
+  uint32_t version;
+  uint32_t size; //size of the whole blob in bytes
+  uint32_t particle_size; //sizeof( particle ) when the snapshot was taken
+  int32_t id_counter;
+  float time_accum;
+  uint32_t emitter_count; //psnap_emitter records follow the header
+  uint32_t link_count; //sub-emitter ids
+  uint32_t link_offset;
+};
+
+struct psnap_emitter
+{
+  int32_t id;
+  uint32_t first_update;
+  uint32_t is_stopped;
+  int32_t triggered_burst;
+  float life;
+  float elapsed_time;
+  float spawn_accum;
+  float spawn_scale;
+  int32_t spawn_requests, last_spawn_requests;
+  uint32_t rng_state[2]; //low, high
+  float pos[3];
+  float dir[3];
+  uint32_t first_birth_link, birth_link_count; //into the link array
+  uint32_t first_death_link, death_link_count;
+  uint32_t particle_count;
+  uint32_t particle_offset; //from the start of the blob, 16 byte aligned
+};
+
+class particle_snapshot
+{
+public:
+  //the settings of the emitters, in the order of the records
+  typedef vector<std::shared_ptr<const particle_emitter_def> > defs;
+
+private:
+  static uint32_t align( uint32_t s )
+  {
+    return ( s + 15 ) & ~15u;
+  }
+
+  static const psnap_header* get_header( const char* data, size_t size )
+  {
+    auto h = reinterpret_cast<const psnap_header*>( data );
+
+    if( !data || size < sizeof( psnap_header ) ||
+        memcmp( h->magic, psnap_magic, 4 ) != 0 ||
+        h->version != psnap_version ||
+        h->particle_size != sizeof( particle ) ||
+        h->size > size || h->size < sizeof( psnap_header ) ||
+        h->emitter_count > ( h->size - sizeof( psnap_header ) ) / sizeof( psnap_emitter ) ||
+        h->link_offset < sizeof( psnap_header ) + h->emitter_count * sizeof( psnap_emitter ) || //the links follow the records
+        h->link_offset > h->size || h->link_count > ( h->size - h->link_offset ) / sizeof( int32_t ) )
+    {
+      cerr << "Particle snapshot: invalid or incompatible snapshot." << endl;
+      return 0;
+    }
+
+    return h;
+  }
+
+  static const psnap_emitter* find_record( const psnap_header* h, int id )
+  {
+    auto records = reinterpret_cast<const psnap_emitter*>( h + 1 );
+
+    for( uint32_t c = 0; c < h->emitter_count; ++c )
+    {
+      if( records[c].id == id )
+      {
+        return records + c;
+      }
+    }
+
+    return 0;
+  }
+
+  static bool check_record( const psnap_header* h, const psnap_emitter& r )
+  {
+    if( r.particle_offset > h->size || r.particle_count > ( h->size - r.particle_offset ) / sizeof( particle ) ||
+        r.first_birth_link > h->link_count || r.birth_link_count > h->link_count - r.first_birth_link ||
+        r.first_death_link > h->link_count || r.death_link_count > h->link_count - r.first_death_link )
+    {
+      cerr << "Particle snapshot: corrupt emitter record." << endl;
+      return false;
+    }
+
+    return true;
+  }
+
+  //translate: offset applied to the world space particle positions, used when forking to a new place
+  static bool restore_record( particle_emitter& e, const char* data, const psnap_header* h, const psnap_emitter& r, const vec3& translate )
+  {
+    if( !check_record( h, r ) )
+    {
+      return false;
+    }
+
+    e.first_update = r.first_update != 0;
+    e.life = r.life;
+    e.elapsed_time = r.elapsed_time;
+    e.spawn_accum = r.spawn_accum;
+
+    auto src = reinterpret_cast<const particle*>( data + r.particle_offset );
+    e.particles.assign( src, r.particle_count );
+
+    if( !e.get_def().is_local_space && ( translate.x != 0 || translate.y != 0 || translate.z != 0 ) )
+    {
+      for( auto& p : e.particles )
+      {
+        p.translate( translate );
+      }
+
+      e.particles.refresh_bounds();
+    }
+
+    return true;
+  }
+
+public:
+  //serializes the state of every emitter into out
+  //if settings is given, it gets the settings of the emitters, restore() needs them to recreate emitters
+  static void save( const particle_manager& pm, vector<char>& out, defs* settings = 0 )
+  {
+    uint32_t link_count = 0;
+
+    for( auto& e : pm.emitters )
+    {
+      link_count += e.birth_subemitter_ids.size() + e.death_subemitter_ids.size();
+    }
+
+    uint32_t link_offset = sizeof( psnap_header ) + pm.emitters.size() * sizeof( psnap_emitter );
+    uint32_t size = align( link_offset + link_count * sizeof( int32_t ) );
+    uint32_t records_size = size;
+
+    for( auto& e : pm.emitters )
+    {
+      size = align( size + e.particles.size() * sizeof( particle ) );
+    }
+
+    out.resize( size );
+    char* data = &out[0];
+
+    auto h = reinterpret_cast<psnap_header*>( data );
+    memcpy( h->magic, psnap_magic, 4 );
+    h->version = psnap_version;
+    h->size = size;
+    h->particle_size = sizeof( particle );
+    h->id_counter = pm.id_counter;
+    h->time_accum = pm.time_accum;
+    h->emitter_count = pm.emitters.size();
+    h->link_count = link_count;
+    h->link_offset = link_offset;
+
+    auto records = reinterpret_cast<psnap_emitter*>( h + 1 );
+    auto links = reinterpret_cast<int32_t*>( data + link_offset );
+    uint32_t offset = records_size;
+    uint32_t link = 0;
+
+    if( settings )
+    {
+      settings->clear();
+    }
+
+    for( uint32_t c = 0; c < pm.emitters.size(); ++c )
+    {
+      auto& e = pm.emitters[c];
+      auto& r = records[c];
+
+      r.id = e.id;
+      r.first_update = e.first_update;
+      r.is_stopped = e.is_stopped;
+      r.triggered_burst = e.triggered_burst;
+      r.life = e.life;
+      r.elapsed_time = e.elapsed_time;
+      r.spawn_accum = e.spawn_accum;
+      r.spawn_scale = e.spawn_scale;
+      r.spawn_requests = e.spawn_requests;
+      r.last_spawn_requests = e.last_spawn_requests;
+      r.rng_state[0] = uint32_t( e.rng.state );
+      r.rng_state[1] = uint32_t( e.rng.state >> 32 );
+      r.pos[0] = e.pos.x; r.pos[1] = e.pos.y; r.pos[2] = e.pos.z;
+      r.dir[0] = e.dir.x; r.dir[1] = e.dir.y; r.dir[2] = e.dir.z;
+
+      r.first_birth_link = link;
+      r.birth_link_count = e.birth_subemitter_ids.size();
+      for( int id : e.birth_subemitter_ids )
+        links[link++] = id;
+
+      r.first_death_link = link;
+      r.death_link_count = e.death_subemitter_ids.size();
+      for( int id : e.death_subemitter_ids )
+        links[link++] = id;
+
+      if( settings )
+      {
+        settings->push_back( e.def );
+      }
+
+      r.particle_count = e.particles.size();
+      r.particle_offset = offset;
+
+      e.particles.copy_to( reinterpret_cast<particle*>( data + offset ) );
+
+      offset = align( offset + e.particles.size() * sizeof( particle ) );
+    }
+  }
+
+  //rolls the manager back to the snapshot, settings is what save() handed out
+  //w/o settings the emitters that are gone since can't be recreated, and the restore fails
+  //returns false if the snapshot is invalid, the manager is left untouched then
+  static bool restore( particle_manager& pm, const char* data, size_t size, const defs* settings = 0 )
+  {
+    auto h = get_header( data, size );
+
+    if( !h )
+    {
+      return false;
+    }
+
+    auto records = reinterpret_cast<const psnap_emitter*>( h + 1 );
+    auto links = reinterpret_cast<const int32_t*>( data + h->link_offset );
+
+    if( settings && settings->size() != h->emitter_count )
+    {
+      cerr << "Particle snapshot: the settings don't belong to the snapshot." << endl;
+      return false;
+    }
+
+    //everything is checked before the manager is touched
+    for( uint32_t c = 0; c < h->emitter_count; ++c )
+    {
+      if( !check_record( h, records[c] ) )
+      {
+        return false;
+      }
+
+      if( !settings && !pm.get( records[c].id ) )
+      {
+        cerr << "Particle snapshot: emitter " << records[c].id << " is gone, and there are no settings to recreate it." << endl;
+        return false;
+      }
+    }
+
+    //emitters created after the snapshot go away
+    for( int c = pm.emitters.size() - 1; c >= 0; --c )
+    {
+      if( !find_record( h, pm.emitters[c].id ) )
+      {
+        pm.retire( pm.emitters[c] );
+        pm.emitters.erase( pm.emitters.begin() + c );
+      }
+    }
+
+    //the ones that are gone are recreated w/ their old ids
+    for( uint32_t c = 0; c < h->emitter_count; ++c )
+    {
+      if( !pm.get( records[c].id ) )
+      {
+        pm.add_emitter( ( *settings )[c] ).init( records[c].id, &pm, pm.seed, ( *settings )[c] );
+      }
+    }
+
+    //same order as when saved, the update order matters for the results
+    vector<particle_emitter> ordered;
+    ordered.reserve( pm.emitters.capacity() );
+
+    for( uint32_t c = 0; c < h->emitter_count; ++c )
+    {
+      auto& r = records[c];
+      ordered.push_back( std::move( *pm.get( r.id ) ) );
+      auto& e = ordered.back();
+
+      if( settings )
+      {
+        e.def = ( *settings )[c];
+      }
+
+      e.pos = vec3( r.pos[0], r.pos[1], r.pos[2] );
+      e.dir = vec3( r.dir[0], r.dir[1], r.dir[2] );
+      e.is_stopped = r.is_stopped != 0;
+      e.triggered_burst = r.triggered_burst;
+      e.spawn_scale = r.spawn_scale;
+      e.spawn_requests = r.spawn_requests;
+      e.last_spawn_requests = r.last_spawn_requests;
+      e.rng.state = uint64_t( r.rng_state[0] ) | ( uint64_t( r.rng_state[1] ) << 32 );
+      e.birth_subemitter_ids.assign( links + r.first_birth_link, links + r.first_birth_link + r.birth_link_count );
+      e.death_subemitter_ids.assign( links + r.first_death_link, links + r.first_death_link + r.death_link_count );
+      e.sub_events.clear();
+
+      restore_record( e, data, h, r, vec3( 0 ) );
+    }
+
+    pm.emitters.swap( ordered );
+    pm.id_counter = h->id_counter;
+    pm.time_accum = h->time_accum;
+
+    return true;
+  }
+
+  //copies the saved state of emitter src_id into emitter dst_id (forking a warmed up effect)
+  //the particles are moved along with the emitter, dst keeps its own pos and dir
+  static bool restore_emitter( particle_manager& pm, const char* data, size_t size, int src_id, int dst_id )
+  {
+    auto h = get_header( data, size );
+    auto e = pm.get( dst_id );
+
+    if( !h || !e )
+    {
+      return false;
+    }
+
+    auto r = find_record( h, src_id );
+
+    if( !r )
+    {
+      cerr << "Particle snapshot: emitter " << src_id << " not found." << endl;
+      return false;
+    }
+
+    vec3 translate = e->pos - vec3( r->pos[0], r->pos[1], r->pos[2] );
+
+    return restore_record( *e, data, h, *r, translate );
+  }
+};
@@ -0,0 +1,273 @@
+#pragma once
+
+#include "particle_billboard.h"
+
+#include <cstdint>
+#include <algorithm>
+
+/*
+ * Alpha trimmed billboards
+ *
+ * Most particle textures are transparent around the edges, drawing the whole
+ * quad spends fill rate on nothing. particle_trim_image() computes a convex
+ * polygon of a few vertices that contains every texel above an alpha
+ * threshold, from the same RGBA8 pixels load_image() uploads:
+ *
+ *   sf::Image im;
+ *   im.loadFromFile( "soapbubble.png" );
+ *   particle_trim_shape s;
+ *   particle_trim_image( im.getPixelsPtr(), im.getSize().x, im.getSize().y, 8, 8, s );
+ *
+ * and particle_expand_polygons() builds that polygon instead of the quad, with
+ * the texture mapped the same way, so the image doesn't change. The polygons
+ * are drawn as triangles using particle_polygon_indices().
+ */
+
+const int particle_trim_max_vertices = 8;
+
+struct particle_trim_shape
+{
+  int count; //vertices, counter-clockwise in texture space, 0 if there's nothing to draw
+  float uv[particle_trim_max_vertices][2];
+  float area; //relative to the quad
+
+  particle_trim_shape() : count( 0 ), area( 0 )
+  {
+  }
+};
+
+namespace particle_trim_detail
+{
+  struct point
+  {
+    double x, y;
+  };
+
+  inline double cross( const point& o, const point& a, const point& b )
+  {
+    return ( a.x - o.x ) * ( b.y - o.y ) - ( a.y - o.y ) * ( b.x - o.x );
+  }
+
+  inline double area( const vector<point>& p )
+  {
+    double a = 0;
+
+    for( int c = 0; c < p.size(); ++c )
+    {
+      auto& n = p[( c + 1 ) % p.size()];
+      a += p[c].x * n.y - n.x * p[c].y;
+    }
+
+    return a * 0.5;
+  }
+
+  //counter-clockwise convex hull, monotone chain
+  inline vector<point> hull( vector<point> p )
+  {
+    std::sort( p.begin(), p.end(), []( const point& a, const point& b )
+    {
+      return a.x < b.x || ( a.x == b.x && a.y < b.y );
+    } );
+
+    vector<point> h( p.size() * 2 );
+    int k = 0;
+
+    for( int c = 0; c < p.size(); ++c )
+    {
+      while( k >= 2 && cross( h[k - 2], h[k - 1], p[c] ) <= 0 ) --k;
+      h[k++] = p[c];
+    }
+
+    for( int c = p.size() - 2, t = k + 1; c >= 0; --c )
+    {
+      while( k >= t && cross( h[k - 2], h[k - 1], p[c] ) <= 0 ) --k;
+      h[k++] = p[c];
+    }
+
+    h.resize( std::max( k - 1, 0 ) );
+    return h;
+  }
+
+  //removing edge i -> i + 1 extends its neighbours until they meet
+  //returns false if they don't meet in front of the edge or inside the image
+  inline bool remove_edge( const vector<point>& p, int i, double w, double h, point& meet, double& added )
+  {
+    int n = p.size();
+    auto& a0 = p[( i + n - 1 ) % n];
+    auto& a1 = p[i];
+    auto& b1 = p[( i + 1 ) % n];
+    auto& b0 = p[( i + 2 ) % n];
+
+    point da = { a1.x - a0.x, a1.y - a0.y };
+    point db = { b1.x - b0.x, b1.y - b0.y };
+
+    //a1 + da * t = b1 + db * s
+    double den = da.x * db.y - da.y * db.x;
+
+    if( den > -1e-12 && den < 1e-12 )
+      return false;
+
+    double t = ( ( b1.x - a1.x ) * db.y - ( b1.y - a1.y ) * db.x ) / den;
+    double s = ( ( b1.x - a1.x ) * da.y - ( b1.y - a1.y ) * da.x ) / den;
+
+    if( t < 0 || s < 0 )
+      return false;
+
+    meet.x = a1.x + da.x * t;
+    meet.y = a1.y + da.y * t;
+
+    //outside the texture the quad's texels would repeat
+    const double eps = 1e-6;
+
+    if( meet.x < -eps || meet.y < -eps || meet.x > w + eps || meet.y > h + eps )
+      return false;
+
+    added = cross( a1, meet, b1 ) * 0.5;
+    return true;
+  }
+}
+
+//pixels are w * h RGBA8, texels w/ alpha above alpha_threshold are kept inside the polygon
+//max_vertices is clamped to [4...particle_trim_max_vertices]
+inline void particle_trim_image( const uint8_t* pixels, int w, int h, uint8_t alpha_threshold, int max_vertices, particle_trim_shape& s )
+{
+  using namespace particle_trim_detail;
+
+  s = particle_trim_shape();
+  max_vertices = std::min( std::max( max_vertices, 4 ), particle_trim_max_vertices );
+
+  //the outer corners of the first and last kept texel of every row
+  vector<point> points;
+  double min_x = w, min_y = h, max_x = 0, max_y = 0;
+
+  for( int y = 0; y < h; ++y )
+  {
+    int first = -1, last = -1;
+
+    for( int x = 0; x < w; ++x )
+    {
+      if( pixels[( y * w + x ) * 4 + 3] > alpha_threshold )
+      {
+        if( first < 0 ) first = x;
+        last = x;
+      }
+    }
+
+    if( first >= 0 )
+    {
+      point p[4] = { { (double)first, (double)y }, { (double)first, y + 1.0 }, { last + 1.0, (double)y }, { last + 1.0, y + 1.0 } };
+      points.insert( points.end(), p, p + 4 );
+
+      min_x = std::min( min_x, (double)first );
+      max_x = std::max( max_x, last + 1.0 );
+      min_y = std::min( min_y, (double)y );
+      max_y = std::max( max_y, y + 1.0 );
+    }
+  }
+
+  if( points.empty() )
+    return;
+
+  vector<point> p = hull( points );
+
+  //drop the edge that adds the least area, until it's small enough
+  while( p.size() > max_vertices )
+  {
+    int best = -1;
+    double best_added = 0;
+    point best_meet;
+
+    for( int c = 0; c < p.size(); ++c )
+    {
+      point meet;
+      double added;
+
+      if( remove_edge( p, c, w, h, meet, added ) && ( best < 0 || added < best_added ) )
+      {
+        best = c;
+        best_added = added;
+        best_meet = meet;
+      }
+    }
+
+    if( best < 0 )
+      break;
+
+    //the meeting point replaces the edge's two vertices
+    int n = p.size();
+    p[best] = best_meet;
+    p.erase( p.begin() + ( best + 1 ) % n );
+  }
+
+  //no way to get there inside the texture, the bounding box always fits
+  if( p.size() > max_vertices )
+  {
+    point box[4] = { { min_x, min_y }, { max_x, min_y }, { max_x, max_y }, { min_x, max_y } };
+    p.assign( box, box + 4 );
+  }
+
+  s.count = p.size();
+
+  for( int c = 0; c < s.count; ++c )
+  {
+    s.uv[c][0] = std::min( std::max( p[c].x / w, 0.0 ), 1.0 );
+    s.uv[c][1] = std::min( std::max( p[c].y / h, 0.0 ), 1.0 );
+  }
+
+  s.area = area( p ) / ( (double)w * h );
+}
+
+//one particle, writes s.count vertices
+//texture space is mapped onto the quad of particle_expand_billboard(), it's a parallelogram so the mapping is affine
+//the shape is in the space of the particle's uv rect, so for a flipbook or an atlas it should be computed from the frame's pixels
+inline void particle_expand_polygon( const particle_instance& p, const vec3& fwd, const particle_trim_shape& s, particle_vertex* out )
+{
+  vec3 pos( p.pos[0], p.pos[1], p.pos[2] );
+
+  vec3 yaxis = vec3( p.axis[0], p.axis[1], p.axis[2] );
+  vec3 xaxis = normalize( cross( fwd, yaxis ) );
+
+  vec3 to_ur = normalize( xaxis + yaxis );
+  vec3 to_lr = normalize( xaxis - yaxis );
+
+  //uv ( 0, 0 ) is the lower right corner, ( 1, 0 ) the upper right one
+  vec3 du = ( to_ur - to_lr ) * p.size;
+  vec3 dv = -( to_ur + to_lr ) * p.size;
+
+  for( int c = 0; c < s.count; ++c )
+  {
+    vec3 v = pos + du * ( s.uv[c][0] - 0.5f ) + dv * ( s.uv[c][1] - 0.5f );
+
+    particle_write_vertex( out + c, s.uv[c][0], s.uv[c][1], v.x, v.y, v.z, p );
+  }
+}
+
+//count particles, writes count * s.count vertices
+inline void particle_expand_polygons( const particle_instance* in, int count, const vec3& fwd, const particle_trim_shape& s, particle_vertex* out )
+{
+  for( int c = 0; c < count; ++c )
+  {
+    particle_expand_polygon( in[c], fwd, s, out + c * s.count );
+  }
+}
+
+//a triangle fan for every polygon, ( s.count - 2 ) * 3 indices per particle
+inline void particle_polygon_indices( const particle_trim_shape& s, int count, vector<uint32_t>& indices )
+{
+  int per_particle = std::max( s.count - 2, 0 ) * 3;
+  indices.resize( count * per_particle );
+
+  uint32_t* out = indices.empty() ? 0 : &indices[0];
+
+  for( int c = 0; c < count; ++c )
+  {
+    uint32_t base = c * s.count;
+
+    for( int v = 1; v + 1 < s.count; ++v )
+    {
+      *out++ = base;
+      *out++ = base + v;
+      *out++ = base + v + 1;
+    }
+  }
+}
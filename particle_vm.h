@@ -0,0 +1,810 @@
+#pragma once
+
+#include "particle.h"
+
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <memory>
+#include <map>
+#include <sstream>
+#include <algorithm>
+#include <iostream>
+
+/*
+ * Particle expression language
+ *
+ * Behaviours are written as a list of assignments, compiled to register bytecode
+ * and run over batches of particles (one instruction processes a whole batch), eg.
+ *
+ *   #swirl around the emitter, fade out
+ *   d = pos - emitter_pos
+ *   vel = vel + cross( vec3( 0, 1, 0 ), d ) * 2 * dt
+ *   opacity = clamp( life * 0.5, 0, 1 )
+ *   size = 1 + noise( pos * 0.1 ) * curve( grow, age )
+ *
+ * Every value is a vec3, scalars are stored in all three components.
+ * Particle attributes: pos, vel, color, size, opacity, life (read-write), age (read-only)
+ * Uniforms: dt, time, emitter_pos, emitter_dir
+ * Functions: vec3, dot, cross, length, normalize, min, max, clamp, mix, abs, floor, fract,
+ *            sqrt, sin, cos, pow, noise, random, curve
+ * Components can be accessed with .x .y .z
+ * Any other name on the left of an assignment is a local variable.
+ */
+
+enum vm_op
+{
+  VM_MOV = 0, VM_ADD, VM_SUB, VM_MUL, VM_DIV, VM_NEG,
+  VM_MIN, VM_MAX, VM_CLAMP, VM_MIX, VM_ABS, VM_FLOOR, VM_FRACT, VM_SQRT, VM_SIN, VM_COS, VM_POW,
+  VM_DOT, VM_CROSS, VM_LENGTH, VM_NORMALIZE, VM_VEC3, VM_X, VM_Y, VM_Z,
+  VM_NOISE, VM_RANDOM, VM_CURVE //curve: c is the curve index
+};
+
+//the attributes live in the first registers
+enum vm_attribute
+{
+  VM_ATTR_POS = 0, VM_ATTR_VEL, VM_ATTR_COLOR, VM_ATTR_SIZE, VM_ATTR_OPACITY, VM_ATTR_LIFE, //writable
+  VM_ATTR_AGE, //per particle, read-only
+  VM_ATTR_DT, VM_ATTR_TIME, VM_ATTR_EMITTER_POS, VM_ATTR_EMITTER_DIR, //uniform
+  VM_ATTR_COUNT
+};
+
+static const int vm_writable_attributes = VM_ATTR_AGE;
+static const int vm_particle_attributes = VM_ATTR_AGE + 1;
+static const int vm_max_registers = 64;
+static const int vm_batch_size = 128;
+static_assert( particle_chunk_size % vm_batch_size == 0, "a batch of particles must not cross a chunk" );
+
+struct vm_instr
+{
+  uint8_t op, dst, a, b, c;
+};
+
+//hash based 3d value noise in [0...1]
+inline float vm_noise( float x, float y, float z )
+{
+  float fx = std::floor( x ), fy = std::floor( y ), fz = std::floor( z );
+  int ix = (int)fx, iy = (int)fy, iz = (int)fz;
+  float tx = x - fx, ty = y - fy, tz = z - fz;
+
+  tx = tx * tx * ( 3 - 2 * tx );
+  ty = ty * ty * ( 3 - 2 * ty );
+  tz = tz * tz * ( 3 - 2 * tz );
+
+  auto hash = []( int x, int y, int z ) -> float
+  {
+    uint32_t h = uint32_t( x ) * 73856093u ^ uint32_t( y ) * 19349663u ^ uint32_t( z ) * 83492791u;
+    h ^= h >> 13;
+    h *= 0x5bd1e995u;
+    h ^= h >> 15;
+    return ( h & 0xffffff ) * ( 1.0f / 16777215.0f );
+  };
+
+  auto lerp = []( float a, float b, float t ) -> float
+  {
+    return a + ( b - a ) * t;
+  };
+
+  float c00 = lerp( hash( ix, iy, iz ), hash( ix + 1, iy, iz ), tx );
+  float c10 = lerp( hash( ix, iy + 1, iz ), hash( ix + 1, iy + 1, iz ), tx );
+  float c01 = lerp( hash( ix, iy, iz + 1 ), hash( ix + 1, iy, iz + 1 ), tx );
+  float c11 = lerp( hash( ix, iy + 1, iz + 1 ), hash( ix + 1, iy + 1, iz + 1 ), tx );
+
+  return lerp( lerp( c00, c10, ty ), lerp( c01, c11, ty ), tz );
+}
+
+class particle_program
+{
+public:
+  vector<vm_instr> code;
+  vector<float> constants; //xyz per constant register, they follow the attributes
+  vector<particle_curve> curves;
+  vector<int> curve_sources; //index into the curve_list of compile() for every curve
+  uint32_t reads; //bitmask of the particle attributes read
+  uint32_t writes; //bitmask of the particle attributes written
+  int register_count;
+
+  particle_program() : reads( 0 ), writes( 0 ), register_count( VM_ATTR_COUNT )
+  {
+  }
+
+  bool empty() const
+  {
+    return code.empty();
+  }
+
+  //compiles the source, curve( name, t ) looks up curve_names to index into curves
+  //returns false and prints the error on failure
+  bool compile( const std::string& source, const vector<std::string>& curve_names = vector<std::string>(), const vector<particle_curve>& curve_list = vector<particle_curve>() );
+
+  //runs the program on every particle of the emitter
+  void execute( particle_emitter& e, float dt ) const
+  {
+    if( code.empty() || e.particles.empty() )
+    {
+      return;
+    }
+
+    static thread_local vector<float> storage;
+    storage.resize( register_count * 3 * vm_batch_size );
+    float* regs = &storage[0];
+
+    auto reg = [&]( int r, int comp ) -> float*
+    {
+      return regs + ( r * 3 + comp ) * vm_batch_size;
+    };
+
+    auto fill = [&]( int r, const vec3& v )
+    {
+      for( int comp = 0; comp < 3; ++comp )
+      {
+        float* d = reg( r, comp );
+        float f = comp == 0 ? v.x : ( comp == 1 ? v.y : v.z );
+        for( int i = 0; i < vm_batch_size; ++i )
+          d[i] = f;
+      }
+    };
+
+    //uniforms and constants are the same for every batch
+    fill( VM_ATTR_DT, vec3( dt ) );
+    fill( VM_ATTR_TIME, vec3( e.get_def().duration - e.life ) );
+    fill( VM_ATTR_EMITTER_POS, e.get_sim_pos() );
+    fill( VM_ATTR_EMITTER_DIR, e.get_sim_dir() );
+
+    for( int c = 0; c < constants.size() / 3; ++c )
+    {
+      fill( VM_ATTR_COUNT + c, vec3( constants[c * 3 + 0], constants[c * 3 + 1], constants[c * 3 + 2] ) );
+    }
+
+    int total = e.particles.size();
+
+    for( int start = 0; start < total; start += vm_batch_size )
+    {
+      //batches never cross a chunk, they are contiguous
+      int count = std::min( vm_batch_size, total - start );
+      particle* p = &e.particles[start];
+
+      //gather
+      for( int i = 0; i < count; ++i )
+      {
+        if( reads & ( 1 << VM_ATTR_POS ) ) { reg( VM_ATTR_POS, 0 )[i] = p[i].pos.x; reg( VM_ATTR_POS, 1 )[i] = p[i].pos.y; reg( VM_ATTR_POS, 2 )[i] = p[i].pos.z; }
+        if( reads & ( 1 << VM_ATTR_VEL ) ) { reg( VM_ATTR_VEL, 0 )[i] = p[i].vel.x; reg( VM_ATTR_VEL, 1 )[i] = p[i].vel.y; reg( VM_ATTR_VEL, 2 )[i] = p[i].vel.z; }
+        if( reads & ( 1 << VM_ATTR_COLOR ) ) { vec3 c = p[i].get_color(); reg( VM_ATTR_COLOR, 0 )[i] = c.x; reg( VM_ATTR_COLOR, 1 )[i] = c.y; reg( VM_ATTR_COLOR, 2 )[i] = c.z; }
+        if( reads & ( 1 << VM_ATTR_SIZE ) ) reg( VM_ATTR_SIZE, 0 )[i] = reg( VM_ATTR_SIZE, 1 )[i] = reg( VM_ATTR_SIZE, 2 )[i] = p[i].get_size();
+        if( reads & ( 1 << VM_ATTR_OPACITY ) ) reg( VM_ATTR_OPACITY, 0 )[i] = reg( VM_ATTR_OPACITY, 1 )[i] = reg( VM_ATTR_OPACITY, 2 )[i] = p[i].get_opacity();
+        if( reads & ( 1 << VM_ATTR_LIFE ) ) reg( VM_ATTR_LIFE, 0 )[i] = reg( VM_ATTR_LIFE, 1 )[i] = reg( VM_ATTR_LIFE, 2 )[i] = p[i].life;
+        if( reads & ( 1 << VM_ATTR_AGE ) ) reg( VM_ATTR_AGE, 0 )[i] = reg( VM_ATTR_AGE, 1 )[i] = reg( VM_ATTR_AGE, 2 )[i] = e.get_def().duration - p[i].life;
+      }
+
+      run( regs, count );
+
+      //scatter
+      for( int i = 0; i < count; ++i )
+      {
+        if( writes & ( 1 << VM_ATTR_POS ) ) p[i].pos = vec3( reg( VM_ATTR_POS, 0 )[i], reg( VM_ATTR_POS, 1 )[i], reg( VM_ATTR_POS, 2 )[i] );
+        if( writes & ( 1 << VM_ATTR_VEL ) ) p[i].vel = vec3( reg( VM_ATTR_VEL, 0 )[i], reg( VM_ATTR_VEL, 1 )[i], reg( VM_ATTR_VEL, 2 )[i] );
+        if( writes & ( 1 << VM_ATTR_COLOR ) ) p[i].set_color( vec3( reg( VM_ATTR_COLOR, 0 )[i], reg( VM_ATTR_COLOR, 1 )[i], reg( VM_ATTR_COLOR, 2 )[i] ) );
+        if( writes & ( 1 << VM_ATTR_SIZE ) ) p[i].set_size( reg( VM_ATTR_SIZE, 0 )[i] );
+        if( writes & ( 1 << VM_ATTR_OPACITY ) ) p[i].set_opacity( reg( VM_ATTR_OPACITY, 0 )[i] );
+        if( writes & ( 1 << VM_ATTR_LIFE ) ) p[i].life = reg( VM_ATTR_LIFE, 0 )[i];
+      }
+    }
+  }
+
+private:
+  //executes the code on count lanes of the registers
+  void run( float* regs, int count ) const
+  {
+    const int n = vm_batch_size;
+
+    for( auto& in : code )
+    {
+      float* d = regs + in.dst * 3 * n;
+      const float* a = regs + in.a * 3 * n;
+      const float* b = regs + in.b * 3 * n;
+      const float* c = regs + in.c * 3 * n;
+
+      //component-wise ops work on all three components in one loop
+      switch( in.op )
+      {
+      case VM_MOV: for( int i = 0; i < 3 * n; ++i ) d[i] = a[i]; break;
+      case VM_ADD: for( int i = 0; i < 3 * n; ++i ) d[i] = a[i] + b[i]; break;
+      case VM_SUB: for( int i = 0; i < 3 * n; ++i ) d[i] = a[i] - b[i]; break;
+      case VM_MUL: for( int i = 0; i < 3 * n; ++i ) d[i] = a[i] * b[i]; break;
+      case VM_DIV: for( int i = 0; i < 3 * n; ++i ) d[i] = a[i] / b[i]; break;
+      case VM_NEG: for( int i = 0; i < 3 * n; ++i ) d[i] = -a[i]; break;
+      case VM_MIN: for( int i = 0; i < 3 * n; ++i ) d[i] = std::min( a[i], b[i] ); break;
+      case VM_MAX: for( int i = 0; i < 3 * n; ++i ) d[i] = std::max( a[i], b[i] ); break;
+      case VM_CLAMP: for( int i = 0; i < 3 * n; ++i ) d[i] = std::min( std::max( a[i], b[i] ), c[i] ); break;
+      case VM_MIX: for( int i = 0; i < 3 * n; ++i ) d[i] = a[i] + ( b[i] - a[i] ) * c[i]; break;
+      case VM_ABS: for( int i = 0; i < 3 * n; ++i ) d[i] = std::abs( a[i] ); break;
+      case VM_FLOOR: for( int i = 0; i < 3 * n; ++i ) d[i] = std::floor( a[i] ); break;
+      case VM_FRACT: for( int i = 0; i < 3 * n; ++i ) d[i] = a[i] - std::floor( a[i] ); break;
+      case VM_SQRT: for( int i = 0; i < 3 * n; ++i ) d[i] = std::sqrt( a[i] ); break;
+      case VM_SIN: for( int i = 0; i < 3 * n; ++i ) d[i] = std::sin( a[i] ); break;
+      case VM_COS: for( int i = 0; i < 3 * n; ++i ) d[i] = std::cos( a[i] ); break;
+      case VM_POW: for( int i = 0; i < 3 * n; ++i ) d[i] = std::pow( a[i], b[i] ); break;
+      case VM_DOT:
+        for( int i = 0; i < count; ++i )
+          d[i] = d[n + i] = d[2 * n + i] = a[i] * b[i] + a[n + i] * b[n + i] + a[2 * n + i] * b[2 * n + i];
+        break;
+      case VM_CROSS:
+        for( int i = 0; i < count; ++i )
+        {
+          float x = a[n + i] * b[2 * n + i] - a[2 * n + i] * b[n + i];
+          float y = a[2 * n + i] * b[i] - a[i] * b[2 * n + i];
+          float z = a[i] * b[n + i] - a[n + i] * b[i];
+          d[i] = x;
+          d[n + i] = y;
+          d[2 * n + i] = z;
+        }
+        break;
+      case VM_LENGTH:
+        for( int i = 0; i < count; ++i )
+          d[i] = d[n + i] = d[2 * n + i] = std::sqrt( a[i] * a[i] + a[n + i] * a[n + i] + a[2 * n + i] * a[2 * n + i] );
+        break;
+      case VM_NORMALIZE:
+        for( int i = 0; i < count; ++i )
+        {
+          float l = std::sqrt( a[i] * a[i] + a[n + i] * a[n + i] + a[2 * n + i] * a[2 * n + i] );
+          float f = l > 0 ? 1 / l : 0;
+          d[i] = a[i] * f;
+          d[n + i] = a[n + i] * f;
+          d[2 * n + i] = a[2 * n + i] * f;
+        }
+        break;
+      case VM_VEC3:
+        for( int i = 0; i < count; ++i )
+        {
+          float x = a[i], y = b[i], z = c[i];
+          d[i] = x;
+          d[n + i] = y;
+          d[2 * n + i] = z;
+        }
+        break;
+      case VM_X:
+      case VM_Y:
+      case VM_Z:
+      {
+        const float* s = a + ( in.op - VM_X ) * n;
+        for( int i = 0; i < count; ++i )
+          d[i] = d[n + i] = d[2 * n + i] = s[i];
+        break;
+      }
+      case VM_NOISE:
+        for( int i = 0; i < count; ++i )
+          d[i] = d[n + i] = d[2 * n + i] = vm_noise( a[i], a[n + i], a[2 * n + i] );
+        break;
+      case VM_RANDOM:
+        for( int i = 0; i < count; ++i )
+          d[i] = d[n + i] = d[2 * n + i] = particle_random( a[i], b[i] );
+        break;
+      case VM_CURVE:
+      {
+        const particle_curve& cv = curves[in.c];
+        for( int i = 0; i < count; ++i )
+        {
+          vec3 v = cv.get( a[i] );
+          d[i] = v.x;
+          d[n + i] = v.y;
+          d[2 * n + i] = v.z;
+        }
+        break;
+      }
+      default:
+        break;
+      }
+    }
+  }
+};
+
+namespace vm_detail
+{
+  struct compiler
+  {
+    particle_program& prog;
+    const vector<std::string>& curve_names;
+    const vector<particle_curve>& curve_list;
+
+    std::string src;
+    size_t pos;
+    int line;
+    std::string error;
+
+    std::map<std::string, int> locals;
+    vector<float> constants;
+    int temp_base; //first register after the locals
+    int temp_top;
+    int max_register;
+
+    compiler( particle_program& p, const std::string& s, const vector<std::string>& cn, const vector<particle_curve>& cl ) :
+      prog( p ), curve_names( cn ), curve_list( cl ), src( s ), pos( 0 ), line( 1 ), temp_base( 0 ), temp_top( 0 ), max_register( VM_ATTR_COUNT )
+    {
+    }
+
+    bool fail( const std::string& msg )
+    {
+      if( error.empty() )
+      {
+        std::stringstream ss;
+        ss << "Particle program, line " << line << ": " << msg;
+        error = ss.str();
+      }
+
+      return false;
+    }
+
+    //skips whitespace and comments, but not newlines
+    void skip()
+    {
+      while( pos < src.size() )
+      {
+        if( src[pos] == ' ' || src[pos] == '\t' || src[pos] == '\r' )
+        {
+          ++pos;
+        }
+        else if( src[pos] == '#' )
+        {
+          while( pos < src.size() && src[pos] != '\n' )
+            ++pos;
+        }
+        else
+        {
+          break;
+        }
+      }
+    }
+
+    char peek()
+    {
+      skip();
+      return pos < src.size() ? src[pos] : 0;
+    }
+
+    bool accept( char c )
+    {
+      if( peek() == c )
+      {
+        ++pos;
+        return true;
+      }
+
+      return false;
+    }
+
+    std::string ident()
+    {
+      skip();
+      size_t start = pos;
+
+      while( pos < src.size() && ( isalnum( (unsigned char)src[pos] ) || src[pos] == '_' ) )
+        ++pos;
+
+      return src.substr( start, pos - start );
+    }
+
+    int alloc_temp()
+    {
+      if( temp_top >= 255 )
+      {
+        fail( "expression too complex" );
+        return 0;
+      }
+
+      max_register = std::max( max_register, temp_top + 1 );
+      return temp_top++;
+    }
+
+    void emit( int op, int dst, int a = 0, int b = 0, int c = 0 )
+    {
+      vm_instr in;
+      in.op = op;
+      in.dst = dst;
+      in.a = a;
+      in.b = b;
+      in.c = c;
+      prog.code.push_back( in );
+    }
+
+    int constant( float f )
+    {
+      for( int c = 0; c < constants.size(); ++c )
+      {
+        if( constants[c] == f )
+          return VM_ATTR_COUNT + c;
+      }
+
+      constants.push_back( f );
+      return VM_ATTR_COUNT + constants.size() - 1;
+    }
+
+    int attribute( const std::string& name )
+    {
+      static const char* names[] = { "pos", "vel", "color", "size", "opacity", "life", "age", "dt", "time", "emitter_pos", "emitter_dir" };
+
+      for( int c = 0; c < VM_ATTR_COUNT; ++c )
+      {
+        if( name == names[c] )
+          return c;
+      }
+
+      return -1;
+    }
+
+    int primary()
+    {
+      char c = peek();
+
+      if( c == '(' )
+      {
+        ++pos;
+        int r = expr();
+        if( !accept( ')' ) )
+          fail( "expected )" );
+        return r;
+      }
+
+      if( isdigit( (unsigned char)c ) || c == '.' )
+      {
+        const char* start = src.c_str() + pos;
+        char* end = 0;
+        float f = strtof( start, &end );
+        pos += end - start;
+        return constant( f );
+      }
+
+      std::string name = ident();
+
+      if( name.empty() )
+      {
+        fail( std::string( "unexpected character " ) + c );
+        return 0;
+      }
+
+      if( accept( '(' ) )
+      {
+        return call( name );
+      }
+
+      int attr = attribute( name );
+
+      if( attr >= 0 )
+      {
+        if( attr < vm_particle_attributes )
+          prog.reads |= 1 << attr;
+
+        return attr;
+      }
+
+      auto it = locals.find( name );
+
+      if( it == locals.end() )
+      {
+        fail( "unknown variable " + name );
+        return 0;
+      }
+
+      return it->second;
+    }
+
+    int call( const std::string& name )
+    {
+      struct func
+      {
+        const char* name;
+        int op;
+        int args;
+      };
+
+      static const func funcs[] =
+      {
+        { "vec3", VM_VEC3, 3 }, { "dot", VM_DOT, 2 }, { "cross", VM_CROSS, 2 }, { "length", VM_LENGTH, 1 },
+        { "normalize", VM_NORMALIZE, 1 }, { "min", VM_MIN, 2 }, { "max", VM_MAX, 2 }, { "clamp", VM_CLAMP, 3 },
+        { "mix", VM_MIX, 3 }, { "abs", VM_ABS, 1 }, { "floor", VM_FLOOR, 1 }, { "fract", VM_FRACT, 1 },
+        { "sqrt", VM_SQRT, 1 }, { "sin", VM_SIN, 1 }, { "cos", VM_COS, 1 }, { "pow", VM_POW, 2 },
+        { "noise", VM_NOISE, 1 }, { "random", VM_RANDOM, 2 }, { "curve", VM_CURVE, 2 }
+      };
+
+      const func* f = 0;
+      for( auto& i : funcs )
+      {
+        if( name == i.name )
+          f = &i;
+      }
+
+      if( !f )
+      {
+        fail( "unknown function " + name );
+        return 0;
+      }
+
+      int args[3] = { 0, 0, 0 };
+      int curve = 0;
+
+      for( int c = 0; c < f->args; ++c )
+      {
+        if( c > 0 && !accept( ',' ) )
+        {
+          fail( "expected , in call to " + name );
+          return 0;
+        }
+
+        //the first argument of curve is the name of the curve
+        if( f->op == VM_CURVE && c == 0 )
+        {
+          std::string cname = ident();
+          auto it = std::find( curve_names.begin(), curve_names.end(), cname );
+
+          if( it == curve_names.end() )
+          {
+            fail( "unknown curve " + cname );
+            return 0;
+          }
+
+          int src_idx = it - curve_names.begin();
+          curve = std::find( prog.curve_sources.begin(), prog.curve_sources.end(), src_idx ) - prog.curve_sources.begin();
+
+          if( curve == prog.curves.size() )
+          {
+            prog.curves.push_back( curve_list[src_idx] );
+            prog.curve_sources.push_back( src_idx );
+          }
+
+          continue;
+        }
+
+        args[c] = expr();
+      }
+
+      if( !accept( ')' ) )
+      {
+        fail( "expected ) in call to " + name );
+        return 0;
+      }
+
+      int dst = alloc_temp();
+
+      if( f->op == VM_CURVE )
+        emit( VM_CURVE, dst, args[1], 0, curve );
+      else
+        emit( f->op, dst, args[0], args[1], args[2] );
+
+      return dst;
+    }
+
+    int postfix()
+    {
+      int r = primary();
+
+      while( accept( '.' ) )
+      {
+        std::string comp = ident();
+
+        if( comp != "x" && comp != "y" && comp != "z" )
+        {
+          fail( "expected x, y or z after ." );
+          return r;
+        }
+
+        int dst = alloc_temp();
+        emit( VM_X + ( comp[0] - 'x' ), dst, r );
+        r = dst;
+      }
+
+      return r;
+    }
+
+    int unary()
+    {
+      if( accept( '-' ) )
+      {
+        int a = unary();
+        int dst = alloc_temp();
+        emit( VM_NEG, dst, a );
+        return dst;
+      }
+
+      return postfix();
+    }
+
+    int term()
+    {
+      int r = unary();
+
+      while( true )
+      {
+        int op;
+
+        if( accept( '*' ) )
+          op = VM_MUL;
+        else if( accept( '/' ) )
+          op = VM_DIV;
+        else
+          break;
+
+        int b = unary();
+        int dst = alloc_temp();
+        emit( op, dst, r, b );
+        r = dst;
+      }
+
+      return r;
+    }
+
+    int expr()
+    {
+      int r = term();
+
+      while( true )
+      {
+        int op;
+
+        if( accept( '+' ) )
+          op = VM_ADD;
+        else if( accept( '-' ) )
+          op = VM_SUB;
+        else
+          break;
+
+        int b = term();
+        int dst = alloc_temp();
+        emit( op, dst, r, b );
+        r = dst;
+      }
+
+      return r;
+    }
+
+    bool statement()
+    {
+      std::string name = ident();
+
+      if( name.empty() )
+        return fail( "expected assignment" );
+
+      if( !accept( '=' ) )
+        return fail( "expected = after " + name );
+
+      int attr = attribute( name );
+      int dst;
+
+      if( attr >= 0 )
+      {
+        if( attr >= vm_writable_attributes )
+          return fail( name + " is read-only" );
+
+        prog.writes |= 1 << attr;
+        dst = attr;
+      }
+      else
+      {
+        temp_top = temp_base;
+        int r = expr();
+
+        //a local can only be used after its first assignment
+        //in the first pass they get their register here, in the second one they are already known
+        auto it = locals.find( name );
+
+        if( it == locals.end() )
+        {
+          it = locals.insert( std::make_pair( name, (int)local_names.size() ) ).first;
+          local_names.push_back( name );
+        }
+
+        emit( VM_MOV, it->second, r );
+        return error.empty();
+      }
+
+      temp_top = temp_base;
+      int r = expr();
+      emit( VM_MOV, dst, r );
+
+      return error.empty();
+    }
+
+    bool compile()
+    {
+      //registers: attributes, constants, locals, temporaries
+      //constants and locals have to be known before the temporaries can be placed,
+      //so a first pass collects them, then the second one emits the final code
+      vector<std::string> local_list;
+
+      for( int pass = 0; pass < 2; ++pass )
+      {
+        prog.code.clear();
+        prog.curves.clear();
+        prog.curve_sources.clear();
+        prog.reads = prog.writes = 0;
+        locals.clear();
+        local_names.clear();
+        pos = 0;
+        line = 1;
+
+        if( pass == 1 )
+        {
+          local_list = local_names_pass0;
+          for( int c = 0; c < local_list.size(); ++c )
+          {
+            locals[local_list[c]] = VM_ATTR_COUNT + constants.size() + c;
+          }
+          local_names = local_list;
+        }
+
+        temp_base = VM_ATTR_COUNT + constants.size() + local_list.size();
+        temp_top = temp_base;
+        max_register = temp_base;
+
+        while( true )
+        {
+          char c = peek();
+
+          if( c == 0 )
+            break;
+
+          if( c == '\n' || c == ';' )
+          {
+            if( c == '\n' )
+              ++line;
+            ++pos;
+            continue;
+          }
+
+          if( !statement() )
+            return false;
+
+          c = peek();
+          if( c != 0 && c != '\n' && c != ';' )
+            return fail( "expected end of statement" );
+        }
+
+        local_names_pass0 = local_names;
+      }
+
+      if( max_register > vm_max_registers || max_register > 255 )
+        return fail( "too many registers used" );
+
+      prog.register_count = max_register;
+      prog.constants.clear();
+
+      for( auto f : constants )
+      {
+        prog.constants.push_back( f );
+        prog.constants.push_back( f );
+        prog.constants.push_back( f );
+      }
+
+      return true;
+    }
+
+    vector<std::string> local_names, local_names_pass0;
+  };
+}
+
+inline bool particle_program::compile( const std::string& source, const vector<std::string>& curve_names, const vector<particle_curve>& curve_list )
+{
+  vm_detail::compiler c( *this, source, curve_names, curve_list );
+
+  if( !c.compile() )
+  {
+    cerr << c.error << endl;
+    code.clear();
+    return false;
+  }
+
+  return true;
+}
+
+//makes the emitters using the definition run the program after their built-in modules
+inline void particle_attach_program( particle_emitter_def& d, const std::shared_ptr<const particle_program>& prog )
+{
+  d.custom_update = [prog]( particle_emitter& em, float dt )
+  {
+    prog->execute( em, dt );
+  };
+}
+
+inline void particle_attach_program( particle_emitter& e, const std::shared_ptr<const particle_program>& prog )
+{
+  particle_attach_program( e.edit_def(), prog );
+}
@@ -1,6 +1,14 @@
 #include "framework.h"
 
 #include "particle.h"
+#include "particle_billboard.h"
+#include "particle_render_queue.h"
+#include "particle_trim.h"
+#include "texture_loader.h"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 using namespace prototyper;
 
@@ -56,6 +64,86 @@ bool move_camera( camera<float>& cam, float move_amount, float seconds )
   return false;
 }
 
+//draws a batch of the snapshot as camera facing quads, or as the trimmed polygon of the texture if there's one
+//stretched billboards already have their axis rotated to the velocity direction and stretched
+//the quads are expanded by the workers, the polygons on this thread
+int draw_billboards( thread_pool& workers, const particle_render_frame& f, const particle_render_queue& q, const particle_draw& d, const particle_trim_shape* trim )
+{
+  static vector<particle_vertex> vertices;
+  static vector<uint32_t> indices;
+
+  int vertex_count = trim ? trim->count : 4;
+  vertices.resize( d.count * vertex_count );
+
+  //the ranges of the merged emitters, one after the other
+  particle_vertex* out = &vertices[0];
+
+  for( uint32_t c = d.first_range; c < d.first_range + d.range_count; ++c )
+  {
+    auto& r = q.get_ranges()[c];
+
+    if( trim )
+      particle_expand_polygons( &f.instances[r.first], r.count, f.view.fwd, *trim, out );
+    else
+      particle_expand_billboards( workers, &f.instances[r.first], r.count, f.view.fwd, out );
+
+    out += r.count * vertex_count;
+  }
+
+  glVertexPointer( 3, GL_FLOAT, sizeof( particle_vertex ), vertices[0].pos );
+  glClientActiveTexture( GL_TEXTURE1 );
+  glTexCoordPointer( 3, GL_FLOAT, sizeof( particle_vertex ), vertices[0].next_uv );
+  glClientActiveTexture( GL_TEXTURE0 );
+  glTexCoordPointer( 2, GL_FLOAT, sizeof( particle_vertex ), vertices[0].uv );
+  glColorPointer( 4, GL_FLOAT, sizeof( particle_vertex ), vertices[0].color );
+
+  if( trim )
+  {
+    particle_polygon_indices( *trim, d.count, indices );
+    glDrawElements( GL_TRIANGLES, indices.size(), GL_UNSIGNED_INT, &indices[0] );
+  }
+  else
+  {
+    glDrawArrays( GL_QUADS, 0, vertices.size() );
+  }
+
+  return d.count;
+}
+
+//screen covering quad, for the composite passes
+void draw_fullscreen_quad()
+{
+  glMatrixMode( GL_MODELVIEW );
+  glPushMatrix();
+  glLoadIdentity();
+  glMatrixMode( GL_PROJECTION );
+  glPushMatrix();
+  glLoadIdentity();
+
+  glBegin( GL_QUADS );
+  glTexCoord2f( 0, 0 );
+  glVertex2f( -1, -1 );
+  glTexCoord2f( 1, 0 );
+  glVertex2f( 1, -1 );
+  glTexCoord2f( 1, 1 );
+  glVertex2f( 1, 1 );
+  glTexCoord2f( 0, 1 );
+  glVertex2f( -1, 1 );
+  glEnd();
+
+  glPopMatrix();
+  glMatrixMode( GL_MODELVIEW );
+  glPopMatrix();
+}
+
+//offscreen target of the particles drawn at half or quarter resolution
+struct lowres_target
+{
+  uint32_t divisor;
+  uvec2 size;
+  GLuint color_tex, depth_tex, fbo;
+};
+
 int main( int argc, char** argv )
 {
   map<string, string> args;
@@ -116,6 +204,9 @@ int main( int argc, char** argv )
       "       --screenx num //set screen width (default:1280)" << endl <<
       "       --screeny num //set screen height (default:720)" << endl <<
       "       --fullscreen  //set fullscreen, windowed by default" << endl <<
+      "       --oit         //draw the first particle system w/ order independent transparency" << endl <<
+      "       --lowres num  //draw the first particle system at 1/num resolution (2 or 4)" << endl <<
+      "       --trim num    //draw the particles as polygons of num vertices (4-8) around the opaque texels" << endl <<
       "       --help        //display this information" << endl;
     return 0;
   }
@@ -132,6 +223,41 @@ int main( int argc, char** argv )
   {
   }
 
+  bool oit = false;
+
+  try
+  {
+    args.at( "--oit" );
+    oit = true;
+  }
+  catch( ... )
+  {
+  }
+
+  int lowres = 1;
+
+  try
+  {
+    ss.clear();
+    ss.str( args.at( "--lowres" ) );
+    ss >> lowres;
+  }
+  catch( ... )
+  {
+  }
+
+  int trim_vertices = 0;
+
+  try
+  {
+    ss.clear();
+    ss.str( args.at( "--trim" ) );
+    ss >> trim_vertices;
+  }
+  catch( ... )
+  {
+  }
+
   /*
    * Initialize the OpenGL context
    */
@@ -171,7 +297,91 @@ int main( int argc, char** argv )
    * Set up the scene
    */
 
-  GLuint tex = frm.load_image( "../resources/particles/soapbubble.png" );
+  //polygon around the texels of the texture that aren't (almost) transparent, quads until the texture arrives
+  particle_trim_shape trim_shape;
+
+  //decoded and mipmapped on worker threads, uploaded by textures.update() when ready
+  texture_loader textures;
+  GLuint tex = textures.load( "../resources/particles/soapbubble.png", TEXTURE_LOAD_MIPMAPS, [&]( GLuint, const texture_image& im )
+  {
+    if( trim_vertices > 0 )
+    {
+      particle_trim_image( &im.mips[0].pixels[0], im.mips[0].w, im.mips[0].h, 8, trim_vertices, trim_shape );
+      cout << "Trimmed billboards: " << trim_shape.count << " vertices, " << trim_shape.area * 100 << "% of the quad" << endl;
+    }
+  } );
+
+  //a copy of the frame's depth, for the offscreen particle targets, the particles don't write depth
+  GLuint scene_depth_tex = 0;
+  frm.create_depth_texture( &scene_depth_tex, screen );
+
+  //weighted blended order independent transparency: accumulation and revealage targets
+  //the particles are depth tested against the frame's depth
+  GLuint oit_accum_tex = 0, oit_reveal_tex = 0, oit_fbo = 0;
+  frm.create_color_texture( &oit_accum_tex, screen );
+  frm.create_color_texture( &oit_reveal_tex, screen );
+
+  glGenFramebuffers( 1, &oit_fbo );
+  glBindFramebuffer( GL_FRAMEBUFFER, oit_fbo );
+  glFramebufferTexture2D( GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, oit_accum_tex, 0 );
+  glFramebufferTexture2D( GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, oit_reveal_tex, 0 );
+  glFramebufferTexture2D( GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, scene_depth_tex, 0 );
+  frm.check_fbo_status();
+  glBindFramebuffer( GL_FRAMEBUFFER, 0 );
+
+  GLuint oit_accum_shader = 0, oit_composite_shader = 0;
+  frm.load_shader( oit_accum_shader, GL_FRAGMENT_SHADER, "../resources/particles/oit_accum.frag" );
+  frm.load_shader( oit_composite_shader, GL_FRAGMENT_SHADER, "../resources/particles/oit_composite.frag" );
+
+  //the accumulation shader blends the flipbook frames like flipbook_blend.frag, order independent emitters can't have their own shader
+  glUseProgram( oit_accum_shader );
+  glUniform1i( glGetUniformLocation( oit_accum_shader, "tex" ), 0 );
+  glUseProgram( oit_composite_shader );
+  glUniform1i( glGetUniformLocation( oit_composite_shader, "accum_tex" ), 0 );
+  glUniform1i( glGetUniformLocation( oit_composite_shader, "reveal_tex" ), 1 );
+  glUseProgram( 0 );
+
+  //low resolution particles: a color and downsampled depth target for half and quarter resolution
+
+  lowres_target lowres_targets[2];
+
+  for( int c = 0; c < 2; ++c )
+  {
+    auto& t = lowres_targets[c];
+    t.divisor = 2 << c;
+    t.size = uvec2( std::max( ( screen.x + t.divisor - 1 ) / t.divisor, 1u ), std::max( ( screen.y + t.divisor - 1 ) / t.divisor, 1u ) );
+    frm.create_color_texture( &t.color_tex, t.size );
+    frm.create_depth_texture( &t.depth_tex, t.size );
+
+    glGenFramebuffers( 1, &t.fbo );
+    glBindFramebuffer( GL_FRAMEBUFFER, t.fbo );
+    glFramebufferTexture2D( GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, t.color_tex, 0 );
+    glFramebufferTexture2D( GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, t.depth_tex, 0 );
+    frm.check_fbo_status();
+    glBindFramebuffer( GL_FRAMEBUFFER, 0 );
+  }
+
+  GLuint lowres_downsample_shader = 0, lowres_upsample_shader = 0;
+  frm.load_shader( lowres_downsample_shader, GL_FRAGMENT_SHADER, "../resources/particles/lowres_downsample.frag" );
+  frm.load_shader( lowres_upsample_shader, GL_FRAGMENT_SHADER, "../resources/particles/lowres_upsample.frag" );
+
+  glUseProgram( lowres_downsample_shader );
+  glUniform1i( glGetUniformLocation( lowres_downsample_shader, "depth_tex" ), 0 );
+  glUniform2f( glGetUniformLocation( lowres_downsample_shader, "texel" ), 1.0f / screen.x, 1.0f / screen.y );
+  glUseProgram( lowres_upsample_shader );
+  glUniform1i( glGetUniformLocation( lowres_upsample_shader, "color_tex" ), 0 );
+  glUniform1i( glGetUniformLocation( lowres_upsample_shader, "depth_tex" ), 1 );
+  glUniform1i( glGetUniformLocation( lowres_upsample_shader, "scene_depth_tex" ), 2 );
+  glUniform2f( glGetUniformLocation( lowres_upsample_shader, "near_far" ), cam_near, cam_far );
+  glUseProgram( 0 );
+
+  //flipbook frames blended in the shader, the default for the particles
+  GLuint flipbook_shader = 0;
+  frm.load_shader( flipbook_shader, GL_FRAGMENT_SHADER, "../resources/particles/flipbook_blend.frag" );
+
+  glUseProgram( flipbook_shader );
+  glUniform1i( glGetUniformLocation( flipbook_shader, "tex" ), 0 );
+  glUseProgram( 0 );
 
   particle_manager pm;
   pm.init();
@@ -179,10 +389,8 @@ int main( int argc, char** argv )
   //////////////////////////////////////////////////
   //first particle system
   //////////////////////////////////////////////////
-  int ps_id = pm.create();
-  auto ps = pm.get( ps_id );
-  ps->pos = vec3( 0 );
-  ps->dir = vec3( 1, 1, 0 );
+  //the settings can be shared by any number of emitters
+  auto ps = std::make_shared<particle_emitter_def>();
   ps->duration = 5; //s
   ps->is_looping = true;
   ps->prewarm = false;
@@ -196,12 +404,12 @@ int main( int argc, char** argv )
   ps->start_pos.type = FUNCTION;
   ps->start_pos.func = []( float dt, const vec3& pos, const vec3& dir ) -> vec3 
   {
-    return pos + vec3( frm.get_random_num( 0, 1 ), 0, frm.get_random_num( 0, 1 ) ) * 0.5;
+    return pos + vec3( particle_random( 0, 1 ), 0, particle_random( 0, 1 ) ) * 0.5;
   };
   ps->start_velocity.type = FUNCTION;
   ps->start_velocity.func = []( float dt, const vec3& pos, const vec3& dir ) -> vec3
   {
-    vec3 rand_vec = vec3( frm.get_random_num( -1, 1 ), frm.get_random_num( -1, 1 ), frm.get_random_num( -1, 1 ) );
+    vec3 rand_vec = vec3( particle_random( -1, 1 ), particle_random( -1, 1 ), particle_random( -1, 1 ) );
     rand_vec *= sign( dot( rand_vec, vec3( 0, 1, 0 ) ) );
     return (dir + rand_vec * 0.25) * 30;
   };
@@ -216,14 +424,20 @@ int main( int argc, char** argv )
   ps->start_life.type = CONSTANT;
   ps->start_life.value = 2; //s
 
+  ps->is_oit = oit;
+  ps->downsample = lowres;
+
   ps->bursts.push_back( make_pair( 0, 30 ) );
   ps->bursts.push_back( make_pair( 2.5, 30 ) );
 
+  int ps_id = pm.create( ps );
+  pm.get( ps_id )->pos = vec3( 0 );
+  pm.get( ps_id )->dir = vec3( 1, 1, 0 );
+
   //////////////////////////////////////////////////
   //second particle system
   //////////////////////////////////////////////////
-  int ps_id2 = pm.create();
-  auto ps2 = pm.get( ps_id2 );
+  auto ps2 = std::make_shared<particle_emitter_def>();
   ps2->duration = 0.5; //s
   ps2->is_looping = true;
   ps2->prewarm = false;
@@ -238,12 +452,12 @@ int main( int argc, char** argv )
   ps2->start_pos.type = FUNCTION;
   ps2->start_pos.func = []( float dt, const vec3& pos, const vec3& dir ) -> vec3
   {
-    return pos + vec3( frm.get_random_num( 0, 1 ), 0, frm.get_random_num( 0, 1 ) ) * 0.5;
+    return pos + vec3( particle_random( 0, 1 ), 0, particle_random( 0, 1 ) ) * 0.5;
   };
   ps2->start_velocity.type = FUNCTION;
   ps2->start_velocity.func = []( float dt, const vec3& pos, const vec3& dir ) -> vec3
   {
-    vec3 rand_vec = vec3( frm.get_random_num( -1, 1 ), frm.get_random_num( -1, 1 ), frm.get_random_num( -1, 1 ) );
+    vec3 rand_vec = vec3( particle_random( -1, 1 ), particle_random( -1, 1 ), particle_random( -1, 1 ) );
     //rand_vec *= sign( dot( rand_vec, vec3( 0, 1, 0 ) ) );
     return ( rand_vec ) * 30;
   };
@@ -260,8 +474,10 @@ int main( int argc, char** argv )
 
   ps2->bursts.push_back( make_pair( 0, 1 ) );
 
+  int ps_id2 = pm.create( ps2 );
+
   //death emit
-  ps->death_subemitter_ids.push_back( ps_id2 );
+  pm.get( ps_id )->death_subemitter_ids.push_back( ps_id2 );
 
   float move_amount = 10;
 
@@ -369,6 +585,63 @@ int main( int argc, char** argv )
 
   float elapsed_time = 0;
 
+  //render snapshots, produced by the simulation thread
+  particle_render_ring ring;
+  particle_render_queue queue;
+
+  //expands the billboards of large batches in parallel, the simulation has a thread of its own
+  thread_pool billboard_workers;
+  billboard_workers.set_threads( std::max( int( std::thread::hardware_concurrency() ) - 2, 0 ) );
+
+  //what the next simulation step gets from the render thread
+  struct sim_tick
+  {
+    std::mutex m;
+    std::condition_variable cv;
+    particle_view view;
+    float seconds; //time not simulated yet, adds up if the simulation falls behind
+    bool pending, do_update, quit;
+  } tick;
+
+  tick.seconds = 0;
+  tick.pending = tick.do_update = tick.quit = false;
+
+  //one long lived simulation thread, woken up every tick
+  std::thread sim_thread( [&]
+  {
+    while( true )
+    {
+      particle_view view;
+      float seconds;
+      bool do_update;
+
+      {
+        std::unique_lock<std::mutex> lock( tick.m );
+        tick.cv.wait( lock, [&] { return tick.quit || tick.pending; } );
+
+        if( tick.quit )
+        {
+          return;
+        }
+
+        view = tick.view;
+        seconds = tick.seconds;
+        do_update = tick.do_update;
+        tick.seconds = 0;
+        tick.pending = false;
+      }
+
+      if( do_update )
+      {
+        pm.set_viewer( view.pos );
+        pm.update( seconds );
+      }
+
+      //culled and sorted back-to-front for the render thread, overlapping emitters merged
+      particle_publish( pm, ring, view, true );
+    }
+  } );
+
   frm.display( [&]
   {
     frm.handle_events( event_handler );
@@ -425,129 +698,259 @@ int main( int argc, char** argv )
     //render last, so dept sorting will be sorta-correct
 
     //update at 60hz
+    //the simulation of the next frame runs on its own thread while this one draws the last published snapshot
     if( seconds > 0.01667 )
     {
-      if( update_pm )
       {
-        pm.update( seconds );
-      }
+        std::lock_guard<std::mutex> lock( tick.m );
+        tick.view.set_up( cam.pos, cam.view_dir, cam.up_vector, the_frame.projection_matrix * cam.get_matrix() );
+        tick.do_update = update_pm;
 
-      //sort each particle system back-to-front
-      auto ptr = pm.get( ps_id );
-      auto sort_func = [&]( const particle& a, const particle& b ) -> bool
-      {
-        return dot( a.pos, cam.pos ) < dot( b.pos, cam.pos );
-      };
+        if( update_pm )
+        {
+          tick.seconds += seconds;
+        }
 
-      if( ptr )
-      {
-        std::sort( ptr->get_particle_iterator(), ptr->get_particle_iterator_end(), sort_func );
+        tick.pending = true;
       }
 
-      ptr = pm.get( ps_id2 );
+      tick.cv.notify_one();
+    }
+
+    //starts accumulating the order independent particles
+    auto begin_oit = [&]
+    {
+      static const GLenum buffers[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+      static const float zero[] = { 0, 0, 0, 0 }, one[] = { 1, 1, 1, 1 };
 
-      if( ptr )
+      glBindFramebuffer( GL_FRAMEBUFFER, oit_fbo );
+      glDrawBuffers( 2, buffers );
+      glClearBufferfv( GL_COLOR, 0, zero );
+      glClearBufferfv( GL_COLOR, 1, one );
+
+      glUseProgram( oit_accum_shader );
+      glBlendFunci( 0, GL_ONE, GL_ONE );
+      glBlendFunci( 1, GL_ZERO, GL_ONE_MINUS_SRC_COLOR );
+    };
+
+    //blends the accumulated particles over the frame
+    auto composite_oit = [&]
+    {
+      glBindFramebuffer( GL_FRAMEBUFFER, 0 );
+
+      glUseProgram( oit_composite_shader );
+      glBlendFunc( GL_ONE_MINUS_SRC_ALPHA, GL_SRC_ALPHA );
+
+      glActiveTexture( GL_TEXTURE1 );
+      glBindTexture( GL_TEXTURE_2D, oit_reveal_tex );
+      glActiveTexture( GL_TEXTURE0 );
+      glBindTexture( GL_TEXTURE_2D, oit_accum_tex );
+
+      draw_fullscreen_quad();
+    };
+
+    //starts drawing into a low resolution target: the nearest depth of every block of the frame goes to its depth buffer,
+    //the color is cleared to transmittance 1
+    auto begin_lowres = [&]( const lowres_target& t )
+    {
+      static const float clear_color[] = { 0, 0, 0, 1 };
+
+      glBindFramebuffer( GL_FRAMEBUFFER, t.fbo );
+      glViewport( 0, 0, t.size.x, t.size.y );
+
+      glUseProgram( lowres_downsample_shader );
+      glUniform1f( glGetUniformLocation( lowres_downsample_shader, "divisor" ), (float)t.divisor );
+      glBindTexture( GL_TEXTURE_2D, scene_depth_tex );
+
+      glDisable( GL_BLEND );
+      glColorMask( false, false, false, false );
+      glDepthMask( true );
+      glDepthFunc( GL_ALWAYS );
+      draw_fullscreen_quad();
+
+      glColorMask( true, true, true, true );
+      glDepthMask( false );
+      glDepthFunc( GL_LEQUAL );
+      glEnable( GL_BLEND );
+      glClearBufferfv( GL_COLOR, 0, clear_color );
+    };
+
+    //depth aware upsample of a low resolution target over the frame
+    auto composite_lowres = [&]( const lowres_target& t )
+    {
+      glBindFramebuffer( GL_FRAMEBUFFER, 0 );
+      glViewport( 0, 0, screen.x, screen.y );
+
+      glUseProgram( lowres_upsample_shader );
+      glUniform2f( glGetUniformLocation( lowres_upsample_shader, "low_size" ), (float)t.size.x, (float)t.size.y );
+      glBlendFunc( GL_ONE, GL_SRC_ALPHA );
+
+      glActiveTexture( GL_TEXTURE2 );
+      glBindTexture( GL_TEXTURE_2D, scene_depth_tex );
+      glActiveTexture( GL_TEXTURE1 );
+      glBindTexture( GL_TEXTURE_2D, t.depth_tex );
+      glActiveTexture( GL_TEXTURE0 );
+      glBindTexture( GL_TEXTURE_2D, t.color_tex );
+
+      //the shader does the depth test
+      glDisable( GL_DEPTH_TEST );
+      draw_fullscreen_quad();
+      glEnable( GL_DEPTH_TEST );
+    };
+
+    auto render_func = [&]( const particle_render_frame& f, GLuint tex ) -> int
+    {
+      queue.clear();
+      queue.submit( f, tex, flipbook_shader );
+      queue.build( true );
+
+      if( queue.get_draws().empty() )
       {
-        std::sort( ptr->get_particle_iterator(), ptr->get_particle_iterator_end(), sort_func );
+        return 0;
       }
-    }
 
-    auto render_func = []( particle_emitter* ptr, const camera<float>& cam, GLuint tex ) -> int
-    {
-      if( ptr )
+      //state shared by every draw
+      glPolygonMode( GL_FRONT_AND_BACK, GL_FILL );
+      glEnable( GL_TEXTURE_2D );
+      glActiveTexture( GL_TEXTURE0 );
+      glEnable( GL_BLEND );
+      glDepthMask( false );
+
+      glEnableClientState( GL_VERTEX_ARRAY );
+      glClientActiveTexture( GL_TEXTURE1 );
+      glEnableClientState( GL_TEXTURE_COORD_ARRAY );
+      glClientActiveTexture( GL_TEXTURE0 );
+      glEnableClientState( GL_TEXTURE_COORD_ARRAY );
+      glEnableClientState( GL_COLOR_ARRAY );
+
+      int counter = 0;
+      bool in_oit = false;
+      const lowres_target* target = 0;
+      bool has_scene_depth = false;
+
+      //the particles don't write depth, so one copy serves every target
+      auto copy_scene_depth = [&]
       {
-        auto ps_it = ptr->get_particle_iterator();
-        auto ps_it_end = ptr->get_particle_iterator_end();
+        if( !has_scene_depth )
+        {
+          glBindTexture( GL_TEXTURE_2D, scene_depth_tex );
+          glCopyTexSubImage2D( GL_TEXTURE_2D, 0, 0, 0, 0, 0, screen.x, screen.y );
+          has_scene_depth = true;
+        }
+      };
 
-        //vec3 fwd = vec3( 0, 0, 1 );
-        vec3 fwd = cam.view_dir;
-        //vec3 up = vec3( 0, 1, 0 );
-        vec3 up = cam.up_vector;
-        vec3 right = cross( cam.view_dir, cam.up_vector );
+      for( auto& d : queue.get_draws() )
+      {
+        uint32_t changes = d.changes;
 
-        glUseProgram( 0 );
-        glPolygonMode( GL_FRONT_AND_BACK, GL_FILL );
+        if( in_oit && d.blend != PARTICLE_BLEND_OIT )
+        {
+          composite_oit();
+          in_oit = false;
 
-        glEnable( GL_TEXTURE_2D );
-        glActiveTexture( GL_TEXTURE0 );
-        glBindTexture( GL_TEXTURE_2D, tex );
-        glEnable( GL_BLEND );
+          //the composite changed everything
+          changes = PARTICLE_STATE_ALL;
+        }
 
-        if( ptr->is_additive )
+        //the draws are grouped by target, full resolution first
+        if( changes & PARTICLE_STATE_TARGET )
         {
-          //additive blending
-          glBlendFunc( GL_SRC_ALPHA, GL_ONE );
+          if( target )
+          {
+            composite_lowres( *target );
+            target = 0;
+          }
+
+          if( d.downsample > 1 )
+          {
+            copy_scene_depth();
+
+            target = &lowres_targets[d.downsample > 2 ? 1 : 0];
+            begin_lowres( *target );
+          }
+
+          changes = PARTICLE_STATE_ALL;
         }
-        else
+
+        if( ( changes & PARTICLE_STATE_SHADER ) && d.blend != PARTICLE_BLEND_OIT )
         {
-          //normal blending
-          glBlendFunc( GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA );
+          glUseProgram( d.shader );
         }
-        
-        glDepthMask( false );
 
-        int counter = 0;
+        if( changes & PARTICLE_STATE_TEXTURE )
+        {
+          glBindTexture( GL_TEXTURE_2D, d.texture );
+        }
 
-        for( ; ps_it != ps_it_end; ++ps_it )
+        if( changes & PARTICLE_STATE_BLEND )
         {
-          glColor4f( ps_it->color.x, ps_it->color.y, ps_it->color.z, ps_it->opacity );
+          if( d.blend == PARTICLE_BLEND_OIT )
+          {
+            //order independent draws are full resolution, so this is still the frame's framebuffer
+            copy_scene_depth();
+            begin_oit();
+            in_oit = true;
 
-          vec3 yaxis;
-          if( ptr->is_stretched )
+            //the copy unbound the texture
+            glBindTexture( GL_TEXTURE_2D, d.texture );
+          }
+          else if( d.blend == PARTICLE_BLEND_ADDITIVE )
           {
-            yaxis = normalize( ps_it->vel ) * ptr->stretch_factor;
+            //additive blending, the transmittance in the low resolution targets' alpha stays
+            if( target )
+              glBlendFuncSeparate( GL_SRC_ALPHA, GL_ONE, GL_ZERO, GL_ONE );
+            else
+              glBlendFunc( GL_SRC_ALPHA, GL_ONE );
           }
           else
           {
-            yaxis = up;
+            //normal blending, premultiplied color and transmittance in the low resolution targets
+            if( target )
+              glBlendFuncSeparate( GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ZERO, GL_ONE_MINUS_SRC_ALPHA );
+            else
+              glBlendFunc( GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA );
           }
-
-          vec3 zaxis = fwd;
-          vec3 xaxis = normalize( cross( zaxis, yaxis ) );
-
-          vec3 to_ur = normalize( xaxis + yaxis );
-          //vec3 to_ur = ( right + up );
-          vec3 to_ll = -to_ur;
-          vec3 to_lr = normalize( xaxis - yaxis );
-          //vec3 to_lr = ( right - up );
-          vec3 to_ul = -to_lr;
-
-          glBegin( GL_QUADS );
-          vec3 ll = ps_it->pos + to_ll * ps_it->size;
-          vec3 lr = ps_it->pos + to_lr * ps_it->size;
-          vec3 ul = ps_it->pos + to_ul * ps_it->size;
-          vec3 ur = ps_it->pos + to_ur * ps_it->size;
-
-          //first, rotate the billboard to velocity direction, then stretch along the y axis
-
-          glVertex3fv( &lr.x );
-          glTexCoord2f( 1, 0 );
-          glVertex3fv( &ur.x );
-          glTexCoord2f( 1, 1 );
-          glVertex3fv( &ul.x );
-          glTexCoord2f( 0, 1 );
-          glVertex3fv( &ll.x );
-          glTexCoord2f( 0, 0 );
-
-          glEnd();
-          ++counter;
         }
 
-        glDisable( GL_TEXTURE_2D );
-        glDepthMask( true );
-        glDisable( GL_BLEND );
+        counter += draw_billboards( billboard_workers, f, queue, d, d.texture == tex && trim_shape.count > 0 ? &trim_shape : 0 );
+      }
 
-        return counter;
+      if( in_oit )
+      {
+        composite_oit();
       }
+
+      if( target )
+      {
+        composite_lowres( *target );
+      }
+
+      glDisableClientState( GL_VERTEX_ARRAY );
+      glClientActiveTexture( GL_TEXTURE1 );
+      glDisableClientState( GL_TEXTURE_COORD_ARRAY );
+      glClientActiveTexture( GL_TEXTURE0 );
+      glDisableClientState( GL_TEXTURE_COORD_ARRAY );
+      glDisableClientState( GL_COLOR_ARRAY );
+
+      glUseProgram( 0 );
+      glDisable( GL_TEXTURE_2D );
+      glDepthMask( true );
+      glDisable( GL_BLEND );
+
+      return counter;
     };
 
     int particles_rendered = 0;
 
+    textures.update();
+
     //render particles
-    auto ptr = pm.get( ps_id );
-    particles_rendered += render_func( ptr, cam, tex );
-    ptr = pm.get( ps_id2 );
-    particles_rendered += render_func( ptr, cam, tex );
+    auto snapshot = ring.acquire();
+
+    if( snapshot )
+    {
+      particles_rendered = render_func( *snapshot, tex );
+    }
 
     //////////////////////////////////////////////////////////
     //////////////////////////////////////////////////////////
@@ -558,5 +961,13 @@ int main( int argc, char** argv )
     frm.get_opengl_error();
   }, silent );
 
+  {
+    std::lock_guard<std::mutex> lock( tick.m );
+    tick.quit = true;
+  }
+
+  tick.cv.notify_one();
+  sim_thread.join();
+
   return 0;
 }
\ No newline at end of file
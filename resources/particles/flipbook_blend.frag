@@ -0,0 +1,14 @@
+#version 120
+
+//flipbook frame blending: texture coordinates 0 are the frame, 1 the next one w/ the blend factor in z
+//w/o a flipbook both are the same, and it's the same as fixed function modulation
+
+uniform sampler2D tex;
+
+void main()
+{
+  vec4 frame = texture2D( tex, gl_TexCoord[0].xy );
+  vec4 next = texture2D( tex, gl_TexCoord[1].xy );
+
+  gl_FragColor = mix( frame, next, gl_TexCoord[1].z ) * gl_Color;
+}
@@ -0,0 +1,27 @@
+#version 120
+
+//nearest depth of every divisor x divisor block of the frame, written to the low resolution depth buffer
+//the nearest one occludes conservatively, the upsample picks the neighbours that match
+
+uniform sampler2D depth_tex;
+uniform vec2 texel; //1 / full resolution
+uniform float divisor; //2 or 4
+
+void main()
+{
+  vec2 corner = floor( gl_FragCoord.xy ) * divisor;
+  float depth = 1.0;
+
+  for( int y = 0; y < 4; ++y )
+  {
+    for( int x = 0; x < 4; ++x )
+    {
+      if( float( x ) < divisor && float( y ) < divisor )
+      {
+        depth = min( depth, texture2D( depth_tex, ( corner + vec2( x, y ) + 0.5 ) * texel ).r );
+      }
+    }
+  }
+
+  gl_FragDepth = depth;
+}
@@ -0,0 +1,55 @@
+#version 120
+
+//depth aware (bilateral) upsample of the low resolution particles, composited over the frame
+//rgb is premultiplied, alpha is the transmittance, blended with GL_ONE, GL_SRC_ALPHA
+
+uniform sampler2D color_tex; //low resolution
+uniform sampler2D depth_tex; //low resolution, nearest depth of every block
+uniform sampler2D scene_depth_tex; //full resolution
+uniform vec2 low_size;
+uniform vec2 near_far;
+
+float linear_depth( float d )
+{
+  return near_far.x * near_far.y / ( near_far.y - d * ( near_far.y - near_far.x ) );
+}
+
+void main()
+{
+  vec2 uv = gl_TexCoord[0].xy;
+  float z = linear_depth( texture2D( scene_depth_tex, uv ).r );
+
+  //the 4 low resolution texels around the pixel, the bilinear weights scaled down by the depth difference
+  vec2 p = uv * low_size - 0.5;
+  vec2 f = fract( p );
+  vec2 base = ( floor( p ) + 0.5 ) / low_size;
+
+  vec4 sum = vec4( 0.0 );
+  float weight_sum = 0.0;
+  vec4 closest = vec4( 0.0, 0.0, 0.0, 1.0 );
+  float closest_diff = 1e30;
+
+  for( int c = 0; c < 4; ++c )
+  {
+    vec2 o = vec2( mod( float( c ), 2.0 ), floor( float( c ) * 0.5 ) );
+    vec2 tuv = base + o / low_size;
+
+    vec4 color = texture2D( color_tex, tuv );
+    float diff = abs( linear_depth( texture2D( depth_tex, tuv ).r ) - z ) / z;
+
+    vec2 bilinear = mix( 1.0 - f, f, o );
+    float w = bilinear.x * bilinear.y / ( 1e-3 + diff );
+
+    sum += color * w;
+    weight_sum += w;
+
+    if( diff < closest_diff )
+    {
+      closest_diff = diff;
+      closest = color;
+    }
+  }
+
+  //none of them is on the same surface: take the closest in depth
+  gl_FragColor = weight_sum > 1e-3 ? sum / weight_sum : closest;
+}
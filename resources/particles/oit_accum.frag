@@ -0,0 +1,20 @@
+#version 120
+
+//weighted blended order independent transparency, accumulation pass
+//McGuire and Bavoil, Weighted Blended Order-Independent Transparency, 2013
+//the flipbook frames are blended like flipbook_blend.frag does
+
+uniform sampler2D tex;
+
+void main()
+{
+  vec4 frame = texture2D( tex, gl_TexCoord[0].xy );
+  vec4 next = texture2D( tex, gl_TexCoord[1].xy );
+  vec4 color = mix( frame, next, gl_TexCoord[1].z ) * gl_Color;
+
+  //closer fragments weigh more
+  float w = color.a * max( 1e-2, 3e3 * pow( 1.0 - gl_FragCoord.z, 3.0 ) );
+
+  gl_FragData[0] = vec4( color.rgb * color.a, color.a ) * w;
+  gl_FragData[1] = vec4( color.a );
+}
@@ -0,0 +1,15 @@
+#version 120
+
+//weighted blended order independent transparency, composited over the frame
+//blended with GL_ONE_MINUS_SRC_ALPHA, GL_SRC_ALPHA
+
+uniform sampler2D accum_tex;
+uniform sampler2D reveal_tex;
+
+void main()
+{
+  vec4 accum = texture2D( accum_tex, gl_TexCoord[0].xy );
+  float revealage = texture2D( reveal_tex, gl_TexCoord[0].xy ).r;
+
+  gl_FragColor = vec4( accum.rgb / clamp( accum.a, 1e-4, 5e4 ), revealage );
+}
@@ -0,0 +1,114 @@
+#include <mymath/mymath.h>
+
+#include <vector>
+#include <functional>
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <map>
+#include <cstdlib>
+#include <cstring>
+
+using namespace mymath;
+using namespace std;
+
+#include "particle_billboard.h"
+
+/*
+ * Checks the batched billboard expansion against the scalar reference,
+ * for counts that leave every possible tail, and the threaded version against the batched one.
+ * Returns non-zero on failure.
+ */
+
+static vector<particle_instance> make_instances( int count )
+{
+  vector<particle_instance> in( count );
+
+  for( auto& p : in )
+  {
+    for( int c = 0; c < 3; ++c )
+    {
+      p.pos[c] = rand() % 2000 / 10.0f - 100;
+      p.axis[c] = rand() % 200 / 100.0f - 1;
+      p.color[c] = rand() % 100 / 100.0f;
+    }
+
+    //the axis can't be parallel to the view direction
+    p.axis[0] += 0.1f;
+
+    p.color[3] = rand() % 100 / 100.0f;
+    p.size = rand() % 100 / 10.0f + 0.1f;
+    p.depth = 0;
+    p.uv[0] = 0.25f;
+    p.uv[1] = 0.5f;
+    p.uv[2] = 0.5f;
+    p.uv[3] = 0.75f;
+    p.next_uv[0] = 0.5f;
+    p.next_uv[1] = 0.5f;
+    p.frame_blend = rand() % 100 / 100.0f;
+  }
+
+  return in;
+}
+
+int main()
+{
+  srand( 3 );
+
+  vec3 fwd = normalize( vec3( 0.3f, -0.2f, -1 ) );
+
+  thread_pool workers;
+  workers.set_threads( 3 );
+
+  const int counts[] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 1023, 1024, 1025, 4099 };
+  int failed = 0;
+
+  for( int count : counts )
+  {
+    vector<particle_instance> in = make_instances( count );
+
+    //one extra quad at the end, the batched versions must not write past count
+    vector<particle_vertex> ref( count * 4 + 4 ), batched( count * 4 + 4 ), threaded( count * 4 + 4 );
+    memset( &ref[0], 0, ref.size() * sizeof( particle_vertex ) );
+    memset( &batched[0], 0xab, batched.size() * sizeof( particle_vertex ) );
+    memset( &threaded[0], 0xab, threaded.size() * sizeof( particle_vertex ) );
+
+    for( int c = 0; c < count; ++c )
+    {
+      particle_expand_billboard( in[c], fwd, &ref[c * 4] );
+    }
+
+    const particle_instance* src = in.empty() ? 0 : &in[0];
+    particle_expand_billboards( src, count, fwd, &batched[0] );
+    particle_expand_billboards( workers, src, count, fwd, &threaded[0] );
+
+    size_t bytes = count * 4 * sizeof( particle_vertex );
+
+    if( memcmp( &ref[0], &batched[0], bytes ) != 0 )
+    {
+      cerr << "count " << count << ": the batched expansion differs from the reference" << endl;
+      ++failed;
+    }
+
+    if( memcmp( &batched[0], &threaded[0], bytes ) != 0 )
+    {
+      cerr << "count " << count << ": the threaded expansion differs from the batched one" << endl;
+      ++failed;
+    }
+
+    //the guard quad is untouched
+    for( int c = 0; c < 4 * (int)sizeof( particle_vertex ); ++c )
+    {
+      if( ( (unsigned char*)&batched[count * 4] )[c] != 0xab || ( (unsigned char*)&threaded[count * 4] )[c] != 0xab )
+      {
+        cerr << "count " << count << ": written past the end" << endl;
+        ++failed;
+        break;
+      }
+    }
+  }
+
+  cout << ( failed ? "FAILED" : "passed" ) << endl;
+
+  return failed ? 1 : 0;
+}
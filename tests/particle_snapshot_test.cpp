@@ -0,0 +1,173 @@
+#include <mymath/mymath.h>
+
+#include <vector>
+#include <functional>
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <map>
+#include <cstdlib>
+#include <cstring>
+
+using namespace mymath;
+using namespace std;
+
+#include "particle.h"
+#include "particle_snapshot.h"
+
+/*
+ * Feeds restore() truncated and corrupt snapshots, they have to be rejected
+ * w/o reading past the blob, and the manager has to stay untouched.
+ * Returns non-zero on failure.
+ */
+
+static void setup( particle_emitter* e, float eps )
+{
+  e->pos = vec3( 0 );
+  e->dir = vec3( 0, 1, 0 );
+
+  auto ps = &e->edit_def();
+  ps->duration = 5;
+  ps->is_looping = true;
+  ps->max_particles = 1000;
+  ps->start_pos.type = CONSTANT;
+  ps->start_pos.value = vec3( 0 );
+  ps->start_velocity.type = FUNCTION;
+  ps->start_velocity.func = []( float, const vec3& p, const vec3& d ) -> vec3 { return d * particle_random( 0, 10 ); };
+  ps->start_color.type = CONSTANT;
+  ps->start_color.value = vec3( 1 );
+  ps->start_size.type = CONSTANT;
+  ps->start_size.value = 1;
+  ps->start_opacity.type = CONSTANT;
+  ps->start_opacity.value = 1;
+  ps->emit_per_second.type = CONSTANT;
+  ps->emit_per_second.value = eps;
+  ps->start_life.type = CONSTANT;
+  ps->start_life.value = 2;
+}
+
+//particle count and position sum of every emitter
+static string state( particle_manager& pm, const vector<int>& ids )
+{
+  string s;
+
+  for( int id : ids )
+  {
+    auto e = pm.get( id );
+    float sum = 0;
+
+    for( auto& p : e->particles )
+    {
+      sum += p.pos.x + p.pos.y + p.pos.z;
+    }
+
+    s += to_string( e->particles.size() ) + ":" + to_string( sum ) + " ";
+  }
+
+  return s;
+}
+
+int main()
+{
+  particle_manager pm;
+  pm.init();
+  pm.set_deterministic( 5, 1 / 60.0f );
+
+  int a = pm.create();
+  setup( pm.get( a ), 100 );
+  int b = pm.create();
+  setup( pm.get( b ), 50 );
+  pm.get( a )->birth_subemitter_ids.push_back( b );
+
+  for( int c = 0; c < 20; ++c )
+  {
+    pm.update( 1 / 60.0f );
+  }
+
+  vector<char> snap;
+  particle_snapshot::defs defs;
+  particle_snapshot::save( pm, snap, &defs );
+
+  pm.update( 1 / 60.0f );
+  string before = state( pm, { a, b } );
+
+  int failed = 0;
+
+  auto expect_rejected = [&]( const char* name, const vector<char>& blob, size_t size )
+  {
+    const char* data = blob.empty() ? 0 : &blob[0];
+
+    //an id that isn't in the snapshot makes the lookup walk every record
+    if( particle_snapshot::restore( pm, data, size, &defs ) || particle_snapshot::restore_emitter( pm, data, size, a, a ) ||
+        particle_snapshot::restore_emitter( pm, data, size, -1, a ) )
+    {
+      cerr << name << ": accepted" << endl;
+      ++failed;
+    }
+
+    if( state( pm, { a, b } ) != before )
+    {
+      cerr << name << ": the manager changed" << endl;
+      ++failed;
+    }
+  };
+
+  auto corrupt = [&]( function<void( psnap_header& )> f )
+  {
+    vector<char> blob = snap;
+    f( *reinterpret_cast<psnap_header*>( &blob[0] ) );
+    return blob;
+  };
+
+  //truncated anywhere
+  for( size_t size = 0; size < snap.size(); size += 7 )
+  {
+    expect_rejected( "truncated", snap, size );
+  }
+
+  //a stored size smaller than the header, w/ a count that would walk off the end
+  expect_rejected( "size below the header", corrupt( []( psnap_header& h ) { h.size = 4; h.emitter_count = 1000000; h.link_offset = 0; h.link_count = 0; } ), snap.size() );
+  expect_rejected( "size past the blob", corrupt( []( psnap_header& h ) { h.size += 16; } ), snap.size() );
+  expect_rejected( "too many records", corrupt( []( psnap_header& h ) { h.emitter_count = h.size / sizeof( psnap_emitter ); } ), snap.size() );
+
+  //the link array overlapping the records
+  expect_rejected( "links in the records", corrupt( []( psnap_header& h ) { h.link_offset = sizeof( psnap_header ); } ), snap.size() );
+  expect_rejected( "links in the header", corrupt( []( psnap_header& h ) { h.link_offset = 0; } ), snap.size() );
+  expect_rejected( "links past the end", corrupt( []( psnap_header& h ) { h.link_count = h.size; } ), snap.size() );
+
+  //a record pointing outside
+  expect_rejected( "particles past the end", corrupt( []( psnap_header& h ) { ( (psnap_emitter*)( &h + 1 ) )->particle_count = 1000000; } ), snap.size() );
+  expect_rejected( "links past the array", corrupt( []( psnap_header& h ) { ( (psnap_emitter*)( &h + 1 ) )->first_birth_link = h.link_count + 1; } ), snap.size() );
+
+  //garbage w/ a valid looking header
+  srand( 11 );
+
+  for( int c = 0; c < 1000; ++c )
+  {
+    vector<char> blob = snap;
+    size_t size = sizeof( psnap_header ) + rand() % ( snap.size() - sizeof( psnap_header ) );
+
+    for( size_t d = 8; d < size; ++d )
+    {
+      if( rand() % 8 == 0 )
+      {
+        blob[d] = rand();
+      }
+    }
+
+    //the result doesn't matter, only that it stays within the blob, run it w/ a sanitizer
+    vector<char> exact( blob.begin(), blob.begin() + size );
+    particle_snapshot::restore_emitter( pm, &exact[0], exact.size(), a, a );
+  }
+
+  //the untouched snapshot still works
+  if( !particle_snapshot::restore( pm, &snap[0], snap.size(), &defs ) )
+  {
+    cerr << "the valid snapshot was rejected" << endl;
+    ++failed;
+  }
+
+  cout << ( failed ? "FAILED" : "passed" ) << endl;
+
+  return failed ? 1 : 0;
+}
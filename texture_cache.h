@@ -0,0 +1,502 @@
+#pragma once
+
+#include "texture_loader.h"
+
+#include <fstream>
+#include <cstdio>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <Windows.h>
+#include <direct.h>
+#else
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/*
+ * Texture cache
+ *
+ * Decoding PNGs dominates startup, so the decoded images are kept in a cache
+ * directory, with the whole mip chain, optionally block compressed (BC3 aka
+ * DXT5). An entry is keyed by the source path, its modification time and
+ * size. It's rebuilt when the source changes, otherwise it's memory mapped
+ * and uploaded as is:
+ *
+ *   texture_cache cache( "texture_cache/" );
+ *   texture_cache_current() = &cache; //framework::load_image() and load_into_meshes() use it from now on
+ *
+ *   GLuint tex = cache.load( "smoke.png" );
+ *
+ * Entry layout: texture_cache_header, the source path, then the levels, 16 byte aligned.
+ */
+
+static const char texture_cache_magic[4] = { 'T', 'X', 'C', 'H' };
+static const uint32_t texture_cache_version = 1;
+static const int texture_cache_max_levels = 16;
+
+enum texture_cache_format
+{
+  TEXTURE_CACHE_RGBA8 = 0, TEXTURE_CACHE_BC3
+};
+
+struct texture_cache_level
+{
+  uint32_t w, h;
+  uint64_t offset, size;
+};
+
+struct texture_cache_header
+{
+  char magic[4];
+  uint32_t version;
+  uint32_t format; //texture_cache_format
+  uint32_t level_count;
+  uint32_t is_transparent; //any alpha below 255 in the source
+  uint32_t path_length;
+  int64_t mtime; //of the source
+  uint64_t source_size;
+  texture_cache_level levels[texture_cache_max_levels];
+};
+
+//BC3: 4x4 blocks of 8 bytes of interpolated alpha and 8 bytes of 4 color mode 565 color
+//endpoints are the bounding box, indices the nearest point on the line, fast and good enough for effects
+inline void texture_compress_bc3( const texture_mip& m, std::vector<uint8_t>& out )
+{
+  int bw = ( m.w + 3 ) / 4, bh = ( m.h + 3 ) / 4;
+  out.resize( bw * bh * 16 );
+  uint8_t* dst = &out[0];
+
+  for( int by = 0; by < bh; ++by )
+  {
+    for( int bx = 0; bx < bw; ++bx, dst += 16 )
+    {
+      //the block, edge texels repeated past the border
+      uint8_t px[16][4];
+
+      for( int c = 0; c < 16; ++c )
+      {
+        int x = std::min( bx * 4 + ( c & 3 ), m.w - 1 );
+        int y = std::min( by * 4 + ( c >> 2 ), m.h - 1 );
+        memcpy( px[c], &m.pixels[( y * m.w + x ) * 4], 4 );
+      }
+
+      int lo[4] = { 255, 255, 255, 255 }, hi[4] = { 0, 0, 0, 0 };
+
+      for( int c = 0; c < 16; ++c )
+      {
+        for( int k = 0; k < 4; ++k )
+        {
+          lo[k] = std::min( lo[k], ( int )px[c][k] );
+          hi[k] = std::max( hi[k], ( int )px[c][k] );
+        }
+      }
+
+      //alpha: a0 > a1 selects 6 interpolated values, index 0 is a0, 1 is a1, 2...7 go from a0 to a1
+      uint64_t alpha_bits = 0;
+
+      if( hi[3] > lo[3] )
+      {
+        for( int c = 0; c < 16; ++c )
+        {
+          int q = ( ( px[c][3] - lo[3] ) * 7 * 2 + ( hi[3] - lo[3] ) ) / ( ( hi[3] - lo[3] ) * 2 );
+          uint64_t idx = q == 7 ? 0 : ( q == 0 ? 1 : 8 - q );
+          alpha_bits |= idx << ( c * 3 );
+        }
+      }
+
+      dst[0] = hi[3];
+      dst[1] = lo[3];
+
+      for( int c = 0; c < 6; ++c )
+      {
+        dst[2 + c] = ( alpha_bits >> ( c * 8 ) ) & 0xff;
+      }
+
+      //color: inset the box a bit, the ends are rarely hit exactly
+      int c0[3], c1[3];
+
+      for( int k = 0; k < 3; ++k )
+      {
+        int inset = ( hi[k] - lo[k] ) / 16;
+        c0[k] = hi[k] - inset;
+        c1[k] = lo[k] + inset;
+      }
+
+      uint16_t e0 = ( ( c0[0] >> 3 ) << 11 ) | ( ( c0[1] >> 2 ) << 5 ) | ( c0[2] >> 3 );
+      uint16_t e1 = ( ( c1[0] >> 3 ) << 11 ) | ( ( c1[1] >> 2 ) << 5 ) | ( c1[2] >> 3 );
+
+      uint32_t color_bits = 0;
+
+      if( e0 != e1 )
+      {
+        int d[3] = { c0[0] - c1[0], c0[1] - c1[1], c0[2] - c1[2] };
+        int len = d[0] * d[0] + d[1] * d[1] + d[2] * d[2];
+
+        for( int c = 0; c < 16; ++c )
+        {
+          int t = ( px[c][0] - c1[0] ) * d[0] + ( px[c][1] - c1[1] ) * d[1] + ( px[c][2] - c1[2] ) * d[2];
+          int q = len > 0 ? std::min( std::max( ( t * 3 * 2 + len ) / ( len * 2 ), 0 ), 3 ) : 3;
+
+          //q: 0 at c1 ... 3 at c0, index 0 is c0, 1 is c1, 2 is 2/3 c0, 3 is 1/3 c0
+          static const uint32_t to_index[4] = { 1, 3, 2, 0 };
+          color_bits |= to_index[q] << ( c * 2 );
+        }
+      }
+
+      memcpy( dst + 8, &e0, 2 );
+      memcpy( dst + 10, &e1, 2 );
+      memcpy( dst + 12, &color_bits, 4 );
+    }
+  }
+}
+
+//a memory mapped, validated cache entry
+class texture_cache_entry
+{
+  const uint8_t* data;
+  size_t size;
+
+#ifdef _WIN32
+  HANDLE file, mapping;
+#endif
+
+  texture_cache_entry( const texture_cache_entry& );
+  texture_cache_entry& operator=( const texture_cache_entry& );
+
+  bool is_valid() const
+  {
+    if( size < sizeof( texture_cache_header ) )
+      return false;
+
+    auto& h = get_header();
+
+    if( memcmp( h.magic, texture_cache_magic, 4 ) != 0 || h.version != texture_cache_version ||
+        h.level_count == 0 || h.level_count > texture_cache_max_levels || h.format > TEXTURE_CACHE_BC3 ||
+        h.path_length > size - sizeof( texture_cache_header ) )
+      return false;
+
+    for( uint32_t c = 0; c < h.level_count; ++c )
+    {
+      auto& l = h.levels[c];
+
+      if( l.offset > size || l.size > size - l.offset )
+        return false;
+
+      //a mip chain: every level is the previous one halved, down to 1
+      if( c == 0 ? l.w == 0 || l.h == 0 || l.w > 65536 || l.h > 65536 :
+          l.w != std::max( h.levels[c - 1].w / 2, 1u ) || l.h != std::max( h.levels[c - 1].h / 2, 1u ) )
+        return false;
+
+      //the upload reads this many bytes of the level
+      uint64_t expected = h.format == TEXTURE_CACHE_BC3 ? uint64_t( ( l.w + 3 ) / 4 ) * ( ( l.h + 3 ) / 4 ) * 16 : uint64_t( l.w ) * l.h * 4;
+
+      if( l.size != expected )
+        return false;
+    }
+
+    return true;
+  }
+
+public:
+#ifdef _WIN32
+  texture_cache_entry() : data( 0 ), size( 0 ), file( INVALID_HANDLE_VALUE ), mapping( 0 )
+#else
+  texture_cache_entry() : data( 0 ), size( 0 )
+#endif
+  {
+  }
+
+  ~texture_cache_entry()
+  {
+    close();
+  }
+
+  bool open( const std::string& filename )
+  {
+    close();
+
+#ifdef _WIN32
+    file = CreateFileA( filename.c_str(), GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0 );
+
+    if( file == INVALID_HANDLE_VALUE )
+      return false;
+
+    LARGE_INTEGER s;
+    GetFileSizeEx( file, &s );
+    size = s.QuadPart;
+    mapping = size ? CreateFileMappingA( file, 0, PAGE_READONLY, 0, 0, 0 ) : 0;
+    data = mapping ? ( const uint8_t* )MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 ) : 0;
+#else
+    int fd = ::open( filename.c_str(), O_RDONLY );
+
+    if( fd < 0 )
+      return false;
+
+    struct stat st;
+
+    if( fstat( fd, &st ) == 0 && st.st_size > 0 )
+    {
+      size = st.st_size;
+      void* p = mmap( 0, size, PROT_READ, MAP_PRIVATE, fd, 0 );
+      data = p == MAP_FAILED ? 0 : ( const uint8_t* )p;
+    }
+
+    //the mapping stays valid w/o the descriptor
+    ::close( fd );
+#endif
+
+    if( !data || !is_valid() )
+    {
+      close();
+      return false;
+    }
+
+    return true;
+  }
+
+  void close()
+  {
+#ifdef _WIN32
+    if( data ) UnmapViewOfFile( data );
+    if( mapping ) CloseHandle( mapping );
+    if( file != INVALID_HANDLE_VALUE ) CloseHandle( file );
+    mapping = 0;
+    file = INVALID_HANDLE_VALUE;
+#else
+    if( data ) munmap( ( void* )data, size );
+#endif
+
+    data = 0;
+    size = 0;
+  }
+
+  bool is_open() const
+  {
+    return data != 0;
+  }
+
+  const texture_cache_header& get_header() const
+  {
+    return *( const texture_cache_header* )data;
+  }
+
+  std::string get_path() const
+  {
+    return std::string( ( const char* )data + sizeof( texture_cache_header ), get_header().path_length );
+  }
+
+  const uint8_t* get_level( int c ) const
+  {
+    return data + get_header().levels[c].offset;
+  }
+
+  //uploads every level to the bound GL_TEXTURE_2D, straight from the mapping
+  //w/ storage set up by glTexStorage2D the levels are only filled in
+  void upload( bool has_storage = false ) const
+  {
+    auto& h = get_header();
+
+    glPixelStorei( GL_UNPACK_ALIGNMENT, 4 );
+
+    for( uint32_t c = 0; c < h.level_count; ++c )
+    {
+      auto& l = h.levels[c];
+
+      if( h.format == TEXTURE_CACHE_BC3 )
+      {
+        if( has_storage )
+          glCompressedTexSubImage2D( GL_TEXTURE_2D, c, 0, 0, l.w, l.h, GL_COMPRESSED_RGBA_S3TC_DXT5_EXT, l.size, get_level( c ) );
+        else
+          glCompressedTexImage2D( GL_TEXTURE_2D, c, GL_COMPRESSED_RGBA_S3TC_DXT5_EXT, l.w, l.h, 0, l.size, get_level( c ) );
+      }
+      else
+      {
+        if( has_storage )
+          glTexSubImage2D( GL_TEXTURE_2D, c, 0, 0, l.w, l.h, GL_RGBA, GL_UNSIGNED_BYTE, get_level( c ) );
+        else
+          glTexImage2D( GL_TEXTURE_2D, c, GL_RGBA8, l.w, l.h, 0, GL_RGBA, GL_UNSIGNED_BYTE, get_level( c ) );
+      }
+    }
+
+    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, h.level_count - 1 );
+  }
+};
+
+class texture_cache
+{
+  std::string dir;
+  bool compress;
+
+  static uint64_t hash( const std::string& s )
+  {
+    //fnv-1a
+    uint64_t h = 14695981039346656037ULL;
+
+    for( char c : s )
+    {
+      h = ( h ^ ( uint8_t )c ) * 1099511628211ULL;
+    }
+
+    return h;
+  }
+
+  std::string get_filename( const std::string& path, uint32_t format ) const
+  {
+    char name[32];
+    snprintf( name, sizeof( name ), "%016llx", ( unsigned long long )hash( path ) );
+    return dir + name + ( format == TEXTURE_CACHE_BC3 ? ".bc3" : ".rgba" );
+  }
+
+  static bool matches( const texture_cache_entry& e, const std::string& path, const struct stat& st, uint32_t format )
+  {
+    auto& h = e.get_header();
+    return h.format == format && h.mtime == ( int64_t )st.st_mtime && h.source_size == ( uint64_t )st.st_size && e.get_path() == path;
+  }
+
+  bool build( const std::string& path, const struct stat& st, uint32_t format, const std::string& filename )
+  {
+    texture_image img;
+
+    if( !texture_decode( path, TEXTURE_LOAD_MIPMAPS, img ) )
+      return false;
+
+    texture_cache_header h;
+    memset( &h, 0, sizeof( h ) );
+    memcpy( h.magic, texture_cache_magic, 4 );
+    h.version = texture_cache_version;
+    h.format = format;
+    h.level_count = std::min( ( int )img.mips.size(), texture_cache_max_levels );
+    h.path_length = path.size();
+    h.mtime = st.st_mtime;
+    h.source_size = st.st_size;
+
+    h.is_transparent = texture_is_transparent( &img.mips[0].pixels[0], img.mips[0].w * img.mips[0].h );
+
+    std::vector<std::vector<uint8_t> > compressed( h.level_count );
+    uint64_t offset = sizeof( h ) + path.size();
+
+    for( uint32_t c = 0; c < h.level_count; ++c )
+    {
+      if( format == TEXTURE_CACHE_BC3 )
+      {
+        texture_compress_bc3( img.mips[c], compressed[c] );
+      }
+
+      offset = ( offset + 15 ) & ~15ULL;
+      h.levels[c].w = img.mips[c].w;
+      h.levels[c].h = img.mips[c].h;
+      h.levels[c].offset = offset;
+      h.levels[c].size = format == TEXTURE_CACHE_BC3 ? compressed[c].size() : img.mips[c].pixels.size();
+      offset += h.levels[c].size;
+    }
+
+    //written next to it first, so a failed write never leaves a broken entry
+    std::string tmp = filename + ".tmp";
+
+    {
+      std::ofstream f( tmp, std::ios::binary | std::ios::trunc );
+
+      if( !f.is_open() )
+      {
+        std::cerr << "Texture cache: couldn't write " << tmp << std::endl;
+        return false;
+      }
+
+      f.write( ( const char* )&h, sizeof( h ) );
+      f.write( path.data(), path.size() );
+
+      for( uint32_t c = 0; c < h.level_count; ++c )
+      {
+        static const char zero[16] = {};
+        f.write( zero, h.levels[c].offset - f.tellp() );
+
+        auto& level = format == TEXTURE_CACHE_BC3 ? compressed[c] : img.mips[c].pixels;
+        f.write( ( const char* )&level[0], level.size() );
+      }
+
+      if( !f )
+      {
+        std::cerr << "Texture cache: couldn't write " << tmp << std::endl;
+        return false;
+      }
+    }
+
+    std::remove( filename.c_str() );
+
+    if( std::rename( tmp.c_str(), filename.c_str() ) != 0 )
+    {
+      std::cerr << "Texture cache: couldn't write " << filename << std::endl;
+      return false;
+    }
+
+    return true;
+  }
+
+public:
+  //compress: BC3 entries for load(), if the context supports them
+  explicit texture_cache( const std::string& directory, bool compress = false ) : dir( directory ), compress( compress )
+  {
+    if( !dir.empty() && dir.back() != '/' && dir.back() != '\\' )
+    {
+      dir += '/';
+    }
+
+#ifdef _WIN32
+    _mkdir( dir.c_str() );
+#else
+    mkdir( dir.c_str(), 0755 );
+#endif
+  }
+
+  //maps the entry of path, builds it first if it's missing or out of date
+  bool acquire( const std::string& path, uint32_t format, texture_cache_entry& e )
+  {
+    struct stat st;
+
+    if( stat( path.c_str(), &st ) != 0 )
+    {
+      std::cerr << "Couldn't load texture: " << path << std::endl;
+      return false;
+    }
+
+    std::string filename = get_filename( path, format );
+
+    if( e.open( filename ) && matches( e, path, st, format ) )
+      return true;
+
+    e.close();
+
+    return build( path, st, format, filename ) && e.open( filename ) && matches( e, path, st, format );
+  }
+
+  //a mipmapped texture w/ the same settings as framework::load_image(), 0 if it fails
+  GLuint load( const std::string& path )
+  {
+    uint32_t format = compress && GLEW_EXT_texture_compression_s3tc ? TEXTURE_CACHE_BC3 : TEXTURE_CACHE_RGBA8;
+    texture_cache_entry e;
+
+    if( !acquire( path, format, e ) )
+      return 0;
+
+    GLuint tex = 0;
+    glGenTextures( 1, &tex );
+    glBindTexture( GL_TEXTURE_2D, tex );
+    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT );
+    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT );
+    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR );
+    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR );
+    e.upload();
+
+    return tex;
+  }
+};
+
+//the cache the framework's loaders use, 0 if none
+inline texture_cache*& texture_cache_current()
+{
+  static texture_cache* cache = 0;
+  return cache;
+}
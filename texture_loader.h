@@ -0,0 +1,480 @@
+#pragma once
+
+#include <GL/glew.h>
+#include <SFML/Graphics/Image.hpp>
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <deque>
+#include <vector>
+#include <string>
+#include <iostream>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <emmintrin.h>
+
+#include "mpsc_queue.h"
+
+/*
+ * Asynchronous texture loading
+ *
+ * load() returns a texture name right away, with a transparent 1x1
+ * placeholder in it. Decoding, conversion and the mip chain are done on
+ * worker threads, the GL thread only uploads the finished images in
+ * update(), through a pixel unpack buffer:
+ *
+ *   texture_loader textures;
+ *   GLuint tex = textures.load( "smoke.png" );
+ *   ...
+ *   //every frame, on the GL thread
+ *   textures.update();
+ *
+ * update() stops after max_bytes, so a burst of loads is spread over frames
+ * instead of stalling one. finish() waits for everything.
+ *
+ * Anything else that needs the pixels can get them from the loader instead of
+ * decoding the file again, the callback is called by update() w/ the decoded
+ * image, right before the upload:
+ *
+ *   textures.load( "smoke.png", TEXTURE_LOAD_MIPMAPS, [&]( GLuint tex, const texture_image& img ) { ... } );
+ */
+
+enum texture_load_flags
+{
+  TEXTURE_LOAD_MIPMAPS = 1 << 0,
+  TEXTURE_LOAD_PREMULTIPLY = 1 << 1 //rgb * alpha, eg. for additive and alpha blended particles in one pass
+};
+
+struct texture_mip
+{
+  int w, h;
+  std::vector<uint8_t> pixels; //RGBA8
+};
+
+struct texture_image
+{
+  std::vector<texture_mip> mips;
+};
+
+typedef std::function<void( GLuint, const texture_image& )> texture_ready_func;
+
+//2x2 box filter, the result is the rounded average, odd sizes drop the last row / column except at size 1
+inline void texture_downsample( const texture_mip& src, texture_mip& dst )
+{
+  dst.w = std::max( src.w / 2, 1 );
+  dst.h = std::max( src.h / 2, 1 );
+  dst.pixels.resize( dst.w * dst.h * 4 );
+
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i two = _mm_set1_epi16( 2 );
+
+  for( int y = 0; y < dst.h; ++y )
+  {
+    const uint8_t* r0 = &src.pixels[( y * 2 ) * src.w * 4];
+    const uint8_t* r1 = &src.pixels[std::min( y * 2 + 1, src.h - 1 ) * src.w * 4];
+    uint8_t* out = &dst.pixels[y * dst.w * 4];
+
+    int x = 0;
+
+    //4 texels out of 8 x 2, in 16 bit lanes
+    for( ; ( x + 4 ) * 2 <= src.w; x += 4 )
+    {
+      __m128i a0 = _mm_loadu_si128( ( const __m128i* )( r0 + x * 8 ) );
+      __m128i a1 = _mm_loadu_si128( ( const __m128i* )( r0 + x * 8 + 16 ) );
+      __m128i b0 = _mm_loadu_si128( ( const __m128i* )( r1 + x * 8 ) );
+      __m128i b1 = _mm_loadu_si128( ( const __m128i* )( r1 + x * 8 + 16 ) );
+
+      //vertical sums, 2 texels per register
+      __m128i s0 = _mm_add_epi16( _mm_unpacklo_epi8( a0, zero ), _mm_unpacklo_epi8( b0, zero ) );
+      __m128i s1 = _mm_add_epi16( _mm_unpackhi_epi8( a0, zero ), _mm_unpackhi_epi8( b0, zero ) );
+      __m128i s2 = _mm_add_epi16( _mm_unpacklo_epi8( a1, zero ), _mm_unpacklo_epi8( b1, zero ) );
+      __m128i s3 = _mm_add_epi16( _mm_unpackhi_epi8( a1, zero ), _mm_unpackhi_epi8( b1, zero ) );
+
+      //horizontal pairs
+      s0 = _mm_add_epi16( s0, _mm_srli_si128( s0, 8 ) );
+      s1 = _mm_add_epi16( s1, _mm_srli_si128( s1, 8 ) );
+      s2 = _mm_add_epi16( s2, _mm_srli_si128( s2, 8 ) );
+      s3 = _mm_add_epi16( s3, _mm_srli_si128( s3, 8 ) );
+
+      __m128i d01 = _mm_srli_epi16( _mm_add_epi16( _mm_unpacklo_epi64( s0, s1 ), two ), 2 );
+      __m128i d23 = _mm_srli_epi16( _mm_add_epi16( _mm_unpacklo_epi64( s2, s3 ), two ), 2 );
+
+      _mm_storeu_si128( ( __m128i* )( out + x * 4 ), _mm_packus_epi16( d01, d23 ) );
+    }
+
+    for( ; x < dst.w; ++x )
+    {
+      int x0 = x * 2;
+      int x1 = std::min( x * 2 + 1, src.w - 1 );
+
+      for( int c = 0; c < 4; ++c )
+      {
+        out[x * 4 + c] = ( r0[x0 * 4 + c] + r0[x1 * 4 + c] + r1[x0 * 4 + c] + r1[x1 * 4 + c] + 2 ) >> 2;
+      }
+    }
+  }
+}
+
+//true if any of the count RGBA8 texels has alpha below 255, 16 texels a step
+inline bool texture_is_transparent( const uint8_t* rgba, size_t count )
+{
+  const __m128i alpha = _mm_set1_epi32( 0xff000000 );
+
+  size_t c = 0;
+
+  for( ; c + 16 <= count; c += 16 )
+  {
+    const __m128i* p = ( const __m128i* )( rgba + c * 4 );
+
+    //all alpha bytes are 255 only if and-ing them keeps every one of them
+    __m128i a = _mm_and_si128( _mm_and_si128( _mm_loadu_si128( p ), _mm_loadu_si128( p + 1 ) ),
+                               _mm_and_si128( _mm_loadu_si128( p + 2 ), _mm_loadu_si128( p + 3 ) ) );
+
+    if( _mm_movemask_epi8( _mm_cmpeq_epi32( _mm_and_si128( a, alpha ), alpha ) ) != 0xffff )
+    {
+      return true;
+    }
+  }
+
+  for( ; c < count; ++c )
+  {
+    if( rgba[c * 4 + 3] < 255 )
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+inline void texture_premultiply( texture_mip& m )
+{
+  for( size_t c = 0; c < m.pixels.size(); c += 4 )
+  {
+    unsigned a = m.pixels[c + 3];
+    m.pixels[c + 0] = ( m.pixels[c + 0] * a + 127 ) / 255;
+    m.pixels[c + 1] = ( m.pixels[c + 1] * a + 127 ) / 255;
+    m.pixels[c + 2] = ( m.pixels[c + 2] * a + 127 ) / 255;
+  }
+}
+
+//every level down to 1x1
+inline void texture_build_mips( texture_image& img )
+{
+  img.mips.resize( 1 );
+
+  while( img.mips.back().w > 1 || img.mips.back().h > 1 )
+  {
+    texture_mip next;
+    texture_downsample( img.mips.back(), next );
+    img.mips.push_back( std::move( next ) );
+  }
+}
+
+//decode and conversion, safe to call from any thread
+inline bool texture_decode( const std::string& path, uint32_t flags, texture_image& img )
+{
+  sf::Image im;
+
+  if( !im.loadFromFile( path ) )
+  {
+    std::cerr << "Couldn't load texture: " << path << std::endl;
+    return false;
+  }
+
+  img.mips.resize( 1 );
+  auto& m = img.mips[0];
+  m.w = im.getSize().x;
+  m.h = im.getSize().y;
+  m.pixels.assign( im.getPixelsPtr(), im.getPixelsPtr() + m.w * m.h * 4 );
+
+  if( m.pixels.empty() )
+  {
+    std::cerr << "Empty texture: " << path << std::endl;
+    return false;
+  }
+
+  if( flags & TEXTURE_LOAD_PREMULTIPLY )
+  {
+    texture_premultiply( m );
+  }
+
+  if( flags & TEXTURE_LOAD_MIPMAPS )
+  {
+    texture_build_mips( img );
+  }
+
+  return true;
+}
+
+class texture_loader
+{
+  struct job
+  {
+    GLuint tex;
+    std::string path;
+    uint32_t flags;
+    texture_ready_func on_ready;
+  };
+
+  struct result
+  {
+    GLuint tex;
+    texture_image* img; //0 if it failed
+    texture_ready_func on_ready;
+  };
+
+  std::vector<std::thread> threads;
+  std::mutex m;
+  std::condition_variable cv;
+  std::deque<job> jobs;
+  std::atomic<bool> quit;
+
+  mpsc_queue<result> done;
+  std::deque<result> ready; //popped, waiting for the upload budget
+  std::atomic<int> pending;
+
+  GLuint pbo;
+
+  void worker()
+  {
+    while( true )
+    {
+      job j;
+
+      {
+        std::unique_lock<std::mutex> lock( m );
+        cv.wait( lock, [&] { return quit || !jobs.empty(); } );
+
+        if( quit )
+        {
+          return;
+        }
+
+        j = jobs.front();
+        jobs.pop_front();
+      }
+
+      result r;
+      r.tex = j.tex;
+      r.img = new texture_image();
+      r.on_ready = j.on_ready;
+
+      if( !texture_decode( j.path, j.flags, *r.img ) )
+      {
+        delete r.img;
+        r.img = 0;
+      }
+
+      //the queue is full until update() drains it, nobody will after quit
+      while( !done.push( r ) )
+      {
+        if( quit )
+        {
+          delete r.img;
+          return;
+        }
+
+        std::this_thread::yield();
+      }
+    }
+  }
+
+  void upload( const result& r )
+  {
+    auto& mips = r.img->mips;
+
+    size_t total = 0;
+
+    for( auto& l : mips )
+    {
+      total += l.pixels.size();
+    }
+
+    if( !pbo )
+    {
+      glGenBuffers( 1, &pbo );
+    }
+
+    //new storage every time, so the driver doesn't wait for the previous upload to finish reading
+    glBindBuffer( GL_PIXEL_UNPACK_BUFFER, pbo );
+    glBufferData( GL_PIXEL_UNPACK_BUFFER, total, 0, GL_STREAM_DRAW );
+    uint8_t* staging = ( uint8_t* )glMapBufferRange( GL_PIXEL_UNPACK_BUFFER, 0, total, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT );
+
+    if( staging )
+    {
+      size_t offset = 0;
+
+      for( auto& l : mips )
+      {
+        memcpy( staging + offset, &l.pixels[0], l.pixels.size() );
+        offset += l.pixels.size();
+      }
+
+      glUnmapBuffer( GL_PIXEL_UNPACK_BUFFER );
+    }
+    else
+    {
+      //mapping failed, straight from memory
+      glBindBuffer( GL_PIXEL_UNPACK_BUFFER, 0 );
+    }
+
+    glBindTexture( GL_TEXTURE_2D, r.tex );
+    glPixelStorei( GL_UNPACK_ALIGNMENT, 4 );
+    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, mips.size() > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR );
+    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, mips.size() - 1 );
+
+    size_t offset = 0;
+
+    for( int c = 0; c < mips.size(); ++c )
+    {
+      const GLvoid* data = staging ? ( const GLvoid* )offset : ( const GLvoid* )&mips[c].pixels[0];
+      glTexImage2D( GL_TEXTURE_2D, c, GL_RGBA8, mips[c].w, mips[c].h, 0, GL_RGBA, GL_UNSIGNED_BYTE, data );
+      offset += mips[c].pixels.size();
+    }
+
+    glBindBuffer( GL_PIXEL_UNPACK_BUFFER, 0 );
+  }
+
+  texture_loader( const texture_loader& );
+  texture_loader& operator=( const texture_loader& );
+
+public:
+  explicit texture_loader( int thread_count = std::max( ( int )std::thread::hardware_concurrency() - 1, 1 ) ) : quit( false ), done( 256 ), pending( 0 ), pbo( 0 )
+  {
+    for( int c = 0; c < thread_count; ++c )
+    {
+      threads.push_back( std::thread( [this] { worker(); } ) );
+    }
+  }
+
+  //needs the GL context for the buffer
+  ~texture_loader()
+  {
+    {
+      std::lock_guard<std::mutex> lock( m );
+      quit = true;
+    }
+
+    cv.notify_all();
+
+    for( auto& t : threads )
+    {
+      t.join();
+    }
+
+    result r;
+
+    while( done.pop( r ) )
+    {
+      ready.push_back( r );
+    }
+
+    for( auto& r : ready )
+    {
+      delete r.img;
+    }
+
+    if( pbo )
+    {
+      glDeleteBuffers( 1, &pbo );
+    }
+  }
+
+  //GL thread, the texture is usable right away, the image arrives later
+  GLuint load( const std::string& path, uint32_t flags = TEXTURE_LOAD_MIPMAPS, const texture_ready_func& on_ready = texture_ready_func() )
+  {
+    static const uint8_t placeholder[4] = { 255, 255, 255, 0 };
+
+    GLuint tex = 0;
+    glGenTextures( 1, &tex );
+    glBindTexture( GL_TEXTURE_2D, tex );
+    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT );
+    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT );
+    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR );
+    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR );
+    glTexImage2D( GL_TEXTURE_2D, 0, GL_RGBA8, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, placeholder );
+
+    job j;
+    j.tex = tex;
+    j.path = path;
+    j.flags = flags;
+    j.on_ready = on_ready;
+
+    ++pending;
+
+    {
+      std::lock_guard<std::mutex> lock( m );
+      jobs.push_back( j );
+    }
+
+    cv.notify_one();
+
+    return tex;
+  }
+
+  //GL thread, uploads the finished images until max_bytes, at least one
+  //returns the number of textures uploaded
+  int update( size_t max_bytes = 16 * 1024 * 1024 )
+  {
+    result r;
+
+    while( done.pop( r ) )
+    {
+      ready.push_back( r );
+    }
+
+    int count = 0;
+    size_t bytes = 0;
+
+    while( !ready.empty() && ( count == 0 || bytes < max_bytes ) )
+    {
+      r = ready.front();
+      ready.pop_front();
+
+      if( r.img )
+      {
+        if( r.on_ready )
+        {
+          r.on_ready( r.tex, *r.img );
+        }
+
+        upload( r );
+
+        for( auto& l : r.img->mips )
+        {
+          bytes += l.pixels.size();
+        }
+
+        delete r.img;
+        ++count;
+      }
+
+      --pending;
+    }
+
+    return count;
+  }
+
+  //GL thread, blocks until every texture is uploaded
+  void finish()
+  {
+    while( pending > 0 )
+    {
+      if( !update( ~size_t( 0 ) ) )
+      {
+        std::this_thread::yield();
+      }
+    }
+  }
+
+  //textures not uploaded yet
+  int get_pending() const
+  {
+    return pending;
+  }
+};
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <vector>
+#include <algorithm>
+
+//persistent worker threads for data parallel loops
+//the calling thread takes part in the work, so a pool of n threads uses n + 1 cores
+class thread_pool
+{
+  std::vector<std::thread> threads;
+  std::mutex m;
+  std::condition_variable start_cv, done_cv;
+
+  const std::function<void( int, int )>* job; //job( begin, end )
+  int job_count;
+  int job_grain;
+  std::atomic<int> next;
+  int working; //threads still working on the current job
+  unsigned generation; //incremented on every job, the workers wait for a change
+  bool quit;
+
+  void run_chunks()
+  {
+    while( true )
+    {
+      int begin = next.fetch_add( job_grain );
+
+      if( begin >= job_count )
+      {
+        break;
+      }
+
+      ( *job )( begin, std::min( begin + job_grain, job_count ) );
+    }
+  }
+
+  void worker()
+  {
+    unsigned seen = 0;
+
+    while( true )
+    {
+      {
+        std::unique_lock<std::mutex> lock( m );
+        start_cv.wait( lock, [&] { return quit || generation != seen; } );
+
+        if( quit )
+        {
+          return;
+        }
+
+        seen = generation;
+      }
+
+      run_chunks();
+
+      {
+        std::lock_guard<std::mutex> lock( m );
+        if( --working == 0 )
+        {
+          done_cv.notify_one();
+        }
+      }
+    }
+  }
+
+  thread_pool( const thread_pool& );
+  thread_pool& operator=( const thread_pool& );
+
+public:
+  thread_pool() : job( 0 ), job_count( 0 ), job_grain( 1 ), next( 0 ), working( 0 ), generation( 0 ), quit( false )
+  {
+  }
+
+  ~thread_pool()
+  {
+    set_threads( 0 );
+  }
+
+  //number of worker threads besides the calling one
+  void set_threads( int n )
+  {
+    {
+      std::lock_guard<std::mutex> lock( m );
+      quit = true;
+    }
+
+    start_cv.notify_all();
+
+    for( auto& t : threads )
+    {
+      t.join();
+    }
+
+    threads.clear();
+    quit = false;
+    generation = 0;
+
+    for( int c = 0; c < n; ++c )
+    {
+      threads.push_back( std::thread( [this] { worker(); } ) );
+    }
+  }
+
+  int get_threads() const
+  {
+    return threads.size();
+  }
+
+  //calls f( begin, end ) on ranges of [0...count) of at most grain elements, in parallel
+  //returns when all of them are done
+  void parallel_for( int count, int grain, const std::function<void( int, int )>& f )
+  {
+    if( count <= 0 )
+    {
+      return;
+    }
+
+    grain = std::max( grain, 1 );
+
+    if( threads.empty() || count <= grain )
+    {
+      f( 0, count );
+      return;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock( m );
+      job = &f;
+      job_count = count;
+      job_grain = grain;
+      next = 0;
+      working = threads.size();
+      ++generation;
+    }
+
+    start_cv.notify_all();
+
+    run_chunks();
+
+    std::unique_lock<std::mutex> lock( m );
+    done_cv.wait( lock, [&] { return working == 0; } );
+    job = 0;
+  }
+};